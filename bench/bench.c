@@ -0,0 +1,560 @@
+/*
+ * Benchmarks of workerpool
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2016 Mervin <mofei2816@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include "workerpool.h"
+#include "taskgroup.h"
+
+#define DEFAULT_TASKS       200000
+#define LATENCY_TASKS       20000
+#define STEADY_GAP          10000       /* ns between steady submits */
+#define BURST_SIZE          1000
+#define FORK_FANOUT         8
+#define FORK_DEPTH          4
+#define BENCH_BUFFER        1024
+#define BENCH_SHARDS        8
+#define MAX_RESULTS         1024
+
+/*
+ * Pool configurations under test. The baseline is a naive pthread pool
+ * with one mutex protected list and one condition.
+ */
+typedef enum bench_config_e {
+    CONFIG_FIFO_LIST,
+    CONFIG_FIFO_RING,
+    CONFIG_STEALING,
+    CONFIG_SPIN,
+    CONFIG_SHARDED,
+    CONFIG_PTHREAD,
+    CONFIG_COUNT
+} bench_config_t;
+
+static const char *config_names[CONFIG_COUNT] = {
+    "fifo-list", "fifo-ring", "stealing", "spin", "sharded", "pthread"
+};
+
+typedef struct basetask_s {
+    void (*func)(void*);
+    void *arg;
+    struct basetask_s *next;
+} basetask_t; // task of baseline pool
+
+typedef struct basepool_s {
+    pthread_mutex_t mutex;
+    pthread_cond_t notify;
+    basetask_t *head, *tail;
+    int stop;
+    uint count;
+    pthread_t *threads;
+} basepool_t; // baseline pthread pool
+
+typedef struct benchpool_s {
+    bench_config_t config;
+    workerpool_t *pool;
+    basepool_t *base;
+} benchpool_t; // pool under test
+
+typedef struct benchresult_s {
+    const char *bench;
+    const char *config;
+    uint producers;
+    uint workers;
+    uint64_t tasks;
+    double seconds;
+    double rate;            /* tasks per second */
+    uint64_t p50, p90, p99, p999;   /* latency in ns, 0 when not measured */
+} benchresult_t; // one row of output
+
+typedef struct producer_s {
+    benchpool_t *bench;
+    uint64_t tasks;
+    pthread_t thread;
+} producer_t; // producer thread of sweep
+
+typedef struct forknode_s {
+    workerpool_t *pool;
+    int depth;
+} forknode_t; // node of fork-join tree
+
+static uint64_t bench_clock();
+static void bench_open(benchpool_t * __restrict, bench_config_t, uint);
+static void bench_put(benchpool_t * __restrict, void (*)(void*), void *);
+static void bench_close(benchpool_t * __restrict);
+static void bench_wait(uint64_t);
+static void basepool_init(basepool_t * __restrict, uint);
+static void basepool_put(basepool_t * __restrict, void (*)(void*), void *);
+static void* basepool_worker(void *);
+static void basepool_destroy(basepool_t * __restrict);
+static void empty_func(void *);
+static void latency_func(void *);
+static void* producer_func(void *);
+static void fork_func(void *);
+static int  compare_u64(const void *, const void *);
+static void bench_throughput(uint, uint64_t);
+static void bench_latency(uint, int);
+static void bench_sweep(uint, uint, uint64_t);
+static void bench_fork_join(uint);
+static void result_add(const char *, bench_config_t, uint, uint, uint64_t, double, const uint64_t *, size_t);
+static void result_print(FILE * __restrict, int);
+
+static atomic_ullong done_counter;
+static uint64_t *latency_submit;
+static uint64_t *latency_start;
+static benchresult_t results[MAX_RESULTS];
+static int result_count;
+
+int main(int argc, char *argv[]) {
+    
+    int json = 0;
+    uint64_t tasks = DEFAULT_TASKS;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    uint max_producers = cpus > 2 ? (uint)cpus : 2;
+    uint max_workers = max_producers;
+    FILE *out = stdout;
+    
+    int opt;
+    while ((opt = getopt(argc, argv, "f:n:p:w:o:")) != -1) {
+        switch (opt) {
+            case 'f':
+                json = strcmp(optarg, "json") == 0;
+                break;
+            case 'n':
+                tasks = strtoull(optarg, NULL, 10);
+                break;
+            case 'p':
+                max_producers = (uint)atoi(optarg);
+                break;
+            case 'w':
+                max_workers = (uint)atoi(optarg);
+                break;
+            case 'o':
+                out = fopen(optarg, "w");
+                if (out == NULL) {
+                    perror(optarg);
+                    return 1;
+                }
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-f csv|json] [-n tasks] [-p producers] [-w workers] [-o file]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (tasks == 0 || max_producers == 0 || max_workers == 0) {
+        fprintf(stderr, "tasks, producers and workers must be positive\n");
+        return 1;
+    }
+    
+    latency_submit = (uint64_t*)malloc(sizeof(uint64_t) * LATENCY_TASKS);
+    latency_start = (uint64_t*)malloc(sizeof(uint64_t) * LATENCY_TASKS);
+    
+    fprintf(stderr, "throughput\n");
+    bench_throughput(max_workers, tasks);
+    fprintf(stderr, "latency\n");
+    bench_latency(max_workers, 0);
+    bench_latency(max_workers, 1);
+    fprintf(stderr, "sweep\n");
+    bench_sweep(max_producers, max_workers, tasks);
+    fprintf(stderr, "fork-join\n");
+    bench_fork_join(max_workers);
+    
+    result_print(out, json);
+    if (out != stdout) {
+        fclose(out);
+    }
+    free(latency_submit);
+    free(latency_start);
+    return 0;
+}
+
+/*
+ * Empty tasks put by one producer, time until all have run.
+ */
+static void bench_throughput(uint workers, uint64_t tasks) {
+    
+    for (int config = 0; config < CONFIG_COUNT; config++) {
+        benchpool_t bench;
+        bench_open(&bench, (bench_config_t)config, workers);
+        atomic_store(&done_counter, 0);
+        uint64_t start = bench_clock();
+        for (uint64_t i = 0; i < tasks; i++) {
+            bench_put(&bench, empty_func, NULL);
+        }
+        bench_wait(tasks);
+        double seconds = (double)(bench_clock() - start) / 1e9;
+        bench_close(&bench);
+        result_add("throughput", (bench_config_t)config, 1, workers, tasks, seconds, NULL, 0);
+    }
+}
+
+/*
+ * Submit to start latency percentiles.
+ * Steady arrival puts a task every STEADY_GAP, so workers mostly park
+ * and wake in between. Burst arrival puts BURST_SIZE tasks at once and
+ * lets the pool drain before the next burst.
+ */
+static void bench_latency(uint workers, int burst) {
+    
+    for (int config = 0; config < CONFIG_COUNT; config++) {
+        benchpool_t bench;
+        bench_open(&bench, (bench_config_t)config, workers);
+        atomic_store(&done_counter, 0);
+        uint64_t start = bench_clock();
+        uint64_t next = start;
+        for (uint64_t i = 0; i < LATENCY_TASKS; i++) {
+            if (burst && i % BURST_SIZE == 0 && i > 0) {
+                bench_wait(i);
+            } else if (!burst) {
+                while (bench_clock() < next) {
+                    sched_yield();
+                }
+                next += STEADY_GAP;
+            }
+            latency_submit[i] = bench_clock();
+            bench_put(&bench, latency_func, (void*)(uintptr_t)i);
+        }
+        bench_wait(LATENCY_TASKS);
+        double seconds = (double)(bench_clock() - start) / 1e9;
+        bench_close(&bench);
+        
+        for (uint64_t i = 0; i < LATENCY_TASKS; i++) {
+            latency_start[i] = latency_start[i] > latency_submit[i] ? latency_start[i] - latency_submit[i] : 0;
+        }
+        qsort(latency_start, LATENCY_TASKS, sizeof(uint64_t), compare_u64);
+        result_add(burst ? "latency-burst" : "latency-steady", (bench_config_t)config, 1, workers,
+                   LATENCY_TASKS, seconds, latency_start, LATENCY_TASKS);
+    }
+}
+
+/*
+ * Producer and consumer ratio sweep over powers of two.
+ */
+static void bench_sweep(uint max_producers, uint max_workers, uint64_t tasks) {
+    
+    for (int config = 0; config < CONFIG_COUNT; config++) {
+        for (uint producers = 1; producers <= max_producers; producers *= 2) {
+            for (uint workers = 1; workers <= max_workers; workers *= 2) {
+                benchpool_t bench;
+                bench_open(&bench, (bench_config_t)config, workers);
+                atomic_store(&done_counter, 0);
+                producer_t *threads = (producer_t*)malloc(sizeof(producer_t) * producers);
+                uint64_t start = bench_clock();
+                for (uint i = 0; i < producers; i++) {
+                    threads[i].bench = &bench;
+                    threads[i].tasks = tasks / producers + (i < tasks % producers ? 1 : 0);
+                    pthread_create(&threads[i].thread, NULL, producer_func, threads + i);
+                }
+                for (uint i = 0; i < producers; i++) {
+                    pthread_join(threads[i].thread, NULL);
+                }
+                bench_wait(tasks);
+                double seconds = (double)(bench_clock() - start) / 1e9;
+                free(threads);
+                bench_close(&bench);
+                result_add("sweep", (bench_config_t)config, producers, workers, tasks, seconds, NULL, 0);
+            }
+        }
+    }
+}
+
+/*
+ * Fork-join tree of FORK_FANOUT children per task and FORK_DEPTH levels,
+ * every parent waits for its children with a task group. The baseline has
+ * no way to help while waiting and would deadlock, so it is left out.
+ */
+static void bench_fork_join(uint workers) {
+    
+    uint64_t tasks = 0;
+    for (uint64_t level = 1, i = 0; i <= FORK_DEPTH; i++, level *= FORK_FANOUT) {
+        tasks += level;
+    }
+    for (int config = 0; config < CONFIG_PTHREAD; config++) {
+        benchpool_t bench;
+        bench_open(&bench, (bench_config_t)config, workers);
+        atomic_store(&done_counter, 0);
+        forknode_t root = { .pool = bench.pool, .depth = FORK_DEPTH };
+        uint64_t start = bench_clock();
+        bench_put(&bench, fork_func, &root);
+        bench_wait(tasks);
+        double seconds = (double)(bench_clock() - start) / 1e9;
+        bench_close(&bench);
+        result_add("fork-join", (bench_config_t)config, 1, workers, tasks, seconds, NULL, 0);
+    }
+}
+
+static uint64_t bench_clock() {
+    
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static void bench_open(benchpool_t *bench, bench_config_t config, uint workers) {
+    
+    bench->config = config;
+    bench->pool = NULL;
+    bench->base = NULL;
+    if (config == CONFIG_PTHREAD) {
+        bench->base = (basepool_t*)malloc(sizeof(basepool_t));
+        basepool_init(bench->base, workers);
+        return;
+    }
+    
+    workerpool_options_t options;
+    workerpool_options_init(&options);
+    options.poolsize = workers;
+    options.buffersize = BENCH_BUFFER;
+    if (config == CONFIG_FIFO_RING) {
+        options.queue = QUEUE_RING;
+    } else if (config == CONFIG_STEALING) {
+        options.schedule = SCHEDULE_STEALING;
+    } else if (config == CONFIG_SPIN) {
+        options.idle = IDLE_SPIN;
+    } else if (config == CONFIG_SHARDED) {
+        options.queue = QUEUE_RING;
+        options.shards = BENCH_SHARDS;
+    }
+    bench->pool = workerpool_new();
+    workerpool_init_options(bench->pool, &options);
+    workerpool_start(bench->pool);
+}
+
+static void bench_put(benchpool_t *bench, void (*func)(void*), void *arg) {
+    
+    // A task lost would leave bench_wait waiting forever.
+    if (bench->base != NULL) {
+        basepool_put(bench->base, func, arg);
+    } else if (workerpool_task_put(bench->pool, func, arg) == -1) {
+        fprintf(stderr, "put failed: %s\n", strerror(errno));
+        abort();
+    }
+}
+
+static void bench_close(benchpool_t *bench) {
+    
+    if (bench->base != NULL) {
+        basepool_destroy(bench->base);
+    } else {
+        workerpool_destroy(bench->pool);
+    }
+}
+
+/*
+ * Wait until n tasks have finished.
+ */
+static void bench_wait(uint64_t n) {
+    
+    while (atomic_load_explicit(&done_counter, memory_order_acquire) < n) {
+        sched_yield();
+    }
+}
+
+static void basepool_init(basepool_t *base, uint count) {
+    
+    pthread_mutex_init(&base->mutex, NULL);
+    pthread_cond_init(&base->notify, NULL);
+    base->head = NULL;
+    base->tail = NULL;
+    base->stop = 0;
+    base->count = count;
+    base->threads = (pthread_t*)malloc(sizeof(pthread_t) * count);
+    for (uint i = 0; i < count; i++) {
+        pthread_create(base->threads + i, NULL, basepool_worker, base);
+    }
+}
+
+static void basepool_put(basepool_t *base, void (*func)(void*), void *arg) {
+    
+    basetask_t *task = (basetask_t*)malloc(sizeof(basetask_t));
+    if (task == NULL) {
+        fprintf(stderr, "put failed: %s\n", strerror(errno));
+        abort();
+    }
+    task->func = func;
+    task->arg = arg;
+    task->next = NULL;
+    pthread_mutex_lock(&base->mutex);
+    if (base->tail != NULL) {
+        base->tail->next = task;
+    } else {
+        base->head = task;
+    }
+    base->tail = task;
+    pthread_cond_signal(&base->notify);
+    pthread_mutex_unlock(&base->mutex);
+}
+
+static void* basepool_worker(void *arg) {
+    
+    basepool_t *base = (basepool_t*)arg;
+    while (1) {
+        pthread_mutex_lock(&base->mutex);
+        while (base->head == NULL && !base->stop) {
+            pthread_cond_wait(&base->notify, &base->mutex);
+        }
+        basetask_t *task = base->head;
+        if (task == NULL) {
+            pthread_mutex_unlock(&base->mutex);
+            return NULL;
+        }
+        base->head = task->next;
+        if (base->head == NULL) {
+            base->tail = NULL;
+        }
+        pthread_mutex_unlock(&base->mutex);
+        task->func(task->arg);
+        free(task);
+    }
+}
+
+static void basepool_destroy(basepool_t *base) {
+    
+    pthread_mutex_lock(&base->mutex);
+    base->stop = 1;
+    pthread_cond_broadcast(&base->notify);
+    pthread_mutex_unlock(&base->mutex);
+    for (uint i = 0; i < base->count; i++) {
+        pthread_join(base->threads[i], NULL);
+    }
+    pthread_mutex_destroy(&base->mutex);
+    pthread_cond_destroy(&base->notify);
+    free(base->threads);
+    free(base);
+}
+
+static void empty_func(void *arg) {
+    (void)arg;
+    atomic_fetch_add_explicit(&done_counter, 1, memory_order_release);
+}
+
+static void latency_func(void *arg) {
+    latency_start[(uintptr_t)arg] = bench_clock();
+    atomic_fetch_add_explicit(&done_counter, 1, memory_order_release);
+}
+
+static void* producer_func(void *arg) {
+    producer_t *producer = (producer_t*)arg;
+    for (uint64_t i = 0; i < producer->tasks; i++) {
+        bench_put(producer->bench, empty_func, NULL);
+    }
+    return NULL;
+}
+
+static void fork_func(void *arg) {
+    forknode_t *node = (forknode_t*)arg;
+    if (node->depth > 0) {
+        forknode_t children[FORK_FANOUT];
+        taskgroup_t *group = taskgroup_new();
+        taskgroup_init(group);
+        for (int i = 0; i < FORK_FANOUT; i++) {
+            children[i].pool = node->pool;
+            children[i].depth = node->depth - 1;
+            if (workerpool_group_put(node->pool, group, fork_func, children + i) == -1) {
+                fprintf(stderr, "put failed: %s\n", strerror(errno));
+                abort();
+            }
+        }
+        taskgroup_wait(group);
+        taskgroup_destroy(group);
+    }
+    atomic_fetch_add_explicit(&done_counter, 1, memory_order_release);
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Store a result row, with latency percentiles from sorted samples.
+ */
+static void result_add(const char *name, bench_config_t config, uint producers, uint workers,
+                       uint64_t tasks, double seconds, const uint64_t *sorted, size_t n) {
+    
+    if (result_count == MAX_RESULTS) {
+        return;
+    }
+    benchresult_t *result = results + result_count++;
+    memset(result, 0, sizeof(benchresult_t));
+    result->bench = name;
+    result->config = config_names[config];
+    result->producers = producers;
+    result->workers = workers;
+    result->tasks = tasks;
+    result->seconds = seconds;
+    result->rate = seconds > 0 ? (double)tasks / seconds : 0;
+    if (sorted != NULL && n > 0) {
+        result->p50 = sorted[n * 50 / 100];
+        result->p90 = sorted[n * 90 / 100];
+        result->p99 = sorted[n * 99 / 100];
+        result->p999 = sorted[n * 999 / 1000];
+    }
+}
+
+/*
+ * Print all results as CSV with header, or as a JSON array.
+ */
+static void result_print(FILE *out, int json) {
+    
+    if (json) {
+        fprintf(out, "[\n");
+    } else {
+        fprintf(out, "bench,config,producers,workers,tasks,seconds,tasks_per_sec,p50_ns,p90_ns,p99_ns,p999_ns\n");
+    }
+    for (int i = 0; i < result_count; i++) {
+        benchresult_t *r = results + i;
+        if (json) {
+            fprintf(out, "  {\"bench\":\"%s\",\"config\":\"%s\",\"producers\":%u,\"workers\":%u,"
+                    "\"tasks\":%llu,\"seconds\":%.6f,\"tasks_per_sec\":%.0f,"
+                    "\"p50_ns\":%llu,\"p90_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu}%s\n",
+                    r->bench, r->config, r->producers, r->workers,
+                    (unsigned long long)r->tasks, r->seconds, r->rate,
+                    (unsigned long long)r->p50, (unsigned long long)r->p90,
+                    (unsigned long long)r->p99, (unsigned long long)r->p999,
+                    i + 1 < result_count ? "," : "");
+        } else {
+            fprintf(out, "%s,%s,%u,%u,%llu,%.6f,%.0f,%llu,%llu,%llu,%llu\n",
+                    r->bench, r->config, r->producers, r->workers,
+                    (unsigned long long)r->tasks, r->seconds, r->rate,
+                    (unsigned long long)r->p50, (unsigned long long)r->p90,
+                    (unsigned long long)r->p99, (unsigned long long)r->p999);
+        }
+    }
+    if (json) {
+        fprintf(out, "]\n");
+    }
+}
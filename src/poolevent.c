@@ -0,0 +1,130 @@
+/*
+ * Event loop wakeup
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2016 Mervin <mofei2816@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#include "poolevent.h"
+
+poolevent_t* poolevent_new() {
+    return (poolevent_t*)malloc(sizeof(poolevent_t));
+}
+
+/*
+ * Init event with a non-blocking descriptor.
+ * Return 0 if success or -1.
+ */
+int poolevent_init(poolevent_t *event) {
+
+    if (event == NULL) {
+        return -1;
+    }
+    atomic_init(&event->signalled, 0);
+#ifdef __linux__
+    event->fds[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    event->fds[1] = event->fds[0];
+    return event->fds[0] < 0 ? -1 : 0;
+#else
+    if (pipe(event->fds) == -1) {
+        event->fds[0] = event->fds[1] = -1;
+        return -1;
+    }
+    for (int i = 0; i < 2; i++) {
+        fcntl(event->fds[i], F_SETFL, fcntl(event->fds[i], F_GETFL) | O_NONBLOCK);
+        fcntl(event->fds[i], F_SETFD, FD_CLOEXEC);
+    }
+    return 0;
+#endif
+}
+
+/*
+ * Return descriptor to poll for reading.
+ */
+int poolevent_fd(poolevent_t *event) {
+
+    return event != NULL ? event->fds[0] : -1;
+}
+
+/*
+ * Make the descriptor readable, unless it already is.
+ */
+void poolevent_signal(poolevent_t *event) {
+
+    if (atomic_exchange(&event->signalled, 1)) {
+        return;
+    }
+#ifdef __linux__
+    uint64_t one = 1;
+    ssize_t r = write(event->fds[1], &one, sizeof(one));
+#else
+    char one = 1;
+    ssize_t r = write(event->fds[1], &one, sizeof(one));
+#endif
+    (void)r;
+}
+
+/*
+ * Make the descriptor unreadable again. The event is cleared before the
+ * descriptor is read, and the descriptor is always read, so a write of a
+ * signal racing with us is drained now or by the next clear. Check for
+ * work only after clearing.
+ * Return 1 if the event was signalled or 0.
+ */
+int poolevent_clear(poolevent_t *event) {
+
+    int signalled = atomic_exchange(&event->signalled, 0);
+#ifdef __linux__
+    uint64_t count;
+    ssize_t r = read(event->fds[0], &count, sizeof(count));
+#else
+    char buffer[16];
+    ssize_t r, n;
+    for (r = 0; (n = read(event->fds[0], buffer, sizeof(buffer))) > 0; r += n) {
+    }
+#endif
+    return signalled || r > 0;
+}
+
+/*
+ * Destroy event and close its descriptors.
+ */
+void poolevent_destroy(poolevent_t *event) {
+
+    if (event == NULL) {
+        return;
+    }
+    if (event->fds[0] >= 0) {
+        close(event->fds[0]);
+    }
+    if (event->fds[1] >= 0 && event->fds[1] != event->fds[0]) {
+        close(event->fds[1]);
+    }
+    free(event);
+}
@@ -0,0 +1,54 @@
+/*
+ * Event loop wakeup
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2016 Mervin <mofei2816@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef POOLEVENT_H_
+#define POOLEVENT_H_
+
+#include <stdlib.h>
+#include <stdatomic.h>
+
+/* struct and types  */
+
+/*
+ * File descriptor an event loop can poll, made readable by any thread.
+ * An eventfd on Linux, a pipe elsewhere. Signals coalesce until the
+ * reader clears the event, so a burst costs one write.
+ */
+typedef struct poolevent_s {
+    int fds[2];                 /* read and write end, the same eventfd on Linux */
+    atomic_int signalled;       /* written and not cleared yet */
+} poolevent_t; // wakeup of an event loop
+
+/* poolevent functions */
+
+poolevent_t* poolevent_new();
+int  poolevent_init(poolevent_t * __restrict);
+int  poolevent_fd(poolevent_t * __restrict);
+void poolevent_signal(poolevent_t * __restrict);
+int  poolevent_clear(poolevent_t * __restrict);
+void poolevent_destroy(poolevent_t * __restrict);
+
+#endif /* POOLEVENT_H_ */
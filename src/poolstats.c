@@ -0,0 +1,129 @@
+/*
+ * Pool runtime statistics
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2016 Mervin <mofei2816@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "poolstats.h"
+
+/*
+ * Allocate a slot on its own cache lines, so counters of different
+ * threads never share a line.
+ */
+poolstats_t* poolstats_new() {
+
+    poolstats_t *stats = NULL;
+    size_t size = (sizeof(poolstats_t) + CACHE_LINE_SIZE - 1) & ~(size_t)(CACHE_LINE_SIZE - 1);
+    if (posix_memalign((void**)&stats, CACHE_LINE_SIZE, size) != 0) {
+        return (poolstats_t*)NULL;
+    }
+    return stats;
+}
+
+/*
+ * Reset all counters.
+ */
+void poolstats_init(poolstats_t *stats) {
+
+    if (stats == NULL) {
+        return;
+    }
+    atomic_init(&stats->tasks, 0);
+    atomic_init(&stats->steals, 0);
+    atomic_init(&stats->parks, 0);
+    atomic_init(&stats->wakeups, 0);
+    atomic_init(&stats->idle_ns, 0);
+    for (int i = 0; i < POOLSTATS_BUCKETS; i++) {
+        atomic_init(&stats->wait_hist[i], 0);
+        atomic_init(&stats->run_hist[i], 0);
+    }
+}
+
+/*
+ * Count value in its histogram bucket.
+ */
+void poolstats_record(atomic_ullong *hist, uint64_t value) {
+
+    atomic_fetch_add_explicit(hist + poolstats_bucket(value), 1, memory_order_relaxed);
+}
+
+/*
+ * Return histogram bucket of value.
+ * Values below 4 have a bucket each, then every power of two is split
+ * into 4 buckets, which keeps the relative error below 25%.
+ */
+uint poolstats_bucket(uint64_t value) {
+
+    if (value < (1 << POOLSTATS_SUB_BITS)) {
+        return (uint)value;
+    }
+    uint msb = 63 - (uint)__builtin_clzll(value);
+    uint sub = (uint)(value >> (msb - POOLSTATS_SUB_BITS)) & ((1 << POOLSTATS_SUB_BITS) - 1);
+    return ((msb - POOLSTATS_SUB_BITS + 1) << POOLSTATS_SUB_BITS) + sub;
+}
+
+/*
+ * Return lowest value of histogram bucket.
+ */
+uint64_t poolstats_bucket_value(uint bucket) {
+
+    if (bucket < (1 << POOLSTATS_SUB_BITS)) {
+        return bucket;
+    }
+    uint msb = (bucket >> POOLSTATS_SUB_BITS) + POOLSTATS_SUB_BITS - 1;
+    uint64_t sub = bucket & ((1 << POOLSTATS_SUB_BITS) - 1);
+    return ((1ULL << POOLSTATS_SUB_BITS) + sub) << (msb - POOLSTATS_SUB_BITS);
+}
+
+/*
+ * Return the value below which fraction q of a histogram falls,
+ * or 0 for an empty histogram.
+ */
+uint64_t poolstats_percentile(const uint64_t *hist, double q) {
+
+    uint64_t total = 0;
+    for (int i = 0; i < POOLSTATS_BUCKETS; i++) {
+        total += hist[i];
+    }
+    if (total == 0) {
+        return 0;
+    }
+
+    uint64_t rank = (uint64_t)(q * (double)total);
+    uint64_t seen = 0;
+    for (uint i = 0; i < POOLSTATS_BUCKETS; i++) {
+        seen += hist[i];
+        if (seen > rank) {
+            return poolstats_bucket_value(i);
+        }
+    }
+    return poolstats_bucket_value(POOLSTATS_BUCKETS - 1);
+}
+
+/*
+ * Destroy slot.
+ */
+void poolstats_destroy(poolstats_t *stats) {
+
+    free(stats);
+}
@@ -0,0 +1,77 @@
+/*
+ * Pool runtime statistics
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2016 Mervin <mofei2816@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef POOLSTATS_H_
+#define POOLSTATS_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+
+#include "taskqueue.h"
+
+#define POOLSTATS_SUB_BITS      2
+#define POOLSTATS_BUCKETS       (64 << POOLSTATS_SUB_BITS)
+
+/*
+ * Counters compile to nothing unless WORKERPOOL_STATS is defined.
+ */
+#ifdef WORKERPOOL_STATS
+    #define POOLSTATS_ADD(stats, field, n)      atomic_fetch_add_explicit(&(stats)->field, (n), memory_order_relaxed)
+    #define POOLSTATS_RECORD(stats, hist, v)    poolstats_record((stats)->hist, (v))
+#else
+    #define POOLSTATS_ADD(stats, field, n)
+    #define POOLSTATS_RECORD(stats, hist, v)
+#endif
+
+/* struct and types  */
+
+/*
+ * Statistics of one thread, written by that thread only except for
+ * the shared slot of threads outside the pool.
+ * Histograms are log-bucketed with 4 sub-buckets per power of two.
+ */
+typedef struct poolstats_s {
+    atomic_ullong tasks;                /* tasks executed */
+    atomic_ullong steals;               /* tasks stolen from other workers */
+    atomic_ullong parks;                /* times parked */
+    atomic_ullong wakeups;              /* times woken up for a task */
+    atomic_ullong idle_ns;              /* time spent parked */
+    atomic_ullong wait_hist[POOLSTATS_BUCKETS];     /* queue wait time in ns */
+    atomic_ullong run_hist[POOLSTATS_BUCKETS];      /* execution time in ns */
+} poolstats_t; // statistics slot
+
+/* poolstats functions */
+
+poolstats_t* poolstats_new();
+void poolstats_init(poolstats_t * __restrict);
+void poolstats_record(atomic_ullong * __restrict, uint64_t);
+uint poolstats_bucket(uint64_t);
+uint64_t poolstats_bucket_value(uint);
+uint64_t poolstats_percentile(const uint64_t * __restrict, double);
+void poolstats_destroy(poolstats_t * __restrict);
+
+#endif /* POOLSTATS_H_ */
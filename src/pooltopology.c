@@ -0,0 +1,276 @@
+/*
+ * CPU and NUMA topology
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2016 Mervin <mofei2816@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <dirent.h>
+#include <sched.h>
+#endif
+
+#include "pooltopology.h"
+
+#define SYSFS_NODE_PATH     "/sys/devices/system/node"
+
+#ifdef __linux__
+static int pooltopology_add_list(pooltopology_t * __restrict, uint, const char * __restrict, const cpu_set_t * __restrict);
+static int pooltopology_compare(const void *, const void *);
+#endif
+
+pooltopology_t* pooltopology_new() {
+    return (pooltopology_t*)malloc(sizeof(pooltopology_t));
+}
+
+/*
+ * Init an empty topology.
+ * Return 0 if success or -1.
+ */
+int pooltopology_init(pooltopology_t *topology) {
+
+    if (topology == NULL) {
+        return -1;
+    }
+    topology->cpu_count = 0;
+    topology->node_count = 0;
+    topology->capacity = 0;
+    topology->cpus = NULL;
+    topology->nodes = NULL;
+    return 0;
+}
+
+/*
+ * Add cpu to node, after the cpus already added to it.
+ * Return 0 if success or -1.
+ */
+int pooltopology_add(pooltopology_t *topology, uint node, int cpu) {
+
+    if (topology == NULL || cpu < 0) {
+        return -1;
+    }
+    if (topology->cpu_count == topology->capacity) {
+        uint capacity = topology->capacity == 0 ? 16 : topology->capacity * 2;
+        int *cpus = (int*)realloc(topology->cpus, sizeof(int) * capacity);
+        if (cpus == NULL) {
+            return -1;
+        }
+        topology->cpus = cpus;
+        uint *nodes = (uint*)realloc(topology->nodes, sizeof(uint) * capacity);
+        if (nodes == NULL) {
+            return -1;
+        }
+        topology->nodes = nodes;
+        topology->capacity = capacity;
+    }
+
+    // Keep entries ordered by node.
+    uint i = topology->cpu_count;
+    while (i > 0 && topology->nodes[i - 1] > node) {
+        topology->cpus[i] = topology->cpus[i - 1];
+        topology->nodes[i] = topology->nodes[i - 1];
+        i--;
+    }
+    topology->cpus[i] = cpu;
+    topology->nodes[i] = node;
+    topology->cpu_count++;
+    if (node >= topology->node_count) {
+        topology->node_count = node + 1;
+    }
+    return 0;
+}
+
+/*
+ * Add the cpus this process may run on, grouped by the NUMA nodes of sysfs.
+ * Nodes without such cpus are skipped. Without sysfs all cpus form node 0.
+ * Return 0 if success or -1.
+ */
+int pooltopology_detect(pooltopology_t *topology) {
+
+    if (topology == NULL) {
+        return -1;
+    }
+#ifdef __linux__
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        return -1;
+    }
+
+    // Collect node ids, readdir gives them in no particular order.
+    int ids[CPU_SETSIZE];
+    int count = 0;
+    DIR *dir = opendir(SYSFS_NODE_PATH);
+    if (dir != NULL) {
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL && count < CPU_SETSIZE) {
+            int id;
+            char tail;
+            if (sscanf(entry->d_name, "node%d%c", &id, &tail) == 1 && id >= 0) {
+                ids[count++] = id;
+            }
+        }
+        closedir(dir);
+    }
+    qsort(ids, count, sizeof(int), pooltopology_compare);
+
+    uint node = 0;
+    for (int i = 0; i < count; i++) {
+        char path[64];
+        char list[4096];
+        snprintf(path, sizeof(path), SYSFS_NODE_PATH "/node%d/cpulist", ids[i]);
+        FILE *file = fopen(path, "r");
+        if (file == NULL) {
+            continue;
+        }
+        int r = fgets(list, sizeof(list), file) != NULL;
+        fclose(file);
+        if (r && pooltopology_add_list(topology, node, list, &allowed) > 0) {
+            node++;
+        }
+    }
+
+    if (topology->cpu_count == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &allowed) && pooltopology_add(topology, 0, cpu) == -1) {
+                return -1;
+            }
+        }
+    }
+#else
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    for (int cpu = 0; cpu < online; cpu++) {
+        if (pooltopology_add(topology, 0, cpu) == -1) {
+            return -1;
+        }
+    }
+#endif
+    return topology->cpu_count > 0 ? 0 : -1;
+}
+
+/*
+ * Return node of cpu or -1 when cpu is not in topology.
+ */
+int pooltopology_node_of(const pooltopology_t *topology, int cpu) {
+
+    if (topology == NULL) {
+        return -1;
+    }
+    for (uint i = 0; i < topology->cpu_count; i++) {
+        if (topology->cpus[i] == cpu) {
+            return (int)topology->nodes[i];
+        }
+    }
+    return -1;
+}
+
+/*
+ * Pick cpu for the index-th worker and store its node.
+ * Compact placement fills a node before the next one, scatter deals
+ * workers to nodes in turn.
+ * Return cpu if success or -1 when topology is empty.
+ */
+int pooltopology_place(const pooltopology_t *topology, uint index, int scatter, uint *node) {
+
+    if (topology == NULL || topology->cpu_count == 0) {
+        return -1;
+    }
+    uint i = index % topology->cpu_count;
+    if (scatter) {
+        // Find the cpus of the node, skipping nodes which have none.
+        for (uint n = 0; n < topology->node_count; n++) {
+            uint want = (index + n) % topology->node_count;
+            uint start = 0;
+            while (start < topology->cpu_count && topology->nodes[start] < want) {
+                start++;
+            }
+            uint end = start;
+            while (end < topology->cpu_count && topology->nodes[end] == want) {
+                end++;
+            }
+            if (end > start) {
+                i = start + (index / topology->node_count) % (end - start);
+                break;
+            }
+        }
+    }
+    if (node != NULL) {
+        *node = topology->nodes[i];
+    }
+    return topology->cpus[i];
+}
+
+/*
+ * Destroy topology.
+ */
+void pooltopology_destroy(pooltopology_t *topology) {
+
+    if (topology == NULL) {
+        return;
+    }
+    free(topology->cpus);
+    free(topology->nodes);
+    free(topology);
+}
+
+#ifdef __linux__
+/*
+ * Add the allowed cpus of a list like "0-3,8,10-11" to node.
+ * Return number of cpus added.
+ */
+static int pooltopology_add_list(pooltopology_t *topology, uint node, const char *list, const cpu_set_t *allowed) {
+
+    int added = 0;
+    while (*list != '\0' && *list != '\n') {
+        char *end;
+        long first = strtol(list, &end, 10);
+        if (end == list) {
+            break;
+        }
+        long last = first;
+        if (*end == '-') {
+            list = end + 1;
+            last = strtol(list, &end, 10);
+        }
+        for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+            if (cpu >= 0 && CPU_ISSET(cpu, allowed) && pooltopology_add(topology, node, (int)cpu) == 0) {
+                added++;
+            }
+        }
+        list = *end == ',' ? end + 1 : end;
+    }
+    return added;
+}
+
+static int pooltopology_compare(const void *a, const void *b) {
+
+    int x = *(const int*)a;
+    int y = *(const int*)b;
+    return (x > y) - (x < y);
+}
+#endif
@@ -0,0 +1,58 @@
+/*
+ * CPU and NUMA topology
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2016 Mervin <mofei2816@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef POOLTOPOLOGY_H_
+#define POOLTOPOLOGY_H_
+
+#include <stdlib.h>
+#include <sys/types.h>
+
+/* struct and types  */
+
+/*
+ * CPUs grouped by NUMA node. Nodes are dense indices from 0, CPUs are
+ * kept ordered by node. Build one by hand to describe any machine, or
+ * detect the one we run on.
+ */
+typedef struct pooltopology_s {
+    uint cpu_count;
+    uint node_count;
+    uint capacity;
+    int *cpus;          /* cpu ids ordered by node */
+    uint *nodes;        /* node of each entry of cpus */
+} pooltopology_t; // cpu topology
+
+/* pooltopology functions */
+
+pooltopology_t* pooltopology_new();
+int  pooltopology_init(pooltopology_t * __restrict);
+int  pooltopology_add(pooltopology_t * __restrict, uint, int);
+int  pooltopology_detect(pooltopology_t * __restrict);
+int  pooltopology_node_of(const pooltopology_t * __restrict, int);
+int  pooltopology_place(const pooltopology_t * __restrict, uint, int, uint * __restrict);
+void pooltopology_destroy(pooltopology_t * __restrict);
+
+#endif /* POOLTOPOLOGY_H_ */
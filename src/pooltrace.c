@@ -0,0 +1,270 @@
+/*
+ * Pool event tracing
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2016 Mervin <mofei2816@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <time.h>
+
+#include "pooltrace.h"
+
+static inline uint64_t pooltrace_tsc();
+static uint64_t pooltrace_clock();
+static pooltracering_t* pooltrace_ring(pooltrace_t * __restrict);
+static void pooltrace_ring_release(void *);
+
+static const char *pooltrace_names[] = { "submit", "dequeue", "task", "task", "park", "park" };
+static const char *pooltrace_phases[] = { "i", "i", "B", "E", "B", "E" };
+
+pooltrace_t* pooltrace_new() {
+    return (pooltrace_t*)malloc(sizeof(pooltrace_t));
+}
+
+/*
+ * Init trace and take the reference point to convert counter to time.
+ * Return 0 if success or -1.
+ */
+int pooltrace_init(pooltrace_t *trace) {
+
+    if (trace == NULL) {
+        return -1;
+    }
+    pthread_mutex_init(&trace->mutex, NULL);
+    if (pthread_key_create(&trace->ring_key, pooltrace_ring_release) != 0) {
+        return -1;
+    }
+    trace->rings = NULL;
+    trace->ring_count = 0;
+    trace->tsc_start = pooltrace_tsc();
+    trace->ns_start = pooltrace_clock();
+    return 0;
+}
+
+/*
+ * Record an event in the ring of current thread.
+ */
+void pooltrace_record(pooltrace_t *trace, pooltrace_type_t type, void *func) {
+
+    pooltracering_t *ring = pooltrace_ring(trace);
+    if (ring == NULL) {
+        return;
+    }
+    unsigned long head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    pooltraceevent_t *event = ring->events + (head & (POOLTRACE_RING_SIZE - 1));
+    event->tsc = pooltrace_tsc();
+    event->func = func;
+    event->type = (uint32_t)type;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+/*
+ * Mark current thread as worker of index.
+ * A ring released by a worker of the same index is taken over first, then
+ * any released one, so workers coming and going do not add rings.
+ */
+void pooltrace_worker(pooltrace_t *trace, int index) {
+
+    pooltracering_t *ring = (pooltracering_t*)pthread_getspecific(trace->ring_key);
+    if (ring == NULL) {
+        pooltracering_t *found = NULL;
+        pthread_mutex_lock(&trace->mutex);
+        for (pooltracering_t *next = trace->rings; next != NULL; next = next->next) {
+            if (next->released && (found == NULL || next->worker == index)) {
+                found = next;
+            }
+        }
+        if (found != NULL) {
+            found->released = 0;
+        }
+        pthread_mutex_unlock(&trace->mutex);
+        pthread_setspecific(trace->ring_key, found);
+    }
+    ring = pooltrace_ring(trace);
+    if (ring != NULL) {
+        ring->worker = index;
+    }
+}
+
+/*
+ * Release the ring of current thread, which is about to exit. Its events
+ * stay for dumping until another worker takes the ring over.
+ */
+void pooltrace_release(pooltrace_t *trace) {
+
+    pooltracering_t *ring = (pooltracering_t*)pthread_getspecific(trace->ring_key);
+    if (ring == NULL) {
+        return;
+    }
+    pthread_setspecific(trace->ring_key, NULL);
+    pthread_mutex_lock(&trace->mutex);
+    ring->released = 1;
+    pthread_mutex_unlock(&trace->mutex);
+}
+
+/*
+ * Write all recorded events as Chrome trace event JSON, which loads in
+ * chrome://tracing and Perfetto. Events written while dumping may be torn,
+ * so dump a stopped or paused pool for an exact capture.
+ * Return 0 if success or -1.
+ */
+int pooltrace_dump(pooltrace_t *trace, FILE *out) {
+
+    if (trace == NULL || out == NULL) {
+        return -1;
+    }
+
+    // Scale counter ticks to microseconds from the reference points.
+    uint64_t ticks = pooltrace_tsc() - trace->tsc_start;
+    uint64_t ns = pooltrace_clock() - trace->ns_start;
+    double us_per_tick = ticks > 0 && ns > 0 ? (double)ns / (double)ticks / 1000.0 : 0.001;
+
+    fprintf(out, "{\"traceEvents\":[\n");
+    int first = 1;
+    pthread_mutex_lock(&trace->mutex);
+    for (pooltracering_t *ring = trace->rings; ring != NULL; ring = ring->next) {
+        if (ring->worker >= 0) {
+            fprintf(out, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"worker %d\"}}",
+                    first ? "" : ",\n", ring->id, ring->worker);
+        } else {
+            fprintf(out, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"thread %u\"}}",
+                    first ? "" : ",\n", ring->id, ring->id);
+        }
+        first = 0;
+
+        unsigned long head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        unsigned long tail = head > POOLTRACE_RING_SIZE ? head - POOLTRACE_RING_SIZE : 0;
+        for (unsigned long i = tail; i < head; i++) {
+            pooltraceevent_t *event = ring->events + (i & (POOLTRACE_RING_SIZE - 1));
+            if (event->type > TRACE_WAKE) {
+                continue;
+            }
+            double ts = (double)(event->tsc - trace->tsc_start) * us_per_tick;
+            fprintf(out, ",\n{\"name\":\"%s\",\"ph\":\"%s\",\"ts\":%.3f,\"pid\":1,\"tid\":%u",
+                    pooltrace_names[event->type], pooltrace_phases[event->type], ts, ring->id);
+            if (event->type == TRACE_SUBMIT || event->type == TRACE_DEQUEUE) {
+                fprintf(out, ",\"s\":\"t\"");
+            }
+            if (event->func != NULL) {
+                fprintf(out, ",\"args\":{\"func\":\"%p\"}", event->func);
+            }
+            fprintf(out, "}");
+        }
+    }
+    pthread_mutex_unlock(&trace->mutex);
+    fprintf(out, "\n],\"displayTimeUnit\":\"ns\"}\n");
+    return ferror(out) ? -1 : 0;
+}
+
+/*
+ * Destroy trace and all rings.
+ */
+void pooltrace_destroy(pooltrace_t *trace) {
+
+    if (trace == NULL) {
+        return;
+    }
+    pooltracering_t *ring = trace->rings;
+    while (ring != NULL) {
+        pooltracering_t *tmp = ring->next;
+        free(ring);
+        ring = tmp;
+    }
+    pthread_key_delete(trace->ring_key);
+    pthread_mutex_destroy(&trace->mutex);
+    free(trace);
+}
+
+/*
+ * Read the cheapest cycle counter of the platform.
+ */
+static inline uint64_t pooltrace_tsc() {
+#if defined(__x86_64__) || defined(__i386__)
+    uint32_t lo, hi;
+    __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+#elif defined(__aarch64__)
+    uint64_t value;
+    __asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(value));
+    return value;
+#else
+    return pooltrace_clock();
+#endif
+}
+
+static uint64_t pooltrace_clock() {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+/*
+ * Return ring of current thread on first event, taking over a ring
+ * released by another thread outside the pool or creating one.
+ * Rings stay with the trace after their thread exits, so they can be dumped.
+ */
+static pooltracering_t* pooltrace_ring(pooltrace_t *trace) {
+
+    pooltracering_t *ring = (pooltracering_t*)pthread_getspecific(trace->ring_key);
+    if (ring != NULL) {
+        return ring;
+    }
+    pthread_mutex_lock(&trace->mutex);
+    for (ring = trace->rings; ring != NULL; ring = ring->next) {
+        if (ring->released && ring->worker == -1) {
+            ring->released = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&trace->mutex);
+
+    if (ring == NULL) {
+        ring = (pooltracering_t*)malloc(sizeof(pooltracering_t));
+        if (ring == NULL) {
+            return (pooltracering_t*)NULL;
+        }
+        atomic_init(&ring->head, 0);
+        ring->worker = -1;
+        ring->released = 0;
+        ring->trace = trace;
+        pthread_mutex_lock(&trace->mutex);
+        ring->id = ++trace->ring_count;
+        ring->next = trace->rings;
+        trace->rings = ring;
+        pthread_mutex_unlock(&trace->mutex);
+    }
+    pthread_setspecific(trace->ring_key, ring);
+    return ring;
+}
+
+/*
+ * Thread exit destructor, release the ring of a thread outside the pool
+ * for the next thread recording. Workers release theirs before.
+ */
+static void pooltrace_ring_release(void *ptr) {
+
+    pooltracering_t *ring = (pooltracering_t*)ptr;
+    pthread_mutex_lock(&ring->trace->mutex);
+    ring->released = 1;
+    pthread_mutex_unlock(&ring->trace->mutex);
+}
@@ -0,0 +1,104 @@
+/*
+ * Pool event tracing
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2016 Mervin <mofei2816@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef POOLTRACE_H_
+#define POOLTRACE_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+
+#ifndef POOLTRACE_RING_SIZE
+#define POOLTRACE_RING_SIZE     0x10000     /* events per thread, power of two */
+#endif
+
+/*
+ * Events compile to nothing unless WORKERPOOL_TRACE is defined.
+ */
+#ifdef WORKERPOOL_TRACE
+    #define POOLTRACE(trace, type, func)    pooltrace_record((trace), (type), (void*)(func))
+#else
+    #define POOLTRACE(trace, type, func)
+#endif
+
+/* enums */
+
+typedef enum pooltrace_type_e {
+    TRACE_SUBMIT,       /* task put to pool */
+    TRACE_DEQUEUE,      /* task taken by worker */
+    TRACE_START,        /* task started */
+    TRACE_END,          /* task finished */
+    TRACE_PARK,         /* worker parked */
+    TRACE_WAKE          /* worker woke up */
+} pooltrace_type_t; // trace event type
+
+/* struct and types  */
+
+typedef struct pooltraceevent_s {
+    uint64_t tsc;                       /* time stamp counter */
+    void *func;                         /* task function, NULL for park and wake */
+    uint32_t type;
+} pooltraceevent_t; // trace event
+
+/*
+ * Ring of one thread. Only the owner thread writes, old events are
+ * overwritten when the ring is full. A worker leaving its loop releases
+ * its ring, and the next worker started takes it over. Rings of other
+ * threads are released when the thread exits, and taken over by the next
+ * thread recording.
+ */
+typedef struct pooltracering_s {
+    atomic_ulong head;                  /* events ever written */
+    uint32_t id;                        /* trace thread id */
+    int worker;                         /* worker index, -1 for other threads */
+    int released;                       /* no thread writes, guarded by mutex */
+    struct pooltrace_s *trace;
+    struct pooltracering_s *next;
+    pooltraceevent_t events[POOLTRACE_RING_SIZE];
+} pooltracering_t; // per thread trace ring
+
+typedef struct pooltrace_s {
+    pthread_mutex_t mutex;              /* guards ring list */
+    pthread_key_t ring_key;             /* ring of current thread */
+    pooltracering_t *rings;
+    uint32_t ring_count;
+    uint64_t tsc_start;                 /* time stamp counter at init */
+    uint64_t ns_start;                  /* monotonic clock at init */
+} pooltrace_t; // event trace of a pool
+
+/* pooltrace functions */
+
+pooltrace_t* pooltrace_new();
+int  pooltrace_init(pooltrace_t * __restrict);
+void pooltrace_record(pooltrace_t * __restrict, pooltrace_type_t, void *);
+void pooltrace_worker(pooltrace_t * __restrict, int);
+void pooltrace_release(pooltrace_t * __restrict);
+int  pooltrace_dump(pooltrace_t * __restrict, FILE * __restrict);
+void pooltrace_destroy(pooltrace_t * __restrict);
+
+#endif /* POOLTRACE_H_ */
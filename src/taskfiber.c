@@ -0,0 +1,306 @@
+/*
+ * Task fiber
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2016 Mervin <mofei2816@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "taskfiber.h"
+
+static taskfibercache_t* taskfiberpool_cache(taskfiberpool_t * __restrict);
+static void taskfiberpool_cache_release(void *);
+static void taskfiber_main(uint, uint);
+
+taskfiberpool_t* taskfiberpool_new() {
+    return (taskfiberpool_t*)malloc(sizeof(taskfiberpool_t));
+}
+
+/*
+ * Init fiber pool with stacks of stack_size bytes, rounded up to pages.
+ * Return 0 if success or -1.
+ */
+int taskfiberpool_init(taskfiberpool_t *fiberpool, size_t stack_size) {
+
+    if (fiberpool == NULL) {
+        return -1;
+    }
+    if (pthread_key_create(&fiberpool->cache_key, taskfiberpool_cache_release) != 0) {
+        return -1;
+    }
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    fiberpool->stack_size = (stack_size + page - 1) / page * page;
+    pthread_mutex_init(&fiberpool->mutex, NULL);
+    fiberpool->free = NULL;
+    fiberpool->all = NULL;
+    fiberpool->caches = NULL;
+    return 0;
+}
+
+/*
+ * Destroy fiber pool and all fibers it ever handed out, suspended ones
+ * and ones cached by other threads too.
+ */
+void taskfiberpool_destroy(taskfiberpool_t *fiberpool) {
+
+    if (fiberpool == NULL) {
+        return;
+    }
+    pthread_key_delete(fiberpool->cache_key);
+
+    taskfibercache_t *cache = fiberpool->caches;
+    while (cache != NULL) {
+        taskfibercache_t *tmp = cache->next;
+        free(cache);
+        cache = tmp;
+    }
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    taskfiber_t *fiber = fiberpool->all;
+    while (fiber != NULL) {
+        taskfiber_t *tmp = fiber->all_next;
+        munmap(fiber->stack, fiber->stack_size + page);
+        free(fiber);
+        fiber = tmp;
+    }
+    pthread_mutex_destroy(&fiberpool->mutex);
+    free(fiberpool);
+}
+
+/*
+ * Take a fiber from the cache of current thread to run task, create one
+ * when neither the cache nor the shared free list has any.
+ * Stacks are mapped lazily with a guard page below, so a fiber only
+ * costs the pages its task touches.
+ * Return fiber or NULL.
+ */
+taskfiber_t* taskfiber_alloc(taskfiberpool_t *fiberpool, const task_t *task) {
+
+    taskfibercache_t *cache = taskfiberpool_cache(fiberpool);
+    if (cache != NULL && cache->free == NULL) {
+        // Move a batch from the shared free list to the cache.
+        pthread_mutex_lock(&fiberpool->mutex);
+        taskfiber_t *last = fiberpool->free;
+        if (last != NULL) {
+            int size = 1;
+            while (size < TASKFIBER_CACHE_SIZE && last->next != NULL) {
+                last = last->next;
+                size++;
+            }
+            cache->free = fiberpool->free;
+            fiberpool->free = last->next;
+            last->next = NULL;
+            cache->size = size;
+        }
+        pthread_mutex_unlock(&fiberpool->mutex);
+    }
+    taskfiber_t *fiber;
+    if (cache != NULL) {
+        fiber = cache->free;
+        if (fiber != NULL) {
+            cache->free = fiber->next;
+            cache->size--;
+        }
+    } else {
+        pthread_mutex_lock(&fiberpool->mutex);
+        fiber = fiberpool->free;
+        if (fiber != NULL) {
+            fiberpool->free = fiber->next;
+        }
+        pthread_mutex_unlock(&fiberpool->mutex);
+    }
+
+    if (fiber == NULL) {
+        fiber = (taskfiber_t*)malloc(sizeof(taskfiber_t));
+        if (fiber == NULL) {
+            return (taskfiber_t*)NULL;
+        }
+        size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_STACK
+        flags |= MAP_STACK;
+#endif
+        fiber->stack = mmap(NULL, fiberpool->stack_size + page, PROT_READ | PROT_WRITE, flags, -1, 0);
+        if (fiber->stack == MAP_FAILED) {
+            free(fiber);
+            return (taskfiber_t*)NULL;
+        }
+        mprotect(fiber->stack, page, PROT_NONE);
+        fiber->stack_size = fiberpool->stack_size;
+        fiber->fiberpool = fiberpool;
+
+        // The entry gets the fiber split in two, makecontext only passes ints.
+        uint64_t ptr = (uint64_t)(uintptr_t)fiber;
+        getcontext(&fiber->context);
+        fiber->context.uc_stack.ss_sp = (char*)fiber->stack + page;
+        fiber->context.uc_stack.ss_size = fiber->stack_size;
+        fiber->context.uc_link = NULL;
+        makecontext(&fiber->context, (void (*)(void))taskfiber_main, 2, (uint)(ptr >> 32), (uint)ptr);
+
+        pthread_mutex_lock(&fiberpool->mutex);
+        fiber->all_next = fiberpool->all;
+        fiberpool->all = fiber;
+        pthread_mutex_unlock(&fiberpool->mutex);
+    }
+
+    fiber->task = *task;
+    fiber->state = FIBER_RUNNING;
+    fiber->awaited = NULL;
+    fiber->next = NULL;
+    return fiber;
+}
+
+/*
+ * Run fiber in the calling thread until its task finishes or suspends.
+ * Return the state the fiber left with.
+ */
+fiber_state_t taskfiber_switch(taskfiber_t *fiber) {
+
+    ucontext_t caller;
+    fiber->caller = &caller;
+    fiber->state = FIBER_RUNNING;
+    swapcontext(&caller, &fiber->context);
+    return fiber->state;
+}
+
+/*
+ * Suspend the running fiber and return to the thread which switched to it.
+ * Returns once the fiber is switched to again. Fiber only.
+ */
+void taskfiber_suspend(taskfiber_t *fiber, fiber_state_t state) {
+
+    fiber->state = state;
+    swapcontext(&fiber->context, fiber->caller);
+}
+
+/*
+ * Give a fiber whose task finished back to the cache of current thread.
+ * A batch goes back to the shared free list when the cache grows too big,
+ * so fibers resumed and finished elsewhere flow back to other workers.
+ */
+void taskfiber_free(taskfiber_t *fiber) {
+
+    if (fiber == NULL) {
+        return;
+    }
+    taskfiberpool_t *fiberpool = fiber->fiberpool;
+    taskfibercache_t *cache = taskfiberpool_cache(fiberpool);
+    if (cache == NULL) {
+        pthread_mutex_lock(&fiberpool->mutex);
+        fiber->next = fiberpool->free;
+        fiberpool->free = fiber;
+        pthread_mutex_unlock(&fiberpool->mutex);
+        return;
+    }
+
+    fiber->next = cache->free;
+    cache->free = fiber;
+    cache->size++;
+
+    if (cache->size >= TASKFIBER_CACHE_SIZE * 2) {
+        taskfiber_t *first = cache->free;
+        taskfiber_t *last = first;
+        for (int i = 1; i < TASKFIBER_CACHE_SIZE; i++) {
+            last = last->next;
+        }
+        cache->free = last->next;
+        cache->size -= TASKFIBER_CACHE_SIZE;
+
+        pthread_mutex_lock(&fiberpool->mutex);
+        last->next = fiberpool->free;
+        fiberpool->free = first;
+        pthread_mutex_unlock(&fiberpool->mutex);
+    }
+}
+
+/*
+ * Return cache of current thread, create it on first use.
+ */
+static taskfibercache_t* taskfiberpool_cache(taskfiberpool_t *fiberpool) {
+
+    taskfibercache_t *cache = (taskfibercache_t*)pthread_getspecific(fiberpool->cache_key);
+    if (cache != NULL) {
+        return cache;
+    }
+
+    cache = (taskfibercache_t*)malloc(sizeof(taskfibercache_t));
+    if (cache == NULL) {
+        return (taskfibercache_t*)NULL;
+    }
+    cache->fiberpool = fiberpool;
+    cache->free = NULL;
+    cache->size = 0;
+    cache->prev = NULL;
+
+    pthread_mutex_lock(&fiberpool->mutex);
+    cache->next = fiberpool->caches;
+    if (fiberpool->caches != NULL) {
+        fiberpool->caches->prev = cache;
+    }
+    fiberpool->caches = cache;
+    pthread_mutex_unlock(&fiberpool->mutex);
+
+    pthread_setspecific(fiberpool->cache_key, cache);
+    return cache;
+}
+
+/*
+ * Thread exit destructor, give cached fibers back to the shared free list.
+ */
+static void taskfiberpool_cache_release(void *ptr) {
+
+    taskfibercache_t *cache = (taskfibercache_t*)ptr;
+    taskfiberpool_t *fiberpool = cache->fiberpool;
+
+    pthread_mutex_lock(&fiberpool->mutex);
+    while (cache->free != NULL) {
+        taskfiber_t *fiber = cache->free;
+        cache->free = fiber->next;
+        fiber->next = fiberpool->free;
+        fiberpool->free = fiber;
+    }
+    if (cache->prev != NULL) {
+        cache->prev->next = cache->next;
+    } else {
+        fiberpool->caches = cache->next;
+    }
+    if (cache->next != NULL) {
+        cache->next->prev = cache->prev;
+    }
+    pthread_mutex_unlock(&fiberpool->mutex);
+    free(cache);
+}
+
+/*
+ * Entry of a fiber. Runs the task it was given, then waits to be given
+ * the next one.
+ */
+static void taskfiber_main(uint high, uint low) {
+
+    taskfiber_t *fiber = (taskfiber_t*)(uintptr_t)(((uint64_t)high << 32) | low);
+    while (1) {
+        fiber->task.func(task_args(&fiber->task));
+        taskfiber_suspend(fiber, FIBER_DONE);
+    }
+}
@@ -0,0 +1,95 @@
+/*
+ * Task fiber
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2016 Mervin <mofei2816@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef TASKFIBER_H_
+#define TASKFIBER_H_
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <ucontext.h>
+
+#include "taskfuture.h"
+#include "taskqueue.h"
+
+#define TASKFIBER_CACHE_SIZE 0x8    /* fibers moved between cache and pool at once */
+
+/* enums */
+
+typedef enum fiber_state_e {
+    FIBER_RUNNING,
+    FIBER_YIELDED,          /* suspended, ready to resume */
+    FIBER_AWAITING,         /* suspended until awaited future is done */
+    FIBER_DONE              /* task finished, fiber may run another */
+} fiber_state_t;    // fiber state
+
+/* struct and types  */
+
+/*
+ * Task running on its own stack, which can suspend itself and be resumed
+ * later by any thread. A fiber runs one task after another until freed.
+ */
+typedef struct taskfiber_s {
+    ucontext_t context;
+    ucontext_t *caller;                 /* context to switch back to on suspend */
+    void *stack;                        /* mapping of stack and guard page */
+    size_t stack_size;
+    task_t task;
+    fiber_state_t state;
+    taskfuture_t *awaited;              /* future of FIBER_AWAITING */
+    futurewaiter_t waiter;              /* resumes fiber once awaited is done */
+    void *owner;                        /* pool the fiber runs on */
+    struct taskfiberpool_s *fiberpool;
+    struct taskfiber_s *next;           /* next in free list */
+    struct taskfiber_s *all_next;       /* next in all fibers */
+} taskfiber_t; // stackful task
+
+typedef struct taskfibercache_s {
+    struct taskfiberpool_s *fiberpool;
+    taskfiber_t *free;
+    int size;
+    struct taskfibercache_s *prev, *next;
+} taskfibercache_t; // thread local cache of fibers
+
+typedef struct taskfiberpool_s {
+    pthread_mutex_t mutex;
+    pthread_key_t cache_key;
+    size_t stack_size;
+    taskfiber_t *free;                  /* shared free list */
+    taskfiber_t *all;
+    taskfibercache_t *caches;           /* all thread caches */
+} taskfiberpool_t; // pool of reusable fibers
+
+/* taskfiber functions */
+
+taskfiberpool_t* taskfiberpool_new();
+int  taskfiberpool_init(taskfiberpool_t * __restrict, size_t);
+void taskfiberpool_destroy(taskfiberpool_t * __restrict);
+taskfiber_t* taskfiber_alloc(taskfiberpool_t * __restrict, const task_t * __restrict);
+fiber_state_t taskfiber_switch(taskfiber_t * __restrict);
+void taskfiber_suspend(taskfiber_t * __restrict, fiber_state_t);
+void taskfiber_free(taskfiber_t * __restrict);
+
+#endif /* TASKFIBER_H_ */
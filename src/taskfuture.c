@@ -0,0 +1,286 @@
+/*
+ * Task future
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2016 Mervin <mofei2816@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <errno.h>
+#include <time.h>
+
+#include "taskfuture.h"
+
+#define FUTURE_SPIN     0x40
+
+static void taskfuture_finish(taskfuture_t * __restrict, void *, future_state_t);
+static void taskfuture_unref(taskfuture_t * __restrict);
+
+taskfuturepool_t* taskfuturepool_new() {
+    return (taskfuturepool_t*)malloc(sizeof(taskfuturepool_t));
+}
+
+/*
+ * Init future pool.
+ * Return 0 if success or -1.
+ */
+int taskfuturepool_init(taskfuturepool_t *futurepool) {
+
+    if (futurepool == NULL) {
+        return -1;
+    }
+    pthread_mutex_init(&futurepool->mutex, NULL);
+    futurepool->free = NULL;
+    futurepool->all = NULL;
+    return 0;
+}
+
+/*
+ * Destroy future pool and all futures it ever handed out.
+ */
+void taskfuturepool_destroy(taskfuturepool_t *futurepool) {
+
+    if (futurepool == NULL) {
+        return;
+    }
+    taskfuture_t *future = futurepool->all;
+    while (future != NULL) {
+        taskfuture_t *tmp = future->all_next;
+        pthread_mutex_destroy(&future->mutex);
+        pthread_cond_destroy(&future->done_notify);
+        free(future);
+        future = tmp;
+    }
+    pthread_mutex_destroy(&futurepool->mutex);
+    free(futurepool);
+}
+
+/*
+ * Take a pending future from pool, allocate one when pool is empty.
+ * The future is owned by both the caller and the task until released.
+ */
+taskfuture_t* taskfuture_alloc(taskfuturepool_t *futurepool, void *(*func)(void*), void *arg) {
+
+    pthread_mutex_lock(&futurepool->mutex);
+    taskfuture_t *future = futurepool->free;
+    if (future != NULL) {
+        futurepool->free = future->next;
+    }
+    pthread_mutex_unlock(&futurepool->mutex);
+
+    if (future == NULL) {
+        future = (taskfuture_t*)malloc(sizeof(taskfuture_t));
+        if (future == NULL) {
+            return (taskfuture_t*)NULL;
+        }
+        pthread_mutex_init(&future->mutex, NULL);
+        pthread_cond_init(&future->done_notify, NULL);
+        future->futurepool = futurepool;
+        pthread_mutex_lock(&futurepool->mutex);
+        future->all_next = futurepool->all;
+        futurepool->all = future;
+        pthread_mutex_unlock(&futurepool->mutex);
+    }
+
+    future->func = func;
+    future->args = arg;
+    future->result = NULL;
+    future->next = NULL;
+    atomic_init(&future->state, FUTURE_PENDING);
+    atomic_init(&future->refs, 2);
+    atomic_init(&future->waiters, 0);
+    future->resumers = NULL;
+    return future;
+}
+
+/*
+ * Task function of a submitted future.
+ */
+void taskfuture_run(void *ptr) {
+
+    taskfuture_t *future = (taskfuture_t*)ptr;
+    taskfuture_complete(future, future->func(future->args));
+}
+
+/*
+ * Publish result, wake up waiters and run added waiters.
+ */
+void taskfuture_complete(taskfuture_t *future, void *result) {
+
+    taskfuture_finish(future, result, FUTURE_DONE);
+}
+
+/*
+ * Finish future without running its task, as the pool was shut down.
+ * Waiters are released with a NULL result.
+ */
+void taskfuture_cancel(taskfuture_t *future) {
+
+    taskfuture_finish(future, NULL, FUTURE_CANCELLED);
+}
+
+static void taskfuture_finish(taskfuture_t *future, void *result, future_state_t state) {
+
+    future->result = result;
+    atomic_store(&future->state, state);
+    if (atomic_load(&future->waiters) > 0) {
+        pthread_mutex_lock(&future->mutex);
+        pthread_cond_broadcast(&future->done_notify);
+        futurewaiter_t *resumers = future->resumers;
+        future->resumers = NULL;
+        pthread_mutex_unlock(&future->mutex);
+
+        // A waiter may release the future, read next first.
+        while (resumers != NULL) {
+            futurewaiter_t *next = resumers->next;
+            resumers->func(resumers->arg);
+            resumers = next;
+        }
+    }
+    taskfuture_unref(future);
+}
+
+/*
+ * Return 1 if task of future has finished or was cancelled.
+ */
+int taskfuture_is_done(taskfuture_t *future) {
+
+    if (future == NULL) {
+        return 0;
+    }
+    return atomic_load_explicit(&future->state, memory_order_acquire) != FUTURE_PENDING;
+}
+
+/*
+ * Return 1 if future was cancelled and its task never ran.
+ */
+int taskfuture_is_cancelled(taskfuture_t *future) {
+
+    if (future == NULL) {
+        return 0;
+    }
+    return atomic_load_explicit(&future->state, memory_order_acquire) == FUTURE_CANCELLED;
+}
+
+/*
+ * Block until task finished and return its result.
+ */
+void* taskfuture_wait(taskfuture_t *future) {
+
+    void *result = NULL;
+    taskfuture_wait_timeout(future, UINT64_MAX, &result);
+    return result;
+}
+
+/*
+ * Block until task finished or timeout in nanoseconds elapsed.
+ * Return 0 and set result if finished or -1 on timeout.
+ */
+int taskfuture_wait_timeout(taskfuture_t *future, uint64_t timeout, void **result) {
+
+    if (future == NULL) {
+        return -1;
+    }
+
+    // Short tasks usually finish before we would fall asleep.
+    for (int i = 0; i < FUTURE_SPIN && !taskfuture_is_done(future); i++);
+
+    if (!taskfuture_is_done(future)) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        if (timeout != UINT64_MAX) {
+            deadline.tv_sec += timeout / 1000000000ULL;
+            deadline.tv_nsec += timeout % 1000000000ULL;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+        }
+
+        pthread_mutex_lock(&future->mutex);
+        atomic_fetch_add(&future->waiters, 1);
+        while (!taskfuture_is_done(future)) {
+            if (timeout == UINT64_MAX) {
+                pthread_cond_wait(&future->done_notify, &future->mutex);
+            } else if (pthread_cond_timedwait(&future->done_notify, &future->mutex, &deadline) == ETIMEDOUT) {
+                break;
+            }
+        }
+        atomic_fetch_sub(&future->waiters, 1);
+        pthread_mutex_unlock(&future->mutex);
+    }
+
+    if (!taskfuture_is_done(future)) {
+        return -1;
+    }
+    if (result != NULL) {
+        *result = future->result;
+    }
+    return 0;
+}
+
+/*
+ * Add a waiter whose callback runs in the completing thread once task
+ * finished, instead of blocking a thread. The waiter must stay valid
+ * until then.
+ * Return 0 if added or -1 when task has finished already.
+ */
+int taskfuture_add_waiter(taskfuture_t *future, futurewaiter_t *waiter) {
+
+    if (future == NULL || waiter == NULL) {
+        return -1;
+    }
+    pthread_mutex_lock(&future->mutex);
+    atomic_fetch_add(&future->waiters, 1);
+    if (taskfuture_is_done(future)) {
+        atomic_fetch_sub(&future->waiters, 1);
+        pthread_mutex_unlock(&future->mutex);
+        return -1;
+    }
+    waiter->next = future->resumers;
+    future->resumers = waiter;
+    pthread_mutex_unlock(&future->mutex);
+    return 0;
+}
+
+/*
+ * Release caller ownership of future.
+ * The future returns to its pool once the task has finished as well.
+ */
+void taskfuture_release(taskfuture_t *future) {
+
+    if (future == NULL) {
+        return;
+    }
+    taskfuture_unref(future);
+}
+
+static void taskfuture_unref(taskfuture_t *future) {
+
+    if (atomic_fetch_sub(&future->refs, 1) != 1) {
+        return;
+    }
+    taskfuturepool_t *futurepool = future->futurepool;
+    pthread_mutex_lock(&futurepool->mutex);
+    future->next = futurepool->free;
+    futurepool->free = future;
+    pthread_mutex_unlock(&futurepool->mutex);
+}
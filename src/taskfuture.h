@@ -0,0 +1,88 @@
+/*
+ * Task future
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2016 Mervin <mofei2816@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef TASKFUTURE_H_
+#define TASKFUTURE_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+
+/* enums */
+
+typedef enum future_state_e {
+    FUTURE_PENDING,
+    FUTURE_DONE,
+    FUTURE_CANCELLED
+} future_state_t;   // future state
+
+/* struct and types  */
+
+typedef struct futurewaiter_s {
+    void (*func)(void*);
+    void *arg;
+    struct futurewaiter_s *next;
+} futurewaiter_t;   // callback run when a future is done
+
+typedef struct taskfuture_s {
+    void *(*func)(void*);
+    void *args;
+    void *result;
+    atomic_int state;
+    atomic_int refs;                    /* owners, caller and worker */
+    atomic_int waiters;                 /* threads blocked in wait and added waiters */
+    futurewaiter_t *resumers;           /* added waiters, guarded by mutex */
+    pthread_mutex_t mutex;
+    pthread_cond_t done_notify;
+    struct taskfuturepool_s *futurepool;
+    struct taskfuture_s *next;          /* next in free list */
+    struct taskfuture_s *all_next;      /* next in all futures */
+} taskfuture_t; // completion handle of a task
+
+typedef struct taskfuturepool_s {
+    pthread_mutex_t mutex;
+    taskfuture_t *free;
+    taskfuture_t *all;
+} taskfuturepool_t; // pool of reusable futures
+
+/* taskfuture functions */
+
+taskfuturepool_t* taskfuturepool_new();
+int  taskfuturepool_init(taskfuturepool_t * __restrict);
+void taskfuturepool_destroy(taskfuturepool_t * __restrict);
+taskfuture_t* taskfuture_alloc(taskfuturepool_t * __restrict, void *(*)(void*), void*);
+void taskfuture_run(void *);
+void taskfuture_complete(taskfuture_t * __restrict, void *);
+void taskfuture_cancel(taskfuture_t * __restrict);
+int  taskfuture_is_done(taskfuture_t * __restrict);
+int  taskfuture_is_cancelled(taskfuture_t * __restrict);
+void* taskfuture_wait(taskfuture_t * __restrict);
+int  taskfuture_wait_timeout(taskfuture_t * __restrict, uint64_t, void ** __restrict);
+int  taskfuture_add_waiter(taskfuture_t * __restrict, futurewaiter_t * __restrict);
+void taskfuture_release(taskfuture_t * __restrict);
+
+#endif /* TASKFUTURE_H_ */
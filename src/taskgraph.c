@@ -0,0 +1,287 @@
+/*
+ * Task dependency graph
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2016 Mervin <mofei2816@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "taskgraph.h"
+
+static int  taskgraph_sort(taskgraph_t * __restrict);
+static void taskgraph_node_put(taskgraph_t * __restrict, graphnode_t * __restrict);
+static void taskgraph_node_done(taskgraph_t * __restrict);
+static int  taskgraph_done(void *);
+
+taskgraph_t* taskgraph_new() {
+    return (taskgraph_t*)malloc(sizeof(taskgraph_t));
+}
+
+/*
+ * Init empty graph.
+ */
+void taskgraph_init(taskgraph_t *graph) {
+
+    if (graph == NULL) {
+        return;
+    }
+    graph->pool = NULL;
+    graph->nodes = NULL;
+    graph->node_count = 0;
+    graph->node_capacity = 0;
+    graph->order = NULL;
+    graph->root_count = 0;
+    graph->sorted = 0;
+    atomic_init(&graph->remaining, 0);
+    atomic_init(&graph->cancelled, 0);
+    pthread_mutex_init(&graph->mutex, NULL);
+    pthread_cond_init(&graph->done_notify, NULL);
+}
+
+/*
+ * Add a node running func with arg to graph.
+ * Return id of the node or -1.
+ */
+int taskgraph_add_node(taskgraph_t *graph, void (*taskfunc)(void*), void *arg) {
+
+    if (graph == NULL || taskfunc == NULL || graph->node_count == INT32_MAX) {
+        return -1;
+    }
+
+    if (graph->node_count == graph->node_capacity) {
+        uint capacity = graph->node_capacity > 0 ? graph->node_capacity * 2 : 16;
+        graphnode_t *nodes = (graphnode_t*)realloc(graph->nodes, sizeof(graphnode_t) * capacity);
+        if (nodes == NULL) {
+            return -1;
+        }
+        graph->nodes = nodes;
+        graph->node_capacity = capacity;
+    }
+
+    graphnode_t *node = graph->nodes + graph->node_count;
+    node->func = taskfunc;
+    node->args = arg;
+    node->graph = graph;
+    atomic_init(&node->pending, 0);
+    node->predecessors = 0;
+    node->successors = NULL;
+    node->successor_count = 0;
+    node->successor_capacity = 0;
+    graph->sorted = 0;
+    return (int)graph->node_count++;
+}
+
+/*
+ * Add an edge to graph, node to runs only after node from finished.
+ * Return 0 if success or -1.
+ */
+int taskgraph_add_edge(taskgraph_t *graph, uint from, uint to) {
+
+    if (graph == NULL || from >= graph->node_count || to >= graph->node_count || from == to) {
+        return -1;
+    }
+
+    graphnode_t *node = graph->nodes + from;
+    if (node->successor_count == node->successor_capacity) {
+        uint capacity = node->successor_capacity > 0 ? node->successor_capacity * 2 : 4;
+        uint *successors = (uint*)realloc(node->successors, sizeof(uint) * capacity);
+        if (successors == NULL) {
+            return -1;
+        }
+        node->successors = successors;
+        node->successor_capacity = capacity;
+    }
+    node->successors[node->successor_count++] = to;
+    graph->nodes[to].predecessors++;
+    graph->sorted = 0;
+    return 0;
+}
+
+/*
+ * Run all nodes of graph on pool, each after all its predecessors, and
+ * wait for them to finish. The waiting thread runs pending tasks of the
+ * pool meanwhile. A graph may be run again as often as needed, only the
+ * first run after a change allocates.
+ * Return 0 if success or -1 when the graph has a cycle, or the pool was
+ * shut down before all nodes ran.
+ */
+int workerpool_run_graph(workerpool_t *pool, taskgraph_t *graph) {
+
+    if (workerpool_status(pool) == INVALID || graph == NULL) {
+        return -1;
+    }
+    if (!graph->sorted && taskgraph_sort(graph) == -1) {
+        return -1;
+    }
+    if (graph->node_count == 0) {
+        return 0;
+    }
+
+    // Reset the counters of the run before any node may finish.
+    graph->pool = pool;
+    for (uint i = 0; i < graph->node_count; i++) {
+        atomic_store_explicit(&graph->nodes[i].pending, graph->nodes[i].predecessors, memory_order_relaxed);
+    }
+    atomic_store(&graph->remaining, graph->node_count);
+    atomic_store(&graph->cancelled, 0);
+
+    for (uint i = 0; i < graph->root_count; i++) {
+        taskgraph_node_put(graph, graph->nodes + graph->order[i]);
+    }
+
+    workerpool_help_wait(pool, taskgraph_done, graph, &graph->mutex, &graph->done_notify);
+    return atomic_load(&graph->cancelled) ? -1 : 0;
+}
+
+static int taskgraph_done(void *ptr) {
+
+    return atomic_load(&((taskgraph_t*)ptr)->remaining) == 0;
+}
+
+/*
+ * Destroy graph.
+ */
+void taskgraph_destroy(taskgraph_t *graph) {
+
+    if (graph == NULL) {
+        return;
+    }
+    for (uint i = 0; i < graph->node_count; i++) {
+        free(graph->nodes[i].successors);
+    }
+    free(graph->nodes);
+    free(graph->order);
+    pthread_mutex_destroy(&graph->mutex);
+    pthread_cond_destroy(&graph->done_notify);
+    free(graph);
+}
+
+/*
+ * Order nodes of graph so that every node comes after its predecessors.
+ * Return 0 if success or -1 when the graph has a cycle.
+ */
+static int taskgraph_sort(taskgraph_t *graph) {
+
+    uint *order = (uint*)realloc(graph->order, sizeof(uint) * (graph->node_count > 0 ? graph->node_count : 1));
+    if (order == NULL) {
+        return -1;
+    }
+    graph->order = order;
+
+    // Pending counts serve as scratch for the in-degrees.
+    uint count = 0;
+    for (uint i = 0; i < graph->node_count; i++) {
+        atomic_store_explicit(&graph->nodes[i].pending, graph->nodes[i].predecessors, memory_order_relaxed);
+        if (graph->nodes[i].predecessors == 0) {
+            order[count++] = i;
+        }
+    }
+    graph->root_count = count;
+    for (uint i = 0; i < count; i++) {
+        graphnode_t *node = graph->nodes + order[i];
+        for (uint j = 0; j < node->successor_count; j++) {
+            uint id = node->successors[j];
+            if (atomic_fetch_sub_explicit(&graph->nodes[id].pending, 1, memory_order_relaxed) == 1) {
+                order[count++] = id;
+            }
+        }
+    }
+
+    // Nodes on a cycle never get ready.
+    graph->sorted = count == graph->node_count;
+    return graph->sorted ? 0 : -1;
+}
+
+/*
+ * Put a ready node to the pool, or run it here when the pool refuses.
+ * Nodes of a cancelled run only count down, so they never go to the pool.
+ */
+static void taskgraph_node_put(taskgraph_t *graph, graphnode_t *node) {
+
+    if (atomic_load_explicit(&graph->cancelled, memory_order_relaxed) ||
+        workerpool_task_put(graph->pool, taskgraph_node_func, node) == -1) {
+        taskgraph_node_func(node);
+    }
+}
+
+/*
+ * Run a node, then release its successors.
+ * The first successor which gets ready runs right here while the data of
+ * its predecessor is still in cache, the others are put to the pool, which
+ * is the local deque of the worker when work stealing.
+ */
+void taskgraph_node_func(void *ptr) {
+
+    graphnode_t *node = (graphnode_t*)ptr;
+    taskgraph_t *graph = node->graph;
+    while (node != NULL) {
+        if (!atomic_load_explicit(&graph->cancelled, memory_order_relaxed)) {
+            node->func(node->args);
+        }
+
+        graphnode_t *next = NULL;
+        for (uint i = 0; i < node->successor_count; i++) {
+            graphnode_t *successor = graph->nodes + node->successors[i];
+            if (atomic_fetch_sub(&successor->pending, 1) != 1) {
+                continue;
+            }
+            if (next == NULL) {
+                next = successor;
+            } else {
+                taskgraph_node_put(graph, successor);
+            }
+        }
+        taskgraph_node_done(graph);
+        node = next;
+    }
+}
+
+/*
+ * Cancel a node left in a pool which was shut down. The rest of the run
+ * is released without running any node, the graph returns -1.
+ */
+void taskgraph_node_cancel(void *ptr, void (*cancel)(task_t*)) {
+
+    (void)cancel;
+    graphnode_t *node = (graphnode_t*)ptr;
+    atomic_store(&node->graph->cancelled, 1);
+    taskgraph_node_func(node);
+}
+
+/*
+ * Count down a finished node.
+ * Only the count down to zero takes the lock.
+ */
+static void taskgraph_node_done(taskgraph_t *graph) {
+
+    uint remaining = atomic_load(&graph->remaining);
+    while (remaining > 1) {
+        if (atomic_compare_exchange_weak(&graph->remaining, &remaining, remaining - 1)) {
+            return;
+        }
+    }
+
+    pthread_mutex_lock(&graph->mutex);
+    if (atomic_fetch_sub(&graph->remaining, 1) == 1) {
+        pthread_cond_broadcast(&graph->done_notify);
+    }
+    pthread_mutex_unlock(&graph->mutex);
+}
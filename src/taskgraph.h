@@ -0,0 +1,74 @@
+/*
+ * Task dependency graph
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2016 Mervin <mofei2816@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef TASKGRAPH_H_
+#define TASKGRAPH_H_
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+
+#include "workerpool.h"
+
+/* struct and types  */
+
+typedef struct graphnode_s {
+    void (*func)(void*);
+    void *args;
+    struct taskgraph_s *graph;          /* owner graph */
+    atomic_uint pending;                /* predecessors not finished in this run */
+    uint predecessors;                  /* number of predecessors */
+    uint *successors;                   /* ids of successors */
+    uint successor_count;
+    uint successor_capacity;
+} graphnode_t; // node of task graph
+
+typedef struct taskgraph_s {
+    workerpool_t *pool;                 /* pool of the current run */
+    graphnode_t *nodes;
+    uint node_count;
+    uint node_capacity;
+    uint *order;                        /* node ids in dependency order, roots first */
+    uint root_count;                    /* nodes without predecessors */
+    int sorted;                         /* order is valid, cleared by any change */
+    atomic_uint remaining;              /* nodes not finished in this run */
+    atomic_int cancelled;               /* this run was cancelled by shutdown */
+    pthread_mutex_t mutex;
+    pthread_cond_t done_notify;
+} taskgraph_t; // graph of tasks with dependencies
+
+/* taskgraph functions */
+
+taskgraph_t* taskgraph_new();
+void taskgraph_init(taskgraph_t * __restrict);
+int  taskgraph_add_node(taskgraph_t * __restrict, void (*)(void*), void*);
+int  taskgraph_add_edge(taskgraph_t * __restrict, uint, uint);
+int  workerpool_run_graph(workerpool_t * __restrict, taskgraph_t * __restrict);
+void taskgraph_destroy(taskgraph_t * __restrict);
+void taskgraph_node_func(void *);
+void taskgraph_node_cancel(void *, void (*)(task_t*));
+
+#endif /* TASKGRAPH_H_ */
@@ -0,0 +1,166 @@
+/*
+ * Task group
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2016 Mervin <mofei2816@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "taskgroup.h"
+
+typedef struct grouptask_s {
+    taskgroup_t *group;
+    void (*func)(void*);
+    void *args;
+} grouptask_t; // task put into a group
+
+static void taskgroup_task_done(taskgroup_t * __restrict);
+static int  taskgroup_done(void *);
+
+taskgroup_t* taskgroup_new() {
+    return (taskgroup_t*)malloc(sizeof(taskgroup_t));
+}
+
+/*
+ * Init group.
+ */
+void taskgroup_init(taskgroup_t *group) {
+
+    if (group == NULL) {
+        return;
+    }
+    group->pool = NULL;
+    atomic_init(&group->pending, 0);
+    pthread_mutex_init(&group->mutex, NULL);
+    pthread_cond_init(&group->done_notify, NULL);
+}
+
+/*
+ * Put a task to workerpool as member of group.
+ * Return 0 if success or -1.
+ */
+int workerpool_group_put(workerpool_t *pool, taskgroup_t *group, void (*taskfunc)(void*), void *arg) {
+
+    if (group == NULL || taskfunc == NULL) {
+        return -1;
+    }
+
+    // The wrapper travels inline in the task, no allocation needed.
+    grouptask_t grouptask = { .group = group, .func = taskfunc, .args = arg };
+
+    group->pool = pool;
+    atomic_fetch_add(&group->pending, 1);
+    if (workerpool_task_put_inline(pool, taskgroup_task_func, &grouptask, sizeof(grouptask_t)) == -1) {
+        atomic_fetch_sub(&group->pending, 1);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Wait for all tasks of group to finish.
+ * The waiting thread runs pending tasks of the pool meanwhile, so a task
+ * waiting on its children never blocks the worker it runs on.
+ */
+void taskgroup_wait(taskgroup_t *group) {
+
+    if (group == NULL) {
+        return;
+    }
+
+    workerpool_help_wait(group->pool, taskgroup_done, group, &group->mutex, &group->done_notify);
+}
+
+static int taskgroup_done(void *ptr) {
+
+    return atomic_load(&((taskgroup_t*)ptr)->pending) == 0;
+}
+
+/*
+ * Return number of tasks of group not finished yet.
+ */
+long taskgroup_pending(taskgroup_t *group) {
+
+    if (group == NULL) {
+        return 0;
+    }
+    return atomic_load(&group->pending);
+}
+
+/*
+ * Destroy group.
+ */
+void taskgroup_destroy(taskgroup_t *group) {
+
+    if (group == NULL) {
+        return;
+    }
+    pthread_mutex_destroy(&group->mutex);
+    pthread_cond_destroy(&group->done_notify);
+    free(group);
+}
+
+/*
+ * Task function of a group member, runs the task and counts it down.
+ */
+void taskgroup_task_func(void *ptr) {
+
+    grouptask_t *grouptask = (grouptask_t*)ptr;
+    taskgroup_t *group = grouptask->group;
+    grouptask->func(grouptask->args);
+    taskgroup_task_done(group);
+}
+
+/*
+ * Cancel a group member left in a pool which was shut down. The task of
+ * the member goes to cancel, if any, and is counted down as finished.
+ */
+void taskgroup_task_cancel(void *ptr, void (*cancel)(task_t*)) {
+
+    grouptask_t *grouptask = (grouptask_t*)ptr;
+    taskgroup_t *group = grouptask->group;
+    if (cancel != NULL) {
+        task_t task = { .func = grouptask->func, .args = grouptask->args };
+        cancel(&task);
+    }
+    taskgroup_task_done(group);
+}
+
+/*
+ * Count down a finished task.
+ * Only the count down to zero takes the lock, other tasks never touch the
+ * group after their count down.
+ */
+static void taskgroup_task_done(taskgroup_t *group) {
+
+    long pending = atomic_load(&group->pending);
+    while (pending > 1) {
+        if (atomic_compare_exchange_weak(&group->pending, &pending, pending - 1)) {
+            return;
+        }
+    }
+
+    pthread_mutex_lock(&group->mutex);
+    if (atomic_fetch_sub(&group->pending, 1) == 1) {
+        pthread_cond_broadcast(&group->done_notify);
+    }
+    pthread_mutex_unlock(&group->mutex);
+}
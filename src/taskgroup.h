@@ -0,0 +1,56 @@
+/*
+ * Task group
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2016 Mervin <mofei2816@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef TASKGROUP_H_
+#define TASKGROUP_H_
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+
+#include "workerpool.h"
+
+/* struct and types  */
+
+typedef struct taskgroup_s {
+    workerpool_t *pool;                 /* pool tasks were put to */
+    atomic_long pending;                /* tasks not finished yet */
+    pthread_mutex_t mutex;
+    pthread_cond_t done_notify;
+} taskgroup_t; // countdown of a group of tasks
+
+/* taskgroup functions */
+
+taskgroup_t* taskgroup_new();
+void taskgroup_init(taskgroup_t * __restrict);
+int  workerpool_group_put(workerpool_t *, taskgroup_t * __restrict, void (*)(void*), void*);
+void taskgroup_wait(taskgroup_t * __restrict);
+long taskgroup_pending(taskgroup_t * __restrict);
+void taskgroup_destroy(taskgroup_t * __restrict);
+void taskgroup_task_func(void *);
+void taskgroup_task_cancel(void *, void (*)(task_t*));
+
+#endif /* TASKGROUP_H_ */
@@ -0,0 +1,225 @@
+/*
+ * Parallel loops
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2016 Mervin <mofei2816@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <string.h>
+
+#include "taskloop.h"
+
+typedef struct taskloop_s {
+    workerpool_t *pool;
+    size_t grain;                                   /* smallest range split off */
+    void (*body)(size_t, size_t, void*);            /* body of parallel for */
+    void (*reduce)(size_t, size_t, void*, void*);   /* body of parallel reduce */
+    void (*join)(void*, const void*, void*);        /* merges a partial into result */
+    const void *identity;                           /* initial value of partials */
+    void *result;                                   /* guarded by mutex */
+    size_t size;                                    /* size of result */
+    void *ctx;
+    atomic_size_t remaining;                        /* indices not done yet */
+    atomic_int cancelled;                           /* a split was cancelled by shutdown */
+    pthread_mutex_t mutex;
+    pthread_cond_t done_notify;
+} taskloop_t; // state of a parallel loop
+
+typedef struct looptask_s {
+    taskloop_t *loop;
+    size_t begin;
+    size_t end;
+} looptask_t; // range of a parallel loop
+
+static int  taskloop_start(taskloop_t * __restrict, size_t, size_t);
+static void taskloop_run(taskloop_t * __restrict, size_t, size_t);
+static void taskloop_done(taskloop_t * __restrict, size_t);
+static int  taskloop_finished(void *);
+
+/*
+ * Run body over [begin, end) on pool and wait until it is done.
+ * Body gets subranges of at least grain indices, except for the last,
+ * and ctx. A range is only split while other workers are idle, so a busy
+ * pool runs it in few large pieces. Grain 0 picks one from the pool size.
+ * The calling thread takes part.
+ * Return 0 if success or -1, also when the pool was shut down before all
+ * indices ran.
+ */
+int workerpool_parallel_for(workerpool_t *pool, size_t begin, size_t end, size_t grain,
+                            void (*body)(size_t, size_t, void*), void *ctx) {
+
+    if (workerpool_status(pool) == INVALID || body == NULL) {
+        return -1;
+    }
+
+    taskloop_t loop = { .pool = pool, .grain = grain, .body = body, .ctx = ctx };
+    return taskloop_start(&loop, begin, end);
+}
+
+/*
+ * Reduce [begin, end) on pool into result of size bytes and wait until it
+ * is done. Every piece of work starts a partial as a copy of identity and
+ * body adds its subrange to it, join merges partials into result, which
+ * starts as identity too. Join must be associative and commutative, as
+ * partials are merged in any order. Ranges are split like parallel for.
+ * Return 0 if success or -1, also when the pool was shut down before all
+ * indices ran.
+ */
+int workerpool_parallel_reduce(workerpool_t *pool, size_t begin, size_t end, size_t grain,
+                               void (*body)(size_t, size_t, void*, void*),
+                               void (*join)(void*, const void*, void*),
+                               const void *identity, void *result, size_t size, void *ctx) {
+
+    if (workerpool_status(pool) == INVALID || body == NULL || join == NULL ||
+        identity == NULL || result == NULL) {
+        return -1;
+    }
+
+    memcpy(result, identity, size);
+    taskloop_t loop = { .pool = pool, .grain = grain, .reduce = body, .join = join,
+                        .identity = identity, .result = result, .size = size, .ctx = ctx };
+    return taskloop_start(&loop, begin, end);
+}
+
+/*
+ * Run loop over [begin, end) in the calling thread, and wait for the
+ * ranges split off to other workers, running tasks of the pool meanwhile.
+ * Return 0 if success or -1.
+ */
+static int taskloop_start(taskloop_t *loop, size_t begin, size_t end) {
+
+    if (begin >= end) {
+        return 0;
+    }
+    if (loop->grain == 0) {
+        size_t chunks = (size_t)workerpool_poolsize(loop->pool) * LOOP_CHUNKS;
+        loop->grain = (end - begin) / (chunks > 0 ? chunks : 1);
+        loop->grain = loop->grain > 0 ? loop->grain : 1;
+    }
+    atomic_init(&loop->remaining, end - begin);
+    atomic_init(&loop->cancelled, 0);
+    pthread_mutex_init(&loop->mutex, NULL);
+    pthread_cond_init(&loop->done_notify, NULL);
+
+    taskloop_run(loop, begin, end);
+    workerpool_help_wait(loop->pool, taskloop_finished, loop, &loop->mutex, &loop->done_notify);
+    pthread_mutex_destroy(&loop->mutex);
+    pthread_cond_destroy(&loop->done_notify);
+    return atomic_load(&loop->cancelled) ? -1 : 0;
+}
+
+/*
+ * Run range [begin, end) of loop a grain at a time.
+ * Before each grain the upper half of what is left is split off for as
+ * long as some worker is parked or spinning, so ranges are only divided
+ * when there is somebody to take them.
+ */
+static void taskloop_run(taskloop_t *loop, size_t begin, size_t end) {
+
+    // Partial of reduce, merged straight into result under lock when there
+    // is no memory for it.
+    void *partial = NULL;
+    if (loop->reduce != NULL && (partial = malloc(loop->size > 0 ? loop->size : 1)) != NULL) {
+        memcpy(partial, loop->identity, loop->size);
+    }
+
+    size_t count = 0;
+    workerpool_t *pool = loop->pool;
+    while (begin < end) {
+        while (end - begin > loop->grain &&
+               atomic_load_explicit(&pool->idle_workers, memory_order_relaxed) +
+               atomic_load_explicit(&pool->spinning_workers, memory_order_relaxed) > 0) {
+            looptask_t split = { .loop = loop, .begin = begin + (end - begin) / 2, .end = end };
+            if (workerpool_task_put_inline(pool, taskloop_task_func, &split, sizeof(looptask_t)) == -1) {
+                break;
+            }
+            end = split.begin;
+        }
+
+        size_t stop = end - begin > loop->grain ? begin + loop->grain : end;
+        if (loop->body != NULL) {
+            loop->body(begin, stop, loop->ctx);
+        } else if (partial != NULL) {
+            loop->reduce(begin, stop, partial, loop->ctx);
+        } else {
+            pthread_mutex_lock(&loop->mutex);
+            loop->reduce(begin, stop, loop->result, loop->ctx);
+            pthread_mutex_unlock(&loop->mutex);
+        }
+        count += stop - begin;
+        begin = stop;
+    }
+
+    if (partial != NULL) {
+        pthread_mutex_lock(&loop->mutex);
+        loop->join(loop->result, partial, loop->ctx);
+        pthread_mutex_unlock(&loop->mutex);
+        free(partial);
+    }
+    taskloop_done(loop, count);
+}
+
+/*
+ * Task function of a split of a loop.
+ */
+void taskloop_task_func(void *ptr) {
+
+    looptask_t *task = (looptask_t*)ptr;
+    taskloop_run(task->loop, task->begin, task->end);
+}
+
+/*
+ * Cancel a split of a loop left in a pool which was shut down. Its indices
+ * count as done without running, the loop returns -1.
+ */
+void taskloop_task_cancel(void *ptr, void (*cancel)(task_t*)) {
+
+    (void)cancel;
+    looptask_t *task = (looptask_t*)ptr;
+    atomic_store(&task->loop->cancelled, 1);
+    taskloop_done(task->loop, task->end - task->begin);
+}
+
+static int taskloop_finished(void *ptr) {
+
+    return atomic_load(&((taskloop_t*)ptr)->remaining) == 0;
+}
+
+/*
+ * Count down indices done.
+ * Only the count down to zero takes the lock.
+ */
+static void taskloop_done(taskloop_t *loop, size_t count) {
+
+    size_t remaining = atomic_load(&loop->remaining);
+    while (remaining > count) {
+        if (atomic_compare_exchange_weak(&loop->remaining, &remaining, remaining - count)) {
+            return;
+        }
+    }
+
+    pthread_mutex_lock(&loop->mutex);
+    if (atomic_fetch_sub(&loop->remaining, count) == count) {
+        pthread_cond_broadcast(&loop->done_notify);
+    }
+    pthread_mutex_unlock(&loop->mutex);
+}
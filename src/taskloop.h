@@ -0,0 +1,47 @@
+/*
+ * Parallel loops
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2016 Mervin <mofei2816@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef TASKLOOP_H_
+#define TASKLOOP_H_
+
+#include <stdlib.h>
+
+#include "workerpool.h"
+
+#define LOOP_CHUNKS     0x40    /* chunks per worker when grain is 0 */
+
+/* taskloop functions */
+
+int  workerpool_parallel_for(workerpool_t *, size_t, size_t, size_t,
+                             void (*)(size_t, size_t, void*), void*);
+int  workerpool_parallel_reduce(workerpool_t *, size_t, size_t, size_t,
+                                void (*)(size_t, size_t, void*, void*),
+                                void (*)(void*, const void*, void*),
+                                const void * __restrict, void * __restrict, size_t, void*);
+void taskloop_task_func(void *);
+void taskloop_task_cancel(void *, void (*)(task_t*));
+
+#endif /* TASKLOOP_H_ */
@@ -24,8 +24,19 @@
  * SOFTWARE.
  */
 
+#include <string.h>
+
 #include "taskqueue.h"
 
+const char task_args_inline = 0;
+
+static inline int taskqueue_size_locked(taskqueue_t * __restrict);
+static tasknode_t* taskqueue_node_alloc(taskqueue_t * __restrict);
+static tasknode_t* taskqueue_chain(taskqueue_t * __restrict, const task_t * __restrict, int, uint64_t, tasknode_t **);
+static void taskqueue_node_free(taskqueue_t * __restrict, tasknode_t * __restrict);
+static tasknodecache_t* tasknodepool_cache(tasknodepool_t * __restrict);
+static void tasknodepool_cache_release(void *);
+
 taskqueue_t* taskqueue_new() {
     return (taskqueue_t*)malloc(sizeof(taskqueue_t));
 }
@@ -38,12 +49,25 @@ void taskqueue_init(taskqueue_t* queue) {
     if (queue == NULL) {
         return;
     }
-    queue->size = 0;
+    atomic_init(&queue->size, 0);
     queue->first = NULL;
     queue->last = NULL;
+    queue->nodepool = NULL;
     return;
 }
 
+/*
+ * Init queue with nodes allocated from nodepool.
+ */
+void taskqueue_init_nodepool(taskqueue_t *queue, tasknodepool_t *nodepool) {
+
+    if (queue == NULL) {
+        return;
+    }
+    taskqueue_init(queue);
+    queue->nodepool = nodepool;
+}
+
 /*
  * Put task into queue.
  */
@@ -53,30 +77,101 @@ int taskqueue_put(taskqueue_t *queue, void (*func)(void*), void *arg) {
         return -1;
     }
     
-    task_t *task = (task_t*)malloc(sizeof(task_t));
-    if (task == NULL) {
+    tasknode_t *item = taskqueue_node_alloc(queue);
+    if (item == NULL) {
         return -1;
     }
-    task->func = func;
-    task->args = arg;
-    
-    tasknode_t *item = (tasknode_t*)malloc(sizeof(tasknode_t));
-    item->task = task;
+    item->task.func = func;
+    item->task.args = arg;
+    item->task.enqueued = 0;
     item->next = NULL;
     
     if (queue->first == NULL) {
         queue->first = item;
         queue->last = item;
-        queue->size = 1;
+        atomic_store_explicit(&queue->size, 1, memory_order_release);
     } else {
         if (queue->last == NULL) {
+            taskqueue_node_free(queue, item);
             return -1;
         }
         queue->last->next = item;
         queue->last = item;
-        queue->size++;
+        atomic_store_explicit(&queue->size, taskqueue_size_locked(queue) + 1, memory_order_release);
+    }
+    return taskqueue_size_locked(queue);
+}
+
+/*
+ * Put a batch of tasks into queue.
+ * Nodes are linked into a chain first and appended at once.
+ * Return size of queue if success or -1.
+ */
+int taskqueue_put_batch(taskqueue_t *queue, const task_t *tasks, int n) {
+    
+    return taskqueue_put_batch_stamp(queue, tasks, n, 0);
+}
+
+/*
+ * Put a batch of tasks into queue like taskqueue_put_batch, stamping the
+ * nodes with enqueued while they are linked unless it is 0.
+ * Return size of queue if success or -1.
+ */
+int taskqueue_put_batch_stamp(taskqueue_t *queue, const task_t *tasks, int n, uint64_t enqueued) {
+    
+    if (queue == NULL || tasks == NULL || n <= 0) {
+        return -1;
+    }
+    
+    tasknode_t *last = NULL;
+    tasknode_t *first = taskqueue_chain(queue, tasks, n, enqueued, &last);
+    if (first == NULL) {
+        return -1;
+    }
+    
+    if (queue->first == NULL) {
+        queue->first = first;
+        atomic_store_explicit(&queue->size, n, memory_order_release);
+    } else {
+        if (queue->last == NULL) {
+            while (first != NULL) {
+                tasknode_t *tmp = first->next;
+                taskqueue_node_free(queue, first);
+                first = tmp;
+            }
+            return -1;
+        }
+        queue->last->next = first;
+        atomic_store_explicit(&queue->size, taskqueue_size_locked(queue) + n, memory_order_release);
+    }
+    queue->last = last;
+    return taskqueue_size_locked(queue);
+}
+
+/*
+ * Put a batch of tasks in front of the tasks in queue, keeping their
+ * order, so tasks taken too early are the next to be taken again.
+ * Return size of queue if success or -1.
+ */
+int taskqueue_put_front_batch(taskqueue_t *queue, const task_t *tasks, int n) {
+    
+    if (queue == NULL || tasks == NULL || n <= 0) {
+        return -1;
+    }
+    
+    tasknode_t *last = NULL;
+    tasknode_t *first = taskqueue_chain(queue, tasks, n, 0, &last);
+    if (first == NULL) {
+        return -1;
+    }
+    
+    last->next = queue->first;
+    if (queue->first == NULL) {
+        queue->last = last;
     }
-    return queue->size;
+    queue->first = first;
+    atomic_store_explicit(&queue->size, taskqueue_size_locked(queue) + n, memory_order_release);
+    return taskqueue_size_locked(queue);
 }
 
 /*
@@ -85,18 +180,18 @@ int taskqueue_put(taskqueue_t *queue, void (*func)(void*), void *arg) {
  */
 int taskqueue_take(taskqueue_t *queue, task_t *task) {
     
-    if (queue == NULL || queue->first == NULL || queue->size == 0) {
+    if (queue == NULL || queue->first == NULL || taskqueue_size_locked(queue) == 0) {
         return -1;
     }
 
-    task->func = queue->first->task->func;
-    task->args = queue->first->task->args;
+    *task = queue->first->task;
     tasknode_t *tmp = queue->first;
     queue->first = queue->first->next;
-    tasknode_destory(tmp);
+    taskqueue_node_free(queue, tmp);
     
-    if (queue->size > 0) {
-        queue->size--;
+    int size = taskqueue_size_locked(queue);
+    if (size > 0) {
+        atomic_store_explicit(&queue->size, size - 1, memory_order_release);
     }
     if (queue->first == NULL) {
         queue->last = NULL;
@@ -104,6 +199,63 @@ int taskqueue_take(taskqueue_t *queue, task_t *task) {
     return 0;
 }
 
+/*
+ * Take the task of the first node skip returns 0 for and remove the node
+ * from queue. Skipped tasks keep their place.
+ * Return 0 if success or -1.
+ */
+int taskqueue_take_unless(taskqueue_t *queue, task_t *task, int (*skip)(const task_t*)) {
+    
+    if (queue == NULL || task == NULL || skip == NULL) {
+        return -1;
+    }
+    
+    tasknode_t *prev = NULL;
+    for (tasknode_t *node = queue->first; node != NULL; prev = node, node = node->next) {
+        if (skip(&node->task)) {
+            continue;
+        }
+        *task = node->task;
+        if (prev == NULL) {
+            queue->first = node->next;
+        } else {
+            prev->next = node->next;
+        }
+        if (queue->last == node) {
+            queue->last = prev;
+        }
+        taskqueue_node_free(queue, node);
+        atomic_store_explicit(&queue->size, taskqueue_size_locked(queue) - 1, memory_order_release);
+        return 0;
+    }
+    return -1;
+}
+
+/*
+ * Take up to n tasks from queue in order.
+ * Return number of tasks taken.
+ */
+int taskqueue_take_batch(taskqueue_t *queue, task_t *tasks, int n) {
+    
+    if (queue == NULL || tasks == NULL) {
+        return 0;
+    }
+    
+    int count = 0;
+    while (count < n && queue->first != NULL) {
+        tasknode_t *tmp = queue->first;
+        tasks[count++] = tmp->task;
+        queue->first = tmp->next;
+        taskqueue_node_free(queue, tmp);
+    }
+    int size = taskqueue_size_locked(queue);
+    atomic_store_explicit(&queue->size, size > count ? size - count : 0, memory_order_release);
+    if (queue->first == NULL) {
+        queue->last = NULL;
+    }
+    return count;
+}
+
 /*
  * Clear all task from queue.
  */
@@ -117,11 +269,12 @@ void taskqueue_clear(taskqueue_t *queue) {
     
     while (node_cursor != NULL) {
         tasknode_t *tmp = node_cursor->next;
-        tasknode_destory(node_cursor);
+        taskqueue_node_free(queue, node_cursor);
         node_cursor = tmp;
     }
+    queue->first = NULL;
     queue->last = NULL;
-    queue->size = 0;
+    atomic_store_explicit(&queue->size, 0, memory_order_release);
 }
 
 /*
@@ -151,7 +304,278 @@ void task_destroy(task_t *task) {
     if (task == NULL) {
         return;
     }
-    free(task->args);
+    if (task->args != TASK_ARGS_INLINE) {
+        free(task->args);
+    }
     free(task);
 }
 
+/*
+ * Init task with a copy of size bytes of arg stored inline.
+ * Return 0 if success or -1 when arg does not fit.
+ */
+int task_init_inline(task_t *task, void (*func)(void*), const void *arg, size_t size) {
+    
+    if (task == NULL || size > TASK_INLINE_SIZE || (arg == NULL && size > 0)) {
+        return -1;
+    }
+    task->func = func;
+    task->args = TASK_ARGS_INLINE;
+    if (size > 0) {
+        memcpy(task->data, arg, size);
+    }
+    task->enqueued = 0;
+    return 0;
+}
+
+/*
+ * Return size of queue to the owner of its lock, the only writer.
+ */
+static inline int taskqueue_size_locked(taskqueue_t *queue) {
+    return atomic_load_explicit(&queue->size, memory_order_relaxed);
+}
+
+static tasknode_t* taskqueue_node_alloc(taskqueue_t *queue) {
+    
+    if (queue->nodepool == NULL) {
+        return (tasknode_t*)malloc(sizeof(tasknode_t));
+    }
+    return tasknodepool_alloc(queue->nodepool);
+}
+
+/*
+ * Link nodes for a batch of tasks into a chain, setting last to its end.
+ * Tasks are stamped with enqueued unless it is 0.
+ * Return the first node of the chain, or NULL with no node kept.
+ */
+static tasknode_t* taskqueue_chain(taskqueue_t *queue, const task_t *tasks, int n, uint64_t enqueued, tasknode_t **last) {
+    
+    tasknode_t *first = NULL;
+    for (int i = 0; i < n; i++) {
+        tasknode_t *item = tasks[i].func == NULL ? NULL : taskqueue_node_alloc(queue);
+        if (item == NULL) {
+            while (first != NULL) {
+                tasknode_t *tmp = first->next;
+                taskqueue_node_free(queue, first);
+                first = tmp;
+            }
+            return NULL;
+        }
+        item->task = tasks[i];
+        if (enqueued != 0) {
+            item->task.enqueued = enqueued;
+        }
+        item->next = NULL;
+        if (first == NULL) {
+            first = item;
+        } else {
+            (*last)->next = item;
+        }
+        *last = item;
+    }
+    return first;
+}
+
+static void taskqueue_node_free(taskqueue_t *queue, tasknode_t *node) {
+    
+    if (queue->nodepool == NULL) {
+        tasknode_destory(node);
+        return;
+    }
+    tasknodepool_free(queue->nodepool, node);
+}
+
+tasknodepool_t* tasknodepool_new() {
+    return (tasknodepool_t*)malloc(sizeof(tasknodepool_t));
+}
+
+/*
+ * Init node pool.
+ * Return 0 if success or -1.
+ */
+int tasknodepool_init(tasknodepool_t *nodepool) {
+    
+    if (nodepool == NULL) {
+        return -1;
+    }
+    if (pthread_key_create(&nodepool->cache_key, tasknodepool_cache_release) != 0) {
+        return -1;
+    }
+    pthread_mutex_init(&nodepool->mutex, NULL);
+    nodepool->free = NULL;
+    nodepool->slabs = NULL;
+    nodepool->caches = NULL;
+    return 0;
+}
+
+/*
+ * Allocate a node from the cache of current thread.
+ * The cache is refilled from the shared free list, which grows by a
+ * whole slab when it runs dry.
+ */
+tasknode_t* tasknodepool_alloc(tasknodepool_t *nodepool) {
+    
+    tasknodecache_t *cache = tasknodepool_cache(nodepool);
+    if (cache == NULL) {
+        return (tasknode_t*)NULL;
+    }
+    
+    if (cache->free == NULL) {
+        pthread_mutex_lock(&nodepool->mutex);
+        if (nodepool->free == NULL) {
+            tasknodeslab_t *slab = (tasknodeslab_t*)malloc(sizeof(tasknodeslab_t));
+            if (slab == NULL) {
+                pthread_mutex_unlock(&nodepool->mutex);
+                return (tasknode_t*)NULL;
+            }
+            slab->next = nodepool->slabs;
+            nodepool->slabs = slab;
+            for (int i = 0; i < TASKNODE_SLAB_SIZE - 1; i++) {
+                slab->nodes[i].next = slab->nodes + i + 1;
+            }
+            slab->nodes[TASKNODE_SLAB_SIZE - 1].next = NULL;
+            nodepool->free = slab->nodes;
+        }
+        
+        // Move a batch from the shared free list to the cache.
+        tasknode_t *last = nodepool->free;
+        int size = 1;
+        while (size < TASKNODE_CACHE_SIZE && last->next != NULL) {
+            last = last->next;
+            size++;
+        }
+        cache->free = nodepool->free;
+        nodepool->free = last->next;
+        last->next = NULL;
+        cache->size = size;
+        pthread_mutex_unlock(&nodepool->mutex);
+    }
+    
+    tasknode_t *node = cache->free;
+    cache->free = node->next;
+    cache->size--;
+    return node;
+}
+
+/*
+ * Return a node to the cache of current thread.
+ * A batch goes back to the shared free list when the cache grows too big,
+ * so nodes freed by workers flow back to producers.
+ */
+void tasknodepool_free(tasknodepool_t *nodepool, tasknode_t *node) {
+    
+    if (node == NULL) {
+        return;
+    }
+    tasknodecache_t *cache = tasknodepool_cache(nodepool);
+    if (cache == NULL) {
+        pthread_mutex_lock(&nodepool->mutex);
+        node->next = nodepool->free;
+        nodepool->free = node;
+        pthread_mutex_unlock(&nodepool->mutex);
+        return;
+    }
+    
+    node->next = cache->free;
+    cache->free = node;
+    cache->size++;
+    
+    if (cache->size >= TASKNODE_CACHE_SIZE * 2) {
+        tasknode_t *first = cache->free;
+        tasknode_t *last = first;
+        for (int i = 1; i < TASKNODE_CACHE_SIZE; i++) {
+            last = last->next;
+        }
+        cache->free = last->next;
+        cache->size -= TASKNODE_CACHE_SIZE;
+        
+        pthread_mutex_lock(&nodepool->mutex);
+        last->next = nodepool->free;
+        nodepool->free = first;
+        pthread_mutex_unlock(&nodepool->mutex);
+    }
+}
+
+/*
+ * Destroy node pool and all nodes, including nodes cached by other threads.
+ */
+void tasknodepool_destroy(tasknodepool_t *nodepool) {
+    
+    if (nodepool == NULL) {
+        return;
+    }
+    pthread_key_delete(nodepool->cache_key);
+    
+    tasknodecache_t *cache = nodepool->caches;
+    while (cache != NULL) {
+        tasknodecache_t *tmp = cache->next;
+        free(cache);
+        cache = tmp;
+    }
+    tasknodeslab_t *slab = nodepool->slabs;
+    while (slab != NULL) {
+        tasknodeslab_t *tmp = slab->next;
+        free(slab);
+        slab = tmp;
+    }
+    pthread_mutex_destroy(&nodepool->mutex);
+    free(nodepool);
+}
+
+/*
+ * Return cache of current thread, create it on first use.
+ */
+static tasknodecache_t* tasknodepool_cache(tasknodepool_t *nodepool) {
+    
+    tasknodecache_t *cache = (tasknodecache_t*)pthread_getspecific(nodepool->cache_key);
+    if (cache != NULL) {
+        return cache;
+    }
+    
+    cache = (tasknodecache_t*)malloc(sizeof(tasknodecache_t));
+    if (cache == NULL) {
+        return (tasknodecache_t*)NULL;
+    }
+    cache->nodepool = nodepool;
+    cache->free = NULL;
+    cache->size = 0;
+    cache->prev = NULL;
+    
+    pthread_mutex_lock(&nodepool->mutex);
+    cache->next = nodepool->caches;
+    if (nodepool->caches != NULL) {
+        nodepool->caches->prev = cache;
+    }
+    nodepool->caches = cache;
+    pthread_mutex_unlock(&nodepool->mutex);
+    
+    pthread_setspecific(nodepool->cache_key, cache);
+    return cache;
+}
+
+/*
+ * Thread exit destructor, give cached nodes back to the shared free list.
+ */
+static void tasknodepool_cache_release(void *ptr) {
+    
+    tasknodecache_t *cache = (tasknodecache_t*)ptr;
+    tasknodepool_t *nodepool = cache->nodepool;
+    
+    pthread_mutex_lock(&nodepool->mutex);
+    while (cache->free != NULL) {
+        tasknode_t *node = cache->free;
+        cache->free = node->next;
+        node->next = nodepool->free;
+        nodepool->free = node;
+    }
+    if (cache->prev != NULL) {
+        cache->prev->next = cache->next;
+    } else {
+        nodepool->caches = cache->next;
+    }
+    if (cache->next != NULL) {
+        cache->next->prev = cache->prev;
+    }
+    pthread_mutex_unlock(&nodepool->mutex);
+    free(cache);
+}
@@ -27,38 +27,109 @@
 #ifndef TASKQUEUE_H_
 #define TASKQUEUE_H_
 
+#include <pthread.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <stdatomic.h>
+
+#define CACHE_LINE_SIZE     64
+#define TASKNODE_SLAB_SIZE  0x100   /* nodes allocated at once */
+#define TASKNODE_CACHE_SIZE 0x20    /* nodes moved between cache and pool at once */
+#define TASK_INLINE_SIZE    40      /* argument bytes stored in the task itself */
+#define TASK_ARGS_INLINE    ((void*)&task_args_inline)  /* args marker of inline argument */
 
 #define NEW_TASKQUEUE \
         (taskqueue_t*)malloc(sizeof(taskqueue_t))
 
 /* struct and types  */
 
+// Only its address is used, no argument of a task points to it.
+extern const char task_args_inline;
+
+/*
+ * Task with its argument either behind args, or copied into data when
+ * args is TASK_ARGS_INLINE. A task fills one cache line. Its layout is the
+ * same with or without statistics, so a library and an application built
+ * with different flags agree on it.
+ */
 typedef struct task_s {
     void (*func)(void*);
     void *args;
+    _Alignas(16) unsigned char data[TASK_INLINE_SIZE];
+    uint64_t enqueued;              /* put time in nanoseconds, only stamped with WORKERPOOL_STATS */
 } task_t; // task
 
 typedef struct tasknode_s {
-    task_t *task;
+    task_t task;
     struct tasknode_s *next;
 } tasknode_t; // task node
 
+typedef struct tasknodeslab_s {
+    struct tasknodeslab_s *next;
+    tasknode_t nodes[TASKNODE_SLAB_SIZE];
+} tasknodeslab_t; // slab of task nodes
+
+typedef struct tasknodecache_s {
+    struct tasknodepool_s *nodepool;
+    tasknode_t *free;
+    int size;
+    struct tasknodecache_s *prev, *next;
+} tasknodecache_t; // thread local cache of task nodes
+
+typedef struct tasknodepool_s {
+    pthread_mutex_t mutex;
+    pthread_key_t cache_key;
+    tasknode_t *free;               /* shared free list */
+    tasknodeslab_t *slabs;          /* all slabs */
+    tasknodecache_t *caches;        /* all thread caches */
+} tasknodepool_t; // task node allocator
+
 typedef struct taskqueue_s {
     tasknode_t *first;
     tasknode_t *last;
-    int size;
+    atomic_int size;                /* written under the queue lock, read by anyone */
+    tasknodepool_t *nodepool;       /* node allocator, NULL for malloc */
 } taskqueue_t; // task queue
 
 /* taskqueue functions */
 
 taskqueue_t* taskqueue_new();
 void taskqueue_init(taskqueue_t * __restrict);
+void taskqueue_init_nodepool(taskqueue_t * __restrict, tasknodepool_t * __restrict);
 int  taskqueue_put(taskqueue_t * __restrict, void (*)(void *), void *);
+int  taskqueue_put_batch(taskqueue_t * __restrict, const task_t * __restrict, int);
+int  taskqueue_put_batch_stamp(taskqueue_t * __restrict, const task_t * __restrict, int, uint64_t);
+int  taskqueue_put_front_batch(taskqueue_t * __restrict, const task_t * __restrict, int);
 int  taskqueue_take(taskqueue_t * __restrict, task_t * __restrict);
+int  taskqueue_take_batch(taskqueue_t * __restrict, task_t * __restrict, int);
+int  taskqueue_take_unless(taskqueue_t * __restrict, task_t * __restrict, int (*)(const task_t*));
 void taskqueue_clear(taskqueue_t * __restrict);
 void taskqueue_destroy(taskqueue_t * __restrict);
 void tasknode_destory(tasknode_t * __restrict);
 void task_destroy(task_t * __restrict);
+int  task_init_inline(task_t * __restrict, void (*)(void *), const void * __restrict, size_t);
+
+/*
+ * Return number of tasks in queue. Safe without the lock of the queue,
+ * as the check for work before a worker parks needs.
+ */
+static inline int taskqueue_size(taskqueue_t *queue) {
+    return atomic_load(&queue->size);
+}
+
+/*
+ * Return the argument the task function gets.
+ */
+static inline void* task_args(task_t *task) {
+    return task->args == TASK_ARGS_INLINE ? (void*)task->data : task->args;
+}
+
+/* tasknodepool functions */
+
+tasknodepool_t* tasknodepool_new();
+int  tasknodepool_init(tasknodepool_t * __restrict);
+tasknode_t* tasknodepool_alloc(tasknodepool_t * __restrict);
+void tasknodepool_free(tasknodepool_t * __restrict, tasknode_t * __restrict);
+void tasknodepool_destroy(tasknodepool_t * __restrict);
 
 #endif /* TASKQUEUE_H_ */
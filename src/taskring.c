@@ -0,0 +1,224 @@
+/*
+ * Task ring
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2016 Mervin <mofei2816@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "taskring.h"
+
+taskring_t* taskring_new() {
+    return (taskring_t*)malloc(sizeof(taskring_t));
+}
+
+/*
+ * Init ring holding at most capacity tasks. The cells are rounded up to
+ * power of two, the capacity is enforced on its own.
+ * Return 0 if success or -1.
+ */
+int taskring_init(taskring_t *ring, uint capacity) {
+
+    if (ring == NULL || capacity == 0) {
+        return -1;
+    }
+
+    long size = 2;
+    while (size < (long)capacity) {
+        size <<= 1;
+    }
+
+    // Align cells to cache line so the ring never shares a line with neighbours.
+    if (posix_memalign((void**)&ring->cells, CACHE_LINE_SIZE, sizeof(taskcell_t) * size) != 0) {
+        return -1;
+    }
+    for (long i = 0; i < size; i++) {
+        atomic_init(&ring->cells[i].sequence, i);
+    }
+    ring->mask = size - 1;
+    ring->limit = (long)capacity;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    return 0;
+}
+
+/*
+ * Put task into ring.
+ * Return 0 if success or -1 when ring is full.
+ */
+int taskring_put(taskring_t *ring, const task_t *task) {
+
+    taskcell_t *cell;
+    long pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+    while (1) {
+        cell = ring->cells + (pos & ring->mask);
+        long seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        long dif = seq - pos;
+        if (dif == 0 && pos - atomic_load_explicit(&ring->head, memory_order_acquire) >= ring->limit) {
+            // Ring holds capacity tasks, head only grows so it never gets over.
+            return -1;
+        } else if (dif == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ring->tail, &pos, pos + 1,
+                                                      memory_order_seq_cst,
+                                                      memory_order_relaxed)) {
+                break;
+            }
+        } else if (dif < 0) {
+            // Ring is full.
+            return -1;
+        } else {
+            pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        }
+    }
+
+    cell->task = *task;
+    atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+    return 0;
+}
+
+/*
+ * Put a batch of tasks into ring.
+ * Free cells are reserved with a single compare and swap.
+ * Return number of tasks put, 0 when ring is full.
+ */
+int taskring_put_batch(taskring_t *ring, const task_t *tasks, int n) {
+
+    return taskring_put_batch_stamp(ring, tasks, n, 0);
+}
+
+/*
+ * Put a batch of tasks into ring like taskring_put_batch, stamping the
+ * cells with enqueued as they are filled unless it is 0.
+ * Return number of tasks put, 0 when ring is full.
+ */
+int taskring_put_batch_stamp(taskring_t *ring, const task_t *tasks, int n, uint64_t enqueued) {
+
+    long pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    long count;
+
+    while (1) {
+        // Count free cells from tail for current lap, up to capacity.
+        long room = ring->limit - (pos - atomic_load_explicit(&ring->head, memory_order_acquire));
+        count = 0;
+        while (count < n && count < room) {
+            taskcell_t *cell = ring->cells + ((pos + count) & ring->mask);
+            long seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+            if (seq != pos + count) {
+                break;
+            }
+            count++;
+        }
+        if (count == 0) {
+            taskcell_t *cell = ring->cells + (pos & ring->mask);
+            long seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+            if (seq - pos < 0 || (seq == pos && room <= 0)) {
+                // Ring is full.
+                return 0;
+            }
+            pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+            continue;
+        }
+        if (atomic_compare_exchange_weak_explicit(&ring->tail, &pos, pos + count,
+                                                  memory_order_seq_cst,
+                                                  memory_order_relaxed)) {
+            break;
+        }
+    }
+
+    for (long i = 0; i < count; i++) {
+        taskcell_t *cell = ring->cells + ((pos + i) & ring->mask);
+        cell->task = tasks[i];
+        if (enqueued != 0) {
+            cell->task.enqueued = enqueued;
+        }
+        atomic_store_explicit(&cell->sequence, pos + i + 1, memory_order_release);
+    }
+    return (int)count;
+}
+
+/*
+ * Take the oldest task from ring.
+ * Return 0 if success or -1 when ring is empty.
+ */
+int taskring_take(taskring_t *ring, task_t *task) {
+
+    taskcell_t *cell;
+    long pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+    while (1) {
+        cell = ring->cells + (pos & ring->mask);
+        long seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        long dif = seq - (pos + 1);
+        if (dif == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ring->head, &pos, pos + 1,
+                                                      memory_order_seq_cst,
+                                                      memory_order_relaxed)) {
+                break;
+            }
+        } else if (dif < 0) {
+            // Ring is empty.
+            return -1;
+        } else {
+            pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        }
+    }
+
+    *task = cell->task;
+    atomic_store_explicit(&cell->sequence, pos + ring->mask + 1, memory_order_release);
+    return 0;
+}
+
+/*
+ * Return approximate number of tasks in ring.
+ */
+int taskring_size(taskring_t *ring) {
+
+    if (ring == NULL) {
+        return 0;
+    }
+    long tail = atomic_load_explicit(&ring->tail, memory_order_seq_cst);
+    long head = atomic_load_explicit(&ring->head, memory_order_seq_cst);
+    return tail > head ? (int)(tail - head) : 0;
+}
+
+/*
+ * Return capacity of ring.
+ */
+int taskring_capacity(taskring_t *ring) {
+
+    if (ring == NULL) {
+        return 0;
+    }
+    return (int)ring->limit;
+}
+
+/*
+ * Destroy ring.
+ */
+void taskring_destroy(taskring_t *ring) {
+
+    if (ring == NULL) {
+        return;
+    }
+    free(ring->cells);
+    free(ring);
+}
@@ -0,0 +1,69 @@
+/*
+ * Task ring
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2016 Mervin <mofei2816@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef TASKRING_H_
+#define TASKRING_H_
+
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+
+#include "taskqueue.h"
+
+/* struct and types  */
+
+typedef struct taskcell_s {
+    atomic_long sequence;
+    task_t task;
+} taskcell_t; // task ring cell
+
+/*
+ * Bounded lock-free multi-producer/multi-consumer ring.
+ * Tasks are stored by value, put and take never allocate.
+ */
+typedef struct taskring_s {
+    atomic_long head;
+    char head_pad[CACHE_LINE_SIZE - sizeof(atomic_long)];
+    atomic_long tail;
+    char tail_pad[CACHE_LINE_SIZE - sizeof(atomic_long)];
+    long mask;          /* cells - 1 */
+    long limit;         /* most tasks held at once, the capacity asked for */
+    taskcell_t *cells;
+} taskring_t; // task ring
+
+/* taskring functions */
+
+taskring_t* taskring_new();
+int  taskring_init(taskring_t * __restrict, uint);
+int  taskring_put(taskring_t * __restrict, const task_t * __restrict);
+int  taskring_put_batch(taskring_t * __restrict, const task_t * __restrict, int);
+int  taskring_put_batch_stamp(taskring_t * __restrict, const task_t * __restrict, int, uint64_t);
+int  taskring_take(taskring_t * __restrict, task_t * __restrict);
+int  taskring_size(taskring_t * __restrict);
+int  taskring_capacity(taskring_t * __restrict);
+void taskring_destroy(taskring_t * __restrict);
+
+#endif /* TASKRING_H_ */
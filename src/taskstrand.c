@@ -0,0 +1,202 @@
+/*
+ * Serial task strand
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2016 Mervin <mofei2816@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "taskstrand.h"
+
+static int  taskstrand_drain(taskstrand_t * __restrict);
+static void taskstrand_run_first(taskstrand_t * __restrict);
+
+taskstrand_t* taskstrand_new() {
+    return (taskstrand_t*)malloc(sizeof(taskstrand_t));
+}
+
+/*
+ * Allocate and init a strand on pool running STRAND_BATCH tasks at a time.
+ * Return the strand or NULL.
+ */
+taskstrand_t* workerpool_strand_new(workerpool_t *pool) {
+
+    if (workerpool_status(pool) == INVALID) {
+        return NULL;
+    }
+    taskstrand_t *strand = taskstrand_new();
+    if (strand == NULL) {
+        return NULL;
+    }
+    taskstrand_init(strand, pool, STRAND_BATCH);
+    return strand;
+}
+
+/*
+ * Init strand on pool, running at most batch tasks each time it is
+ * scheduled. The strand must be destroyed before the pool.
+ */
+void taskstrand_init(taskstrand_t *strand, workerpool_t *pool, uint batch) {
+
+    if (strand == NULL) {
+        return;
+    }
+    strand->pool = pool;
+    taskqueue_init_nodepool(&strand->queue, pool->nodepool);
+    pthread_mutex_init(&strand->mutex, NULL);
+    strand->scheduled = 0;
+    strand->batch = batch > 0 ? batch : 1;
+
+    // Spread strands over the shards, each strand keeps to one.
+    uint64_t hash = (uint64_t)(uintptr_t)strand * 0x9E3779B97F4A7C15ULL;
+    strand->shard = (uint)(hash >> 32);
+}
+
+/*
+ * Put a task to strand. It runs after all tasks put to strand before,
+ * and never at the same time as any of them.
+ * Return 0 if success or -1.
+ */
+int taskstrand_put(taskstrand_t *strand, void (*taskfunc)(void*), void *arg) {
+
+    if (strand == NULL || taskfunc == NULL) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&strand->mutex);
+    if (taskqueue_put(&strand->queue, taskfunc, arg) == -1) {
+        pthread_mutex_unlock(&strand->mutex);
+        return -1;
+    }
+    int schedule = !strand->scheduled;
+    strand->scheduled = 1;
+    pthread_mutex_unlock(&strand->mutex);
+
+    // Only an idle strand is put to the pool, a scheduled one picks the
+    // task up itself. The task is accepted already, so the runner bypasses
+    // the overflow policy instead of being refused or dropped.
+    if (schedule && workerpool_task_put_spill(strand->pool, strand->shard, taskstrand_task_func, strand) == -1) {
+        taskstrand_run_first(strand);
+    }
+    return 0;
+}
+
+/*
+ * Return number of tasks of strand not run yet.
+ */
+long taskstrand_pending(taskstrand_t *strand) {
+
+    if (strand == NULL) {
+        return 0;
+    }
+    pthread_mutex_lock(&strand->mutex);
+    long pending = taskqueue_size(&strand->queue);
+    pthread_mutex_unlock(&strand->mutex);
+    return pending;
+}
+
+/*
+ * Destroy strand. Tasks not run yet are dropped, so wait for the strand
+ * to drain, for instance by stopping the pool, before.
+ */
+void taskstrand_destroy(taskstrand_t *strand) {
+
+    if (strand == NULL) {
+        return;
+    }
+    taskqueue_clear(&strand->queue);
+    pthread_mutex_destroy(&strand->mutex);
+    free(strand);
+}
+
+/*
+ * Run a batch of strand, then put the strand back to the end of the pool
+ * queue when tasks are left so other work gets its turn.
+ * Should the pool be out of memory, the runner keeps draining the strand.
+ */
+void taskstrand_task_func(void *ptr) {
+
+    taskstrand_t *strand = (taskstrand_t*)ptr;
+    if (taskstrand_drain(strand) &&
+        workerpool_task_put_spill(strand->pool, strand->shard, taskstrand_task_func, strand) == -1) {
+        while (taskstrand_drain(strand)) {
+        }
+    }
+}
+
+/*
+ * Cancel a strand left in a pool which was shut down. Its tasks go to
+ * cancel, if any, and the strand is idle again, so the next put schedules
+ * it on the restarted pool.
+ */
+void taskstrand_task_cancel(void *ptr, void (*cancel)(task_t*)) {
+
+    taskstrand_t *strand = (taskstrand_t*)ptr;
+    task_t task;
+    pthread_mutex_lock(&strand->mutex);
+    while (taskqueue_take(&strand->queue, &task) == 0) {
+        // Cancel may put to the strand again, never call it under the lock.
+        pthread_mutex_unlock(&strand->mutex);
+        if (cancel != NULL) {
+            cancel(&task);
+        }
+        pthread_mutex_lock(&strand->mutex);
+    }
+    strand->scheduled = 0;
+    pthread_mutex_unlock(&strand->mutex);
+}
+
+/*
+ * Run a strand the pool could not schedule in the caller until it is
+ * empty, as the runner does when out of memory, so no task is left behind
+ * with nobody to run it.
+ */
+static void taskstrand_run_first(taskstrand_t *strand) {
+
+    while (taskstrand_drain(strand)) {
+    }
+}
+
+/*
+ * Run up to batch tasks of strand in order.
+ * Return 1 if tasks are left and the strand stays scheduled, or 0 when it
+ * ran dry and is idle again.
+ */
+static int taskstrand_drain(taskstrand_t *strand) {
+
+    for (uint i = 0; i < strand->batch; i++) {
+        task_t task;
+        pthread_mutex_lock(&strand->mutex);
+        if (taskqueue_take(&strand->queue, &task) == -1) {
+            strand->scheduled = 0;
+            pthread_mutex_unlock(&strand->mutex);
+            return 0;
+        }
+        pthread_mutex_unlock(&strand->mutex);
+        task.func(task.args);
+    }
+
+    pthread_mutex_lock(&strand->mutex);
+    int left = taskqueue_size(&strand->queue) > 0;
+    strand->scheduled = left;
+    pthread_mutex_unlock(&strand->mutex);
+    return left;
+}
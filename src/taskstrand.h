@@ -0,0 +1,63 @@
+/*
+ * Serial task strand
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2016 Mervin <mofei2816@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef TASKSTRAND_H_
+#define TASKSTRAND_H_
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "workerpool.h"
+
+#define STRAND_BATCH    16      /* tasks a strand runs before it yields */
+
+/* struct and types  */
+
+/*
+ * Strand runs its tasks one at a time in the order they were put, on any
+ * worker of the pool. Different strands run in parallel.
+ */
+typedef struct taskstrand_s {
+    workerpool_t *pool;                 /* pool the strand runs on */
+    taskqueue_t queue;                  /* tasks not run yet, guarded by mutex */
+    pthread_mutex_t mutex;
+    int scheduled;                      /* strand is put to or running in pool, guarded by mutex */
+    uint batch;                         /* tasks run before the strand yields */
+    uint shard;                         /* injection shard the strand is put to */
+} taskstrand_t; // serial executor on a pool
+
+/* taskstrand functions */
+
+taskstrand_t* taskstrand_new();
+taskstrand_t* workerpool_strand_new(workerpool_t * __restrict);
+void taskstrand_init(taskstrand_t * __restrict, workerpool_t * __restrict, uint);
+int  taskstrand_put(taskstrand_t * __restrict, void (*)(void*), void*);
+long taskstrand_pending(taskstrand_t * __restrict);
+void taskstrand_destroy(taskstrand_t * __restrict);
+void taskstrand_task_func(void *);
+void taskstrand_task_cancel(void *, void (*)(task_t*));
+
+#endif /* TASKSTRAND_H_ */
@@ -0,0 +1,428 @@
+/*
+ * Hierarchical timing wheel
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2016 Mervin <mofei2816@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "timerwheel.h"
+
+#define TIMERWHEEL_MASK     (TIMERWHEEL_SLOTS - 1)
+#define TIMERWHEEL_SPAN     ((uint64_t)1 << (TIMERWHEEL_LEVELS * TIMERWHEEL_SLOT_BITS))
+
+static timernode_t* timerwheel_node_alloc(timerwheel_t * __restrict);
+static void timerwheel_node_free(timerwheel_t * __restrict, timernode_t * __restrict);
+static void timerwheel_link(timerwheel_t * __restrict, timernode_t * __restrict);
+static void timerwheel_unlink(timerwheel_t * __restrict, timernode_t * __restrict);
+static void timerwheel_expire(timerwheel_t * __restrict, timernode_t * __restrict);
+static void timerwheel_cascade(timerwheel_t * __restrict, int, uint);
+static uint64_t timerwheel_next_tick(timerwheel_t * __restrict);
+static void timerwheel_update_next(timerwheel_t * __restrict);
+
+timerwheel_t* timerwheel_new() {
+    return (timerwheel_t*)malloc(sizeof(timerwheel_t));
+}
+
+/*
+ * Init wheel starting at time now with tick length, both in nanoseconds.
+ * Return 0 if success or -1.
+ */
+int timerwheel_init(timerwheel_t *wheel, uint64_t now, uint64_t tick) {
+
+    if (wheel == NULL || tick == 0) {
+        return -1;
+    }
+    pthread_mutex_init(&wheel->mutex, NULL);
+    wheel->start = now;
+    wheel->tick = tick;
+    wheel->now = 0;
+    wheel->count = 0;
+    atomic_init(&wheel->next, UINT64_MAX);
+    for (int i = 0; i < TIMERWHEEL_LEVELS; i++) {
+        wheel->bitmap[i] = 0;
+        for (int j = 0; j < TIMERWHEEL_SLOTS; j++) {
+            wheel->slots[i][j] = NULL;
+        }
+    }
+    wheel->due = NULL;
+    wheel->due_tail = NULL;
+    wheel->free = NULL;
+    wheel->chunks = NULL;
+    wheel->chunk_count = 0;
+    return 0;
+}
+
+/*
+ * Add a timer firing at time expire, then every period nanoseconds if
+ * period is not 0. Both times are rounded up to whole ticks.
+ * Return id of timer if success or 0.
+ */
+timerid_t timerwheel_add(timerwheel_t *wheel, uint64_t expire, uint64_t period, void (*func)(void*), void *arg) {
+
+    if (wheel == NULL || func == NULL) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&wheel->mutex);
+    timernode_t *node = timerwheel_node_alloc(wheel);
+    if (node == NULL) {
+        pthread_mutex_unlock(&wheel->mutex);
+        return 0;
+    }
+    task_t task = { .func = func, .args = arg };
+    node->task = task;
+    node->expire = expire > wheel->start ? (expire - wheel->start + wheel->tick - 1) / wheel->tick : 0;
+    node->period = period == 0 ? 0 : (period + wheel->tick - 1) / wheel->tick;
+    timerwheel_link(wheel, node);
+    wheel->count++;
+    timerwheel_update_next(wheel);
+    timerid_t id = ((timerid_t)node->generation << 32) | node->index;
+    pthread_mutex_unlock(&wheel->mutex);
+    return id;
+}
+
+/*
+ * Cancel a pending timer, a periodic timer stops firing.
+ * Return 0 if success or -1 when timer already fired or was cancelled.
+ */
+int timerwheel_cancel(timerwheel_t *wheel, timerid_t id) {
+
+    uint32_t index = (uint32_t)id;
+    uint32_t generation = (uint32_t)(id >> 32);
+
+    pthread_mutex_lock(&wheel->mutex);
+    if (index / TIMERWHEEL_CHUNK_SIZE >= wheel->chunk_count) {
+        pthread_mutex_unlock(&wheel->mutex);
+        return -1;
+    }
+    timernode_t *node = wheel->chunks[index / TIMERWHEEL_CHUNK_SIZE] + index % TIMERWHEEL_CHUNK_SIZE;
+    if (node->generation != generation || node->head == NULL) {
+        pthread_mutex_unlock(&wheel->mutex);
+        return -1;
+    }
+    timerwheel_unlink(wheel, node);
+    timerwheel_node_free(wheel, node);
+    wheel->count--;
+    timerwheel_update_next(wheel);
+    pthread_mutex_unlock(&wheel->mutex);
+    return 0;
+}
+
+/*
+ * Advance wheel to time now and take at most n expired tasks.
+ * Periodic timers are scheduled again when taken.
+ * Return number of tasks taken.
+ */
+int timerwheel_advance(timerwheel_t *wheel, uint64_t now, task_t *tasks, int n) {
+
+    uint64_t target = now > wheel->start ? (now - wheel->start) / wheel->tick : 0;
+
+    pthread_mutex_lock(&wheel->mutex);
+    while (wheel->now <= target) {
+        
+        // Jump over ticks without anything to expire or cascade.
+        uint64_t next = timerwheel_next_tick(wheel);
+        if (next > target) {
+            wheel->now = target + 1;
+            break;
+        }
+        wheel->now = next;
+        
+        uint index = (uint)(wheel->now & TIMERWHEEL_MASK);
+        for (int level = 1; index == 0 && level < TIMERWHEEL_LEVELS; level++) {
+            index = (uint)((wheel->now >> (level * TIMERWHEEL_SLOT_BITS)) & TIMERWHEEL_MASK);
+            timerwheel_cascade(wheel, level, index);
+        }
+        
+        timernode_t *node = wheel->slots[0][wheel->now & TIMERWHEEL_MASK];
+        while (node != NULL) {
+            timernode_t *tmp = node->next;
+            timerwheel_expire(wheel, node);
+            node = tmp;
+        }
+        wheel->now++;
+    }
+    
+    int taken = 0;
+    while (taken < n && wheel->due != NULL) {
+        timernode_t *node = wheel->due;
+        timerwheel_unlink(wheel, node);
+        tasks[taken++] = node->task;
+        if (node->period == 0) {
+            timerwheel_node_free(wheel, node);
+            wheel->count--;
+            continue;
+        }
+        
+        // Keep the period, but do not try to catch up missed runs.
+        node->expire += node->period;
+        if (node->expire < wheel->now) {
+            node->expire = wheel->now;
+        }
+        timerwheel_link(wheel, node);
+    }
+    timerwheel_update_next(wheel);
+    pthread_mutex_unlock(&wheel->mutex);
+    return taken;
+}
+
+/*
+ * Return time of the next tick the wheel has work at, or UINT64_MAX
+ * when there is no timer. The time may be earlier than the next timer
+ * when upper levels have to cascade first. Does not lock.
+ */
+uint64_t timerwheel_next(timerwheel_t *wheel) {
+
+    return atomic_load(&wheel->next);
+}
+
+/*
+ * Return number of pending timers.
+ */
+size_t timerwheel_count(timerwheel_t *wheel) {
+
+    if (wheel == NULL) {
+        return 0;
+    }
+    return wheel->count;
+}
+
+/*
+ * Cancel all pending timers and give their tasks to cancel, if any, once
+ * each. Cancel is called without the lock.
+ * Return number of timers cancelled.
+ */
+size_t timerwheel_clear(timerwheel_t *wheel, void (*cancel)(task_t*)) {
+
+    if (wheel == NULL) {
+        return 0;
+    }
+    size_t count = 0;
+    pthread_mutex_lock(&wheel->mutex);
+    for (uint32_t i = 0; i < wheel->chunk_count * TIMERWHEEL_CHUNK_SIZE; i++) {
+        timernode_t *node = wheel->chunks[i / TIMERWHEEL_CHUNK_SIZE] + i % TIMERWHEEL_CHUNK_SIZE;
+        if (node->head == NULL) {
+            continue;
+        }
+        task_t task = node->task;
+        timerwheel_unlink(wheel, node);
+        timerwheel_node_free(wheel, node);
+        wheel->count--;
+        count++;
+        if (cancel != NULL) {
+            pthread_mutex_unlock(&wheel->mutex);
+            cancel(&task);
+            pthread_mutex_lock(&wheel->mutex);
+        }
+    }
+    timerwheel_update_next(wheel);
+    pthread_mutex_unlock(&wheel->mutex);
+    return count;
+}
+
+/*
+ * Destroy wheel and drop all pending timers.
+ */
+void timerwheel_destroy(timerwheel_t *wheel) {
+
+    if (wheel == NULL) {
+        return;
+    }
+    for (uint32_t i = 0; i < wheel->chunk_count; i++) {
+        free(wheel->chunks[i]);
+    }
+    free(wheel->chunks);
+    pthread_mutex_destroy(&wheel->mutex);
+    free(wheel);
+}
+
+/*
+ * Take a node from free list, add a chunk of nodes when it is empty.
+ * Wheel must be locked.
+ */
+static timernode_t* timerwheel_node_alloc(timerwheel_t *wheel) {
+
+    if (wheel->free == NULL) {
+        timernode_t **chunks = (timernode_t**)realloc(wheel->chunks, sizeof(timernode_t*) * (wheel->chunk_count + 1));
+        if (chunks == NULL) {
+            return (timernode_t*)NULL;
+        }
+        wheel->chunks = chunks;
+        timernode_t *chunk = (timernode_t*)malloc(sizeof(timernode_t) * TIMERWHEEL_CHUNK_SIZE);
+        if (chunk == NULL) {
+            return (timernode_t*)NULL;
+        }
+        for (int i = TIMERWHEEL_CHUNK_SIZE - 1; i >= 0; i--) {
+            chunk[i].index = wheel->chunk_count * TIMERWHEEL_CHUNK_SIZE + i;
+            chunk[i].generation = 1;
+            chunk[i].head = NULL;
+            chunk[i].next = wheel->free;
+            wheel->free = chunk + i;
+        }
+        wheel->chunks[wheel->chunk_count++] = chunk;
+    }
+    timernode_t *node = wheel->free;
+    wheel->free = node->next;
+    return node;
+}
+
+/*
+ * Give node back to free list. Wheel must be locked.
+ */
+static void timerwheel_node_free(timerwheel_t *wheel, timernode_t *node) {
+
+    node->generation++;
+    node->head = NULL;
+    node->next = wheel->free;
+    wheel->free = node;
+}
+
+/*
+ * Link node into the slot of its expire tick, or to the due list when
+ * the tick has passed. Wheel must be locked.
+ */
+static void timerwheel_link(timerwheel_t *wheel, timernode_t *node) {
+
+    if (node->expire < wheel->now) {
+        timerwheel_expire(wheel, node);
+        return;
+    }
+
+    uint64_t delta = node->expire - wheel->now;
+    if (delta >= TIMERWHEEL_SPAN) {
+        // Too far away, park it in the last slot and cascade again later.
+        delta = TIMERWHEEL_SPAN - 1;
+    }
+    int level = 0;
+    while (delta >= ((uint64_t)1 << ((level + 1) * TIMERWHEEL_SLOT_BITS))) {
+        level++;
+    }
+    uint64_t expire = wheel->now + delta;
+    uint index = (uint)((expire >> (level * TIMERWHEEL_SLOT_BITS)) & TIMERWHEEL_MASK);
+
+    node->head = &wheel->slots[level][index];
+    node->prev = NULL;
+    node->next = *node->head;
+    if (node->next != NULL) {
+        node->next->prev = node;
+    }
+    *node->head = node;
+    wheel->bitmap[level] |= (uint64_t)1 << index;
+}
+
+/*
+ * Unlink node from its slot or the due list. Wheel must be locked.
+ */
+static void timerwheel_unlink(timerwheel_t *wheel, timernode_t *node) {
+
+    if (node->prev != NULL) {
+        node->prev->next = node->next;
+    } else {
+        *node->head = node->next;
+    }
+    if (node->next != NULL) {
+        node->next->prev = node->prev;
+    }
+
+    if (node->head == &wheel->due) {
+        if (wheel->due_tail == node) {
+            wheel->due_tail = node->prev;
+        }
+    } else if (*node->head == NULL) {
+        long slot = node->head - &wheel->slots[0][0];
+        wheel->bitmap[slot / TIMERWHEEL_SLOTS] &= ~((uint64_t)1 << (slot % TIMERWHEEL_SLOTS));
+    }
+    node->head = NULL;
+}
+
+/*
+ * Move node to the tail of the due list. Wheel must be locked.
+ */
+static void timerwheel_expire(timerwheel_t *wheel, timernode_t *node) {
+
+    if (node->head != NULL) {
+        timerwheel_unlink(wheel, node);
+    }
+    node->head = &wheel->due;
+    node->next = NULL;
+    node->prev = wheel->due_tail;
+    if (wheel->due_tail != NULL) {
+        wheel->due_tail->next = node;
+    } else {
+        wheel->due = node;
+    }
+    wheel->due_tail = node;
+}
+
+/*
+ * Move all timers of a slot down to lower levels. Wheel must be locked.
+ */
+static void timerwheel_cascade(timerwheel_t *wheel, int level, uint index) {
+
+    timernode_t *node = wheel->slots[level][index];
+    wheel->slots[level][index] = NULL;
+    wheel->bitmap[level] &= ~((uint64_t)1 << index);
+    while (node != NULL) {
+        timernode_t *tmp = node->next;
+        node->head = NULL;
+        timerwheel_link(wheel, node);
+        node = tmp;
+    }
+}
+
+/*
+ * Return the next tick to process, which has timers to expire or is a
+ * boundary where upper levels cascade, or UINT64_MAX when there is none.
+ * Wheel must be locked.
+ */
+static uint64_t timerwheel_next_tick(timerwheel_t *wheel) {
+
+    if (wheel->due != NULL) {
+        return wheel->now;
+    }
+
+    uint64_t next = UINT64_MAX;
+    if (wheel->bitmap[0] != 0) {
+        uint index = (uint)(wheel->now & TIMERWHEEL_MASK);
+        uint64_t rotated = (wheel->bitmap[0] >> index) | (index == 0 ? 0 : wheel->bitmap[0] << (TIMERWHEEL_SLOTS - index));
+        next = wheel->now + __builtin_ctzll(rotated);
+    }
+    for (int level = 1; level < TIMERWHEEL_LEVELS; level++) {
+        if (wheel->bitmap[level] != 0) {
+            uint64_t boundary = (wheel->now + TIMERWHEEL_MASK) & ~(uint64_t)TIMERWHEEL_MASK;
+            if (boundary < next) {
+                next = boundary;
+            }
+            break;
+        }
+    }
+    return next;
+}
+
+/*
+ * Publish time of the next tick with work. Wheel must be locked.
+ */
+static void timerwheel_update_next(timerwheel_t *wheel) {
+
+    uint64_t next = timerwheel_next_tick(wheel);
+    atomic_store(&wheel->next, next == UINT64_MAX ? UINT64_MAX : wheel->start + next * wheel->tick);
+}
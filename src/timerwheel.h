@@ -0,0 +1,90 @@
+/*
+ * Hierarchical timing wheel
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2016 Mervin <mofei2816@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef TIMERWHEEL_H_
+#define TIMERWHEEL_H_
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+#include "taskqueue.h"
+
+#define TIMERWHEEL_LEVELS       4
+#define TIMERWHEEL_SLOT_BITS    6
+#define TIMERWHEEL_SLOTS        (1 << TIMERWHEEL_SLOT_BITS)
+#define TIMERWHEEL_CHUNK_SIZE   0x100
+
+/* struct and types  */
+
+typedef uint64_t timerid_t;             // timer handle, 0 is invalid
+
+typedef struct timernode_s {
+    task_t task;
+    uint64_t expire;                    /* tick to fire at */
+    uint64_t period;                    /* ticks between runs, 0 for one shot */
+    uint32_t index;                     /* position in node chunks */
+    uint32_t generation;                /* bumped on free, stale ids never match */
+    struct timernode_s **head;          /* list the node is linked in, NULL when free */
+    struct timernode_s *prev;
+    struct timernode_s *next;
+} timernode_t; // timer
+
+/*
+ * Each level has 64 slots, a slot of level n spans 64^n ticks.
+ * Timers of upper levels cascade down when the lower level wraps.
+ */
+typedef struct timerwheel_s {
+    pthread_mutex_t mutex;
+    uint64_t start;                     /* ns of tick 0 */
+    uint64_t tick;                      /* ns per tick */
+    uint64_t now;                       /* next tick to process */
+    size_t count;                       /* pending timers */
+    atomic_ullong next;                 /* ns of next tick with work, read without lock */
+    uint64_t bitmap[TIMERWHEEL_LEVELS]; /* non-empty slots */
+    timernode_t *slots[TIMERWHEEL_LEVELS][TIMERWHEEL_SLOTS];
+    timernode_t *due;                   /* expired, not yet taken */
+    timernode_t *due_tail;
+    timernode_t *free;
+    timernode_t **chunks;
+    uint32_t chunk_count;
+} timerwheel_t; // hierarchical timing wheel
+
+/* timerwheel functions */
+
+timerwheel_t* timerwheel_new();
+int  timerwheel_init(timerwheel_t * __restrict, uint64_t, uint64_t);
+timerid_t timerwheel_add(timerwheel_t * __restrict, uint64_t, uint64_t, void (*)(void*), void*);
+int  timerwheel_cancel(timerwheel_t * __restrict, timerid_t);
+int  timerwheel_advance(timerwheel_t * __restrict, uint64_t, task_t * __restrict, int);
+uint64_t timerwheel_next(timerwheel_t * __restrict);
+size_t timerwheel_count(timerwheel_t * __restrict);
+size_t timerwheel_clear(timerwheel_t * __restrict, void (*)(task_t*));
+void timerwheel_destroy(timerwheel_t * __restrict);
+
+#endif /* TIMERWHEEL_H_ */
@@ -0,0 +1,151 @@
+/*
+ * Work stealing deque
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2016 Mervin <mofei2816@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "workdeque.h"
+
+workdeque_t* workdeque_new() {
+    return (workdeque_t*)malloc(sizeof(workdeque_t));
+}
+
+/*
+ * Init deque with a capacity rounded up to power of two.
+ * Return 0 if success or -1.
+ */
+int workdeque_init(workdeque_t *deque, uint capacity) {
+
+    if (deque == NULL) {
+        return -1;
+    }
+
+    long size = 2;
+    while (size < (long)capacity) {
+        size <<= 1;
+    }
+
+    deque->buffer = (task_t*)malloc(sizeof(task_t) * size);
+    if (deque->buffer == NULL) {
+        return -1;
+    }
+    deque->mask = size - 1;
+    atomic_init(&deque->top, 0);
+    atomic_init(&deque->bottom, 0);
+    return 0;
+}
+
+/*
+ * Push task to the bottom of deque. Owner only.
+ * Return 0 if success or -1 when deque is full.
+ */
+int workdeque_push(workdeque_t *deque, const task_t *task) {
+
+    long b = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    long t = atomic_load_explicit(&deque->top, memory_order_acquire);
+    if (b - t > deque->mask) {
+        return -1;
+    }
+    deque->buffer[b & deque->mask] = *task;
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+    return 0;
+}
+
+/*
+ * Pop task from the bottom of deque. Owner only.
+ * Return 0 if success or -1 when deque is empty.
+ */
+int workdeque_pop(workdeque_t *deque, task_t *task) {
+
+    long b = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&deque->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long t = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+    if (t > b) {
+        // Deque is empty.
+        atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+        return -1;
+    }
+
+    *task = deque->buffer[b & deque->mask];
+    if (t == b) {
+        // Last task, race against thieves.
+        int won = atomic_compare_exchange_strong_explicit(&deque->top, &t, t + 1,
+                                                          memory_order_seq_cst,
+                                                          memory_order_relaxed);
+        atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+        return won ? 0 : -1;
+    }
+    return 0;
+}
+
+/*
+ * Steal task from the top of deque. Any thread.
+ * Return 0 if success or -1 when deque is empty or lost the race.
+ */
+int workdeque_steal(workdeque_t *deque, task_t *task) {
+
+    long t = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long b = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+
+    if (t >= b) {
+        return -1;
+    }
+
+    task_t stolen = deque->buffer[t & deque->mask];
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &t, t + 1,
+                                                 memory_order_seq_cst,
+                                                 memory_order_relaxed)) {
+        return -1;
+    }
+    *task = stolen;
+    return 0;
+}
+
+/*
+ * Return approximate number of tasks in deque.
+ */
+int workdeque_size(workdeque_t *deque) {
+
+    if (deque == NULL) {
+        return 0;
+    }
+    long b = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    long t = atomic_load_explicit(&deque->top, memory_order_relaxed);
+    return b > t ? (int)(b - t) : 0;
+}
+
+/*
+ * Destroy deque.
+ */
+void workdeque_destroy(workdeque_t *deque) {
+
+    if (deque == NULL) {
+        return;
+    }
+    free(deque->buffer);
+    free(deque);
+}
@@ -0,0 +1,62 @@
+/*
+ * Work stealing deque
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2016 Mervin <mofei2816@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef WORKDEQUE_H_
+#define WORKDEQUE_H_
+
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+
+#include "taskqueue.h"
+
+/* struct and types  */
+
+/*
+ * Bounded Chase-Lev deque.
+ * Only the owner thread may push and pop at the bottom,
+ * any other thread may steal from the top.
+ */
+typedef struct workdeque_s {
+    atomic_long top;
+    char top_pad[CACHE_LINE_SIZE - sizeof(atomic_long)];
+    atomic_long bottom;
+    char bottom_pad[CACHE_LINE_SIZE - sizeof(atomic_long)];
+    long mask;          /* capacity - 1 */
+    task_t *buffer;
+} workdeque_t; // work stealing deque
+
+/* workdeque functions */
+
+workdeque_t* workdeque_new();
+int  workdeque_init(workdeque_t * __restrict, uint);
+int  workdeque_push(workdeque_t * __restrict, const task_t * __restrict);
+int  workdeque_pop(workdeque_t * __restrict, task_t * __restrict);
+int  workdeque_steal(workdeque_t * __restrict, task_t * __restrict);
+int  workdeque_size(workdeque_t * __restrict);
+void workdeque_destroy(workdeque_t * __restrict);
+
+#endif /* WORKDEQUE_H_ */
@@ -24,26 +24,206 @@
  * SOFTWARE.
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <limits.h>
+#include <sched.h>
+#include <string.h>
+#include <time.h>
+
 #include "workerpool.h"
+#include "taskgraph.h"
+#include "taskgroup.h"
+#include "taskloop.h"
+#include "taskstrand.h"
+
+#define WORKER_NOTIFY_TASK      1   /* popped from idle stack for work */
+#define WORKER_NOTIFY_TIMER     2   /* timekeeper has a new deadline */
+
+#define PUT_SPILL               0               /* never wait, go over the buffer */
+#define PUT_TRY                 1               /* fail at once when buffer is full */
+#define PUT_BLOCK               UINT64_MAX      /* wait for buffer space */
+
+#define SHARD_CALLER            UINT_MAX        /* shard of the calling thread */
+
+typedef struct internaltask_s {
+    void (*func)(void*);
+    void (*cancel)(void*, void (*)(task_t*));   /* finishes it unrun, NULL keeps it queued */
+} internaltask_t;   // task the pool or its helpers put for their own work
+
+/*
+ * Hint the CPU that we are in a spin loop.
+ */
+static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __asm__ __volatile__("pause");
+#elif defined(__aarch64__) || defined(__arm__)
+    __asm__ __volatile__("yield");
+#endif
+}
 
 static void workerpool_workerthread_func(void *);
-static void workerthread_init(workerthread_t *);
-static void workerthread_join(workerthread_t * __restrict, uint);
+static void workerpool_task_run(workerpool_t * __restrict, task_t * __restrict);
+static void workerpool_task_call(workerpool_t * __restrict, task_t * __restrict);
+static void workerpool_fiber_run(workerpool_t * __restrict, taskfiber_t * __restrict);
+static void workerpool_fiber_resume(void *);
+static void workerpool_fiber_wake(void *);
+static const internaltask_t* workerpool_task_internal(const task_t * __restrict);
+static int  workerpool_task_kept(const task_t * __restrict);
+static void workerpool_future_cancel(void *, void (*)(task_t*));
+static int  workerpool_task_drop_oldest(workerpool_t * __restrict, uint, uint);
+static int  workerpool_task_put_policy(workerpool_t * __restrict, uint, uint, task_t * __restrict);
+static int  workerpool_task_put_lane(workerpool_t * __restrict, uint, uint, const task_t * __restrict, uint64_t);
+static int  workerpool_queue_put(workerpool_t * __restrict, poolqueue_t * __restrict, const task_t * __restrict, uint64_t);
+static int  workerpool_queue_wait(workerpool_t * __restrict, poolqueue_t * __restrict, uint64_t);
+static size_t workerpool_queue_put_batch(workerpool_t * __restrict, poolqueue_t * __restrict, const task_t * __restrict, size_t, int, uint64_t);
+static size_t workerpool_queue_put_some(workerpool_t * __restrict, poolqueue_t * __restrict, const task_t * __restrict, size_t, uint64_t);
+static int  workerpool_queue_take(workerpool_t * __restrict, poolqueue_t * __restrict, task_t * __restrict);
+static int  workerpool_queue_take_batch(workerpool_t * __restrict, poolqueue_t * __restrict, task_t * __restrict, int);
+static int  workerpool_queue_take_worker(workerpool_t * __restrict, workerthread_t *, poolqueue_t * __restrict, task_t * __restrict);
+static int  workerpool_taken_pop(workerthread_t * __restrict, task_t * __restrict);
+static int  workerpool_taken_prio(workerpool_t * __restrict, workerthread_t * __restrict);
+static void workerpool_taken_return(workerpool_t * __restrict, workerthread_t * __restrict);
+static int  workerpool_queue_size(poolqueue_t * __restrict);
+static inline poolqueue_t* workerpool_lane(workerpool_t * __restrict, uint, uint, uint);
+static uint workerpool_caller_node(workerpool_t * __restrict, workerthread_t * __restrict);
+static uint workerpool_caller_shard(workerpool_t * __restrict, workerthread_t * __restrict);
+static int  workerpool_shards_take(workerpool_t * __restrict, workerthread_t *, uint, uint, task_t * __restrict);
+static int  workerpool_lanes_take(workerpool_t * __restrict, workerthread_t * __restrict, task_t * __restrict);
+static int  workerpool_lanes_take_remote(workerpool_t * __restrict, uint, task_t * __restrict);
+static int  workerpool_lanes_size(workerpool_t * __restrict);
+static int  workerpool_task_take(workerpool_t * __restrict, workerthread_t * __restrict, task_t * __restrict);
+static int  workerpool_task_steal(workerpool_t * __restrict, workerthread_t * __restrict, task_t * __restrict);
+static int  workerpool_task_pending(workerpool_t * __restrict);
+static int  workerpool_drained(workerpool_t * __restrict);
+static size_t workerpool_lanes_cancel(workerpool_t * __restrict, void (*)(task_t*));
+static size_t workerpool_queue_cancel(workerpool_t * __restrict, poolqueue_t * __restrict, void (*)(task_t*));
+static int  workerpool_worker_spin(workerpool_t * __restrict, workerthread_t * __restrict, task_t * __restrict);
+static int  workerpool_worker_park(workerpool_t * __restrict, workerthread_t * __restrict);
+static void workerpool_worker_notify(workerpool_t * __restrict, size_t);
+static void workerpool_worker_notify_node(workerpool_t * __restrict, size_t, int);
+static void workerpool_worker_notify_all(workerpool_t * __restrict);
+static uint64_t workerpool_clock();
+static timerid_t workerpool_timer_add(workerpool_t * __restrict, uint64_t, uint64_t, void (*)(void*), void*);
+static void workerpool_timer_poll(workerpool_t * __restrict, workerthread_t * __restrict);
+static int  workerpool_worker_wait(workerpool_t * __restrict, workerthread_t * __restrict, uint64_t);
+static int  workerpool_worker_spawn(workerpool_t * __restrict);
+static void workerpool_worker_grow(workerpool_t * __restrict);
+static int  workerpool_worker_shrink(workerpool_t * __restrict);
+static inline workerthread_t* workerpool_worker_at(workerpool_t * __restrict, uint);
+static void workerthread_wake(workerthread_t * __restrict, int);
+static void poolqueue_init(poolqueue_t * __restrict, workerpool_t * __restrict);
+static void poolqueue_destroy(poolqueue_t * __restrict);
+static void workerthread_init(workerthread_t * __restrict, workerpool_t * __restrict, uint);
+static void workerthread_place(workerthread_t * __restrict, workerpool_t * __restrict);
+static void workerthread_join(workerpool_t * __restrict);
+static int  workerpool_events_init(workerpool_t * __restrict);
+static void workerpool_release(workerpool_t * __restrict);
 
 workerpool_t* workerpool_new() {
-    return (workerpool_t*)malloc(sizeof(workerpool_t));
+    
+    workerpool_t *pool = (workerpool_t*)malloc(sizeof(workerpool_t));
+    if (pool != NULL) {
+        pool->poolsafe.pool_status = INVALID;
+    }
+    return pool;
+}
+
+/*
+ * Fill options with default values.
+ */
+void workerpool_options_init(workerpool_options_t *options) {
+
+    if (options == NULL) {
+        return;
+    }
+    options->poolsize = 1;
+    options->buffersize = 1;
+    options->schedule = SCHEDULE_FIFO;
+    options->dequesize = DEFAULT_DEQUE_SIZE;
+    options->queue = QUEUE_LIST;
+    options->idle = IDLE_BLOCK;
+    options->spin_limit = DEFAULT_SPIN_LIMIT;
+    options->yield_limit = DEFAULT_YIELD_LIMIT;
+    options->aging = DEFAULT_AGING;
+    options->take_batch = DEFAULT_TAKE_BATCH;
+    options->timer_tick = DEFAULT_TIMER_TICK;
+    options->max_workers = 0;
+    options->keepalive = DEFAULT_KEEPALIVE;
+    options->grow_depth = DEFAULT_GROW_DEPTH;
+    options->grow_wait = 0;
+    options->overflow = OVERFLOW_BLOCK;
+    options->discard = NULL;
+    options->affinity = AFFINITY_NONE;
+    options->cpus = NULL;
+    options->cpu_count = 0;
+    options->numa = 0;
+    options->topology = NULL;
+    options->shards = 0;
+    options->events = 0;
+    options->fibers = 0;
+    options->fiber_stack = DEFAULT_FIBER_STACK;
 }
 
 void workerpool_init(workerpool_t * pool, uint poolsize, uint buffersize) {
-    
+
+    workerpool_options_t options;
+    workerpool_options_init(&options);
+    options.poolsize = poolsize;
+    options.buffersize = buffersize;
+    workerpool_init_options(pool, &options);
+}
+
+/*
+ * Init pool with options.
+ * The pool stays invalid when the event descriptors asked for cannot be
+ * made.
+ */
+void workerpool_init_options(workerpool_t *pool, const workerpool_options_t *options) {
+
     // Init pool only when pool has not been inited.
-    if (workerpool_status(pool) != INVALID) {
+    if (workerpool_status(pool) != INVALID || options == NULL) {
         return;
     }
 
-    poolsize = poolsize > MAX_WORKERPOOL_SIZE ? MAX_WORKERPOOL_SIZE : poolsize;
-    
-    pool->worker_threads = NULL;
+    uint poolsize = options->poolsize > MAX_WORKERPOOL_SIZE ? MAX_WORKERPOOL_SIZE : options->poolsize;
+    uint maxsize = options->max_workers > MAX_WORKERPOOL_SIZE ? MAX_WORKERPOOL_SIZE : options->max_workers;
+    uint buffersize = options->buffersize;
+
+    pool->options = *options;
+    if (pool->options.dequesize == 0) {
+        pool->options.dequesize = DEFAULT_DEQUE_SIZE;
+    }
+    atomic_init(&pool->maxsize, maxsize > poolsize ? maxsize : poolsize);
+    atomic_init(&pool->backlog_since, 0);
+    if (pool->options.grow_depth == 0) {
+        pool->options.grow_depth = DEFAULT_GROW_DEPTH;
+    }
+    pool->worker_chunks = (workerthread_t**)calloc(MAX_WORKERPOOL_SIZE / WORKER_CHUNK_SIZE, sizeof(workerthread_t*));
+    atomic_init(&pool->worker_slots, 0);
+    atomic_init(&pool->live_workers, 0);
+    atomic_init(&pool->retire_requests, 0);
+    atomic_init(&pool->kept_slots, 0);
+    pool->stats = NULL;
+#ifdef WORKERPOOL_STATS
+    pool->stats = poolstats_new();
+    poolstats_init(pool->stats);
+#endif
+    pool->trace = NULL;
+#ifdef WORKERPOOL_TRACE
+    pool->trace = pooltrace_new();
+    pooltrace_init(pool->trace);
+#endif
+    pool->idle_stack = NULL;
+    atomic_init(&pool->idle_workers, 0);
+    atomic_init(&pool->spinning_workers, 0);
+
+    // Init worker key.
+    // This key used for find the worker of current thread.
+    pthread_key_create(&pool->worker_key, NULL);
     
     // Init pool mutex lock.
     // This lock used for make pool status operation thread safe.
@@ -51,24 +231,12 @@ void workerpool_init(workerpool_t * pool, uint poolsize, uint buffersize) {
     pthread_mutex_init(pool_mutex, NULL);
     pool->poolsafe.pool_mutex = pool_mutex;
     
-    // Init task queue mutex lock.
-    // This lock used for make task queue thread safe.
-    pthread_mutex_t *taskqueue_mutex = (pthread_mutex_t*)malloc(sizeof(pthread_mutex_t));
-    pthread_mutex_init(taskqueue_mutex, NULL);
-    pool->poolsafe.taskqueue_mutex = taskqueue_mutex;
-    
-    // Init worker condition mutex lock.
-    // This lock used for make worker condition safe.
+    // Init worker notify mutex lock.
+    // This lock used for make idle worker stack safe.
     pthread_mutex_t *worker_notify_mutex = (pthread_mutex_t*)malloc(sizeof(pthread_mutex_t));
     pthread_mutex_init(worker_notify_mutex, NULL);
     pool->poolsafe.worker_notify_mutex = worker_notify_mutex;
     
-    // Init worker condition.
-    // This condition used for make worker thread manageable.
-    pthread_cond_t *worker_notify = (pthread_cond_t*)malloc(sizeof(pthread_cond_t));
-    pthread_cond_init(worker_notify, NULL);
-    pool->poolsafe.worker_notify = worker_notify;
-    
     // Init queue condition mutex lock
     // This lock used for make queue condition safe.
     pthread_mutex_t *queue_notify_mutex = (pthread_mutex_t*)malloc(sizeof(pthread_mutex_t));
@@ -77,28 +245,147 @@ void workerpool_init(workerpool_t * pool, uint poolsize, uint buffersize) {
     
     // Init queue condition
     // This condition used for make queue access manageable.
+    // It runs on the monotonic clock for timed puts.
     pthread_cond_t *queue_notify = (pthread_cond_t*)malloc(sizeof(pthread_cond_t));
-    pthread_cond_init(queue_notify, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(queue_notify, &attr);
     pool->poolsafe.queue_notify = queue_notify;
     
+    // Init drain condition
+    // Shutdown waits on it under the worker notify lock for the last
+    // worker to go idle, until its deadline on the monotonic clock.
+    pthread_cond_t *drain_notify = (pthread_cond_t*)malloc(sizeof(pthread_cond_t));
+    pthread_cond_init(drain_notify, &attr);
+    pthread_condattr_destroy(&attr);
+    pool->poolsafe.drain_notify = drain_notify;
+    
     // Update pool status.
     pool->poolsafe.pool_status = STOP;
     
-    // Init task queue.
-    pool->taskqueue = taskqueue_new();
-    taskqueue_init(pool->taskqueue);
+    // Init task node pool.
+    // Nodes of task queue are recycled through it instead of malloc and free.
+    pool->nodepool = tasknodepool_new();
+    tasknodepool_init(pool->nodepool);
+    
+    // Init future pool.
+    pool->futurepool = taskfuturepool_new();
+    taskfuturepool_init(pool->futurepool);
+    
+    // Init fiber pool.
+    // Fibers are reused for one task after another, and their stacks are
+    // only mapped, so suspended tasks cost little more than what they use.
+    pool->fiberpool = NULL;
+    if (pool->options.fibers) {
+        if (pool->options.fiber_stack == 0) {
+            pool->options.fiber_stack = DEFAULT_FIBER_STACK;
+        }
+        pool->fiberpool = taskfiberpool_new();
+        taskfiberpool_init(pool->fiberpool, pool->options.fiber_stack);
+        pthread_key_create(&pool->fiber_key, NULL);
+    }
     
     // Setup buffer size
     if (buffersize == 0) {
         buffersize = 1;
     }
     pool->buffersize = buffersize;
+    atomic_init(&pool->producers_waiting, 0);
+    atomic_init(&pool->closing, 0);
+    
+    // Init priority lanes.
+    for (int i = 0; i < PRIO_LANES; i++) {
+        poolqueue_init(pool->lanes + i, pool);
+    }
+    
+    // Init topology for worker placement.
+    // Our copies of the cpu list and topology live as long as the pool.
+    pool->topology = NULL;
+    pool->shards = NULL;
+    pool->node_count = 1;
+    pool->shard_count = pool->options.shards > 1 ? pool->options.shards : 1;
+    if (pool->options.affinity == AFFINITY_LIST && pool->options.cpu_count > 0) {
+        int *cpus = (int*)malloc(sizeof(int) * pool->options.cpu_count);
+        memcpy(cpus, options->cpus, sizeof(int) * pool->options.cpu_count);
+        pool->options.cpus = cpus;
+    } else if (pool->options.affinity == AFFINITY_LIST) {
+        pool->options.affinity = AFFINITY_NONE;
+    }
+    if (pool->options.affinity != AFFINITY_NONE || pool->options.numa) {
+        pool->topology = pooltopology_new();
+        pooltopology_init(pool->topology);
+        if (options->topology != NULL) {
+            for (uint i = 0; i < options->topology->cpu_count; i++) {
+                pooltopology_add(pool->topology, options->topology->nodes[i], options->topology->cpus[i]);
+            }
+        } else {
+            pooltopology_detect(pool->topology);
+        }
+    }
+    pool->options.topology = pool->topology;
+    
+    // Split the default lane per node in NUMA mode, and each node into
+    // shards so producers do not all contend on one queue.
+    // Tasks of default priority stay on the node they were put from.
+    if (pool->options.numa && pool->topology->node_count > 1) {
+        pool->node_count = pool->topology->node_count;
+    }
+    if (pool->node_count * pool->shard_count > 1) {
+        uint count = pool->node_count * pool->shard_count;
+        pool->shards = (poolqueue_t*)malloc(sizeof(poolqueue_t) * count);
+        for (uint i = 0; i < count; i++) {
+            poolqueue_init(pool->shards + i, pool);
+        }
+    }
+    
+    // Init timer wheel.
+    // Due timers are put to the default lane by the workers themselves.
+    if (pool->options.timer_tick == 0) {
+        pool->options.timer_tick = DEFAULT_TIMER_TICK;
+    }
+    pool->timers = timerwheel_new();
+    timerwheel_init(pool->timers, workerpool_clock(), pool->options.timer_tick);
+    pool->timekeeper = NULL;
+    pool->timekeeper_deadline = UINT64_MAX;
+    
+    // Init completion queue and events for an event loop.
+    // Completions only use the task queue, they are never bounded.
+    // Without descriptors there is no event loop to serve, so give up.
+    pool->completions = NULL;
+    pool->completion_event = NULL;
+    pool->submission_event = NULL;
+    atomic_init(&pool->space_wanted, 0);
+    if (pool->options.events && workerpool_events_init(pool) == -1) {
+        workerpool_release(pool);
+        pool->poolsafe.pool_status = INVALID;
+        return;
+    }
     
-    pool->poolsize = poolsize;
+    atomic_init(&pool->poolsize, poolsize);
     
     return;
 }
 
+/*
+ * Init completion queue and descriptors of an event loop.
+ * Return 0 if success or -1, what was made is left to workerpool_release.
+ */
+static int workerpool_events_init(workerpool_t *pool) {
+    
+    pool->completions = (poolqueue_t*)malloc(sizeof(poolqueue_t));
+    if (pool->completions == NULL) {
+        return -1;
+    }
+    poolqueue_init(pool->completions, pool);
+    pool->completion_event = poolevent_new();
+    if (poolevent_init(pool->completion_event) == -1) {
+        return -1;
+    }
+    pool->submission_event = poolevent_new();
+    return poolevent_init(pool->submission_event);
+}
+
 void workerpool_destroy(workerpool_t *pool) {
     
     if (workerpool_status(pool) == INVALID) {
@@ -107,23 +394,74 @@ void workerpool_destroy(workerpool_t *pool) {
     }
     
     // Stop pool.
+    // Tasks left in a paused pool and those of pending timers go to the
+    // discard callback, so the arguments they own are not leaked. Those of
+    // the pool's helpers are finished, so nobody waits for them.
     workerpool_stop(pool);
+    workerpool_lanes_cancel(pool, pool->options.discard);
+    timerwheel_clear(pool->timers, pool->options.discard);
+    workerpool_release(pool);
+    free(pool);
+    pool = NULL;
+    
+    return;
+}
+
+/*
+ * Free everything of a stopped pool but the pool itself.
+ */
+static void workerpool_release(workerpool_t *pool) {
     
     // Destroy lock and condition.
     pthread_mutex_destroy(pool->poolsafe.pool_mutex);
     pthread_mutex_destroy(pool->poolsafe.worker_notify_mutex);
-    pthread_mutex_destroy(pool->poolsafe.taskqueue_mutex);
     pthread_mutex_destroy(pool->poolsafe.queue_notify_mutex);
-    pthread_cond_destroy(pool->poolsafe.worker_notify);
     pthread_cond_destroy(pool->poolsafe.queue_notify);
+    pthread_cond_destroy(pool->poolsafe.drain_notify);
+    pthread_key_delete(pool->worker_key);
+    free(pool->poolsafe.pool_mutex);
+    free(pool->poolsafe.worker_notify_mutex);
+    free(pool->poolsafe.queue_notify_mutex);
+    free(pool->poolsafe.queue_notify);
+    free(pool->poolsafe.drain_notify);
     
     // Free memory.
-    free(pool->worker_threads);
-    free(pool->taskqueue);
-    free(pool);
-    pool = NULL;
-    
-    return;
+    for (uint i = 0; i < atomic_load(&pool->kept_slots); i++) {
+        poolstats_destroy(workerpool_worker_at(pool, i)->stats);
+        workdeque_destroy(workerpool_worker_at(pool, i)->deque);
+    }
+    poolstats_destroy(pool->stats);
+    pooltrace_destroy(pool->trace);
+    for (uint i = 0; i < MAX_WORKERPOOL_SIZE / WORKER_CHUNK_SIZE; i++) {
+        free(pool->worker_chunks[i]);
+    }
+    free(pool->worker_chunks);
+    for (int i = 0; i < PRIO_LANES; i++) {
+        poolqueue_destroy(pool->lanes + i);
+    }
+    if (pool->shards != NULL) {
+        for (uint i = 0; i < pool->node_count * pool->shard_count; i++) {
+            poolqueue_destroy(pool->shards + i);
+        }
+        free(pool->shards);
+    }
+    if (pool->completions != NULL) {
+        poolqueue_destroy(pool->completions);
+        free(pool->completions);
+    }
+    poolevent_destroy(pool->completion_event);
+    poolevent_destroy(pool->submission_event);
+    if (pool->options.affinity == AFFINITY_LIST) {
+        free((int*)pool->options.cpus);
+    }
+    pooltopology_destroy(pool->topology);
+    timerwheel_destroy(pool->timers);
+    tasknodepool_destroy(pool->nodepool);
+    taskfuturepool_destroy(pool->futurepool);
+    if (pool->fiberpool != NULL) {
+        pthread_key_delete(pool->fiber_key);
+        taskfiberpool_destroy(pool->fiberpool);
+    }
 }
 
 int workerpool_start(workerpool_t *pool) {
@@ -138,18 +476,20 @@ int workerpool_start(workerpool_t *pool) {
     
     uint pool_status = pool->poolsafe.pool_status;
     if (pool_status == RUNNING) {
+        pthread_mutex_unlock(pool->poolsafe.pool_mutex);
         return 0;
     }
     
     // Update pool status
     pool->poolsafe.pool_status = RUNNING;
+    atomic_store(&pool->closing, 0);
     
-    // Init and start work threads
-    pool->worker_threads = (workerthread_t*)malloc(sizeof(workerthread_t) * pool->poolsize);
-    for (uint i = 0; i < pool->poolsize; i++) {
-        workerthread_init(pool->worker_threads+i);
-        pthread_create((pool->worker_threads+i)->thread, NULL, (void*)workerpool_workerthread_func, (void*)pool);
-        DEBUG_INFO("[INFO] worker -%10d - start.\n", (int)*(pool->worker_threads+i)->thread);
+    // Start the minimum number of work threads, elastic pools grow on demand.
+    atomic_store(&pool->retire_requests, 0);
+    for (uint i = 0; i < atomic_load(&pool->poolsize); i++) {
+        if (workerpool_worker_spawn(pool) == -1) {
+            break;
+        }
     }
     
     // Unlock
@@ -177,14 +517,10 @@ int workerpool_stop(workerpool_t* pool) {
     pool->poolsafe.pool_status = STOP;
     
     // Notify workers
-    pthread_mutex_lock(pool->poolsafe.worker_notify_mutex);
-    pthread_cond_broadcast(pool->poolsafe.worker_notify);
-    pthread_mutex_unlock(pool->poolsafe.worker_notify_mutex);
+    workerpool_worker_notify_all(pool);
     
     // Wait for worker threads response
-    workerthread_join(pool->worker_threads, pool->poolsize);
-    free(pool->worker_threads);
-    pool->worker_threads = NULL;
+    workerthread_join(pool);
     
     // Unlock
     pthread_mutex_unlock(pool->poolsafe.pool_mutex);
@@ -216,14 +552,10 @@ int workerpool_pause(workerpool_t *pool) {
     pool->poolsafe.pool_status = PAUSE;
     
     // Notify workers.
-    pthread_mutex_lock(pool->poolsafe.worker_notify_mutex);
-    pthread_cond_broadcast(pool->poolsafe.worker_notify);
-    pthread_mutex_unlock(pool->poolsafe.worker_notify_mutex);
+    workerpool_worker_notify_all(pool);
     
     // Wait for worker threads response.
-    workerthread_join(pool->worker_threads, pool->poolsize);
-    free(pool->worker_threads);
-    pool->worker_threads = NULL;
+    workerthread_join(pool);
     
     // Unlock
     pthread_mutex_unlock(pool->poolsafe.pool_mutex);
@@ -231,157 +563,2225 @@ int workerpool_pause(workerpool_t *pool) {
     return 0;
 }
 
-int workerpool_task_put(workerpool_t *pool, void (*taskfunc)(void*), void *arg) {
+/*
+ * Shut workerpool down within timeout nanoseconds.
+ * From now on puts from threads outside the pool fail with ECANCELED,
+ * until the pool is started again. Workers drain the queue until it is
+ * empty or the timeout passes, then finish their current task and exit.
+ * Tasks left over go to cancel, or to the discard callback of the options
+ * when cancel is NULL. With neither they stay queued for a later start.
+ * Tasks the pool and its helpers put never go to the callback: futures are
+ * cancelled, group members and strand tasks go to the callback in place of
+ * their wrapper, loops and graphs are released and return -1, suspended
+ * fibers wait for the next start. Pending timers are kept.
+ * Return number of tasks left over or -1.
+ */
+int workerpool_shutdown(workerpool_t *pool, uint64_t timeout, void (*cancel)(task_t*)) {
     
-    if (workerpool_status(pool) == INVALID || taskfunc == NULL) {
+    if (workerpool_status(pool) == INVALID) {
         return -1;
     }
     
+    // Close the pool, wake producers waiting for buffer space so they fail.
     pthread_mutex_lock(pool->poolsafe.queue_notify_mutex);
-    if ((uint)pool->taskqueue->size >= pool->buffersize) {
-        pthread_cond_wait(pool->poolsafe.queue_notify, pool->poolsafe.queue_notify_mutex);
-    }
+    atomic_store(&pool->closing, 1);
+    pthread_cond_broadcast(pool->poolsafe.queue_notify);
     pthread_mutex_unlock(pool->poolsafe.queue_notify_mutex);
     
-    if (taskqueue_put(pool->taskqueue, taskfunc, arg) == -1) {
-        return -1;
+    // Tasks may put more tasks while they run, so wait until the queues are
+    // empty and every worker is idle, rather than for one event. Workers
+    // going idle while the pool closes signal the drain condition.
+    if (pool->poolsafe.pool_status == RUNNING) {
+        uint64_t now = workerpool_clock();
+        uint64_t deadline = timeout >= UINT64_MAX - now ? UINT64_MAX : now + timeout;
+        struct timespec ts;
+        ts.tv_sec = (time_t)(deadline / 1000000000);
+        ts.tv_nsec = (long)(deadline % 1000000000);
+        
+        pthread_mutex_lock(pool->poolsafe.worker_notify_mutex);
+        int drained;
+        int r = 0;
+        while (!(drained = workerpool_drained(pool)) && r != ETIMEDOUT) {
+            if (deadline == UINT64_MAX) {
+                pthread_cond_wait(pool->poolsafe.drain_notify, pool->poolsafe.worker_notify_mutex);
+            } else {
+                r = pthread_cond_timedwait(pool->poolsafe.drain_notify, pool->poolsafe.worker_notify_mutex, &ts);
+            }
+        }
+        pthread_mutex_unlock(pool->poolsafe.worker_notify_mutex);
+        
+        // Past the deadline workers leave without taking another task.
+        if (drained) {
+            workerpool_stop(pool);
+        } else {
+            workerpool_pause(pool);
+        }
     }
     
-    // Notify workers
-    pthread_mutex_lock(pool->poolsafe.worker_notify_mutex);
-    pthread_cond_broadcast(pool->poolsafe.worker_notify);
-    pthread_mutex_unlock(pool->poolsafe.worker_notify_mutex);
-    return 0;
+    if (cancel == NULL) {
+        cancel = pool->options.discard;
+    }
+    if (cancel == NULL) {
+        return workerpool_lanes_size(pool);
+    }
+    return (int)workerpool_lanes_cancel(pool, cancel);
+}
+
+int workerpool_task_put(workerpool_t *pool, void (*taskfunc)(void*), void *arg) {
+    
+    return workerpool_task_put_prio(pool, PRIO_DEFAULT, taskfunc, arg);
 }
 
 /*
- * Return pool size
+ * Put a task function to the priority lane of workerpool.
+ * Lane 0 has the highest priority.
+ * Return 0 if success or -1.
  */
-uint workerpool_poolsize(workerpool_t *pool) {
+int workerpool_task_put_prio(workerpool_t *pool, uint prio, void (*taskfunc)(void*), void *arg) {
     
-    if (workerpool_status(pool) == INVALID) {
-        return 0;
+    if (workerpool_status(pool) == INVALID || taskfunc == NULL || prio >= PRIO_LANES) {
+        return -1;
     }
-    return pool->poolsize;
+    
+    task_t task = { .func = taskfunc, .args = arg };
+    return workerpool_task_put_policy(pool, prio, SHARD_CALLER, &task);
 }
 
 /*
- * Update pool size
+ * Put a task function to the injection shard of the default lane picked by
+ * shard instead of the one of the calling thread. Producers that keep to
+ * distinct shards never contend with each other.
+ * Return 0 if success or -1.
  */
-int workerpool_poolsize_update(workerpool_t *pool, uint size) {
-    
-    uint pool_status = workerpool_status(pool);
+int workerpool_task_put_shard(workerpool_t *pool, uint shard, void (*taskfunc)(void*), void *arg) {
     
-    if (pool_status == INVALID) {
+    if (workerpool_status(pool) == INVALID || taskfunc == NULL) {
         return -1;
     }
     
-    // Return when new size is eq with current size.
-    if (size == pool->poolsize) {
-        return 0;
+    task_t task = { .func = taskfunc, .args = arg };
+    return workerpool_task_put_policy(pool, PRIO_DEFAULT, shard % pool->shard_count, &task);
+}
+
+/*
+ * Put a task function to an injection shard like workerpool_task_put_shard,
+ * but never wait and never apply the overflow policy, going over the buffer
+ * when it is full. For tasks which must not be refused as they carry work
+ * accepted already, like the runner of a strand.
+ * Return 0 if success or -1, which only happens when out of memory.
+ */
+int workerpool_task_put_spill(workerpool_t *pool, uint shard, void (*taskfunc)(void*), void *arg) {
+    
+    if (workerpool_status(pool) == INVALID || taskfunc == NULL) {
+        return -1;
     }
     
-    if (pool_status == RUNNING) {
-        workerpool_pause(pool);
+    task_t task = { .func = taskfunc, .args = arg };
+    return workerpool_task_put_lane(pool, PRIO_DEFAULT, shard % pool->shard_count, &task, PUT_SPILL);
+}
+
+/*
+ * Put a task function with a copy of size bytes at arg, stored inside the
+ * task so no allocation is needed. The function gets a pointer to the copy,
+ * valid until it returns. Size is at most TASK_INLINE_SIZE.
+ * Return 0 if success or -1.
+ */
+int workerpool_task_put_inline(workerpool_t *pool, void (*taskfunc)(void*), const void *arg, size_t size) {
+    
+    if (workerpool_status(pool) == INVALID || taskfunc == NULL) {
+        return -1;
     }
-    pool->poolsize = size;
-    if (pool_status == RUNNING) {
-        workerpool_start(pool);
+    
+    task_t task;
+    if (task_init_inline(&task, taskfunc, arg, size) == -1) {
+        errno = EINVAL;
+        return -1;
     }
-    return 0;
+    return workerpool_task_put_policy(pool, PRIO_DEFAULT, SHARD_CALLER, &task);
 }
 
 /*
- * Return current status of pool
+ * Put a task to the priority lane, applying the overflow policy.
+ * Return 0 if success or -1.
  */
-pool_status_t workerpool_status(workerpool_t *pool) {
+static int workerpool_task_put_policy(workerpool_t *pool, uint prio, uint shard, task_t *task) {
     
-    if (pool == NULL) {
-        return INVALID;
+    if (pool->options.overflow == OVERFLOW_BLOCK) {
+        return workerpool_task_put_lane(pool, prio, shard, task, PUT_BLOCK);
     }
-    pool_status_t current = pool->poolsafe.pool_status;
-    if (current != INVALID  &&
-        current != RUNNING  &&
-        current != STOP     &&
-        current != PAUSE) {
-        pool->poolsafe.pool_status = INVALID;
+    
+    // Apply the overflow policy when the buffer is full.
+    while (workerpool_task_put_lane(pool, prio, shard, task, PUT_TRY) == -1) {
+        if (errno != EAGAIN) {
+            return -1;
+        }
+        switch (pool->options.overflow) {
+            case OVERFLOW_REJECT:
+                return -1;
+            case OVERFLOW_CALLER_RUNS:
+                workerpool_task_run(pool, task);
+                return 0;
+            case OVERFLOW_DROP_OLDEST:
+                if (workerpool_task_drop_oldest(pool, prio, shard) == -1) {
+                    // Only tasks of the pool itself wait, go over the buffer.
+                    return workerpool_task_put_lane(pool, prio, shard, task, PUT_SPILL);
+                }
+                break;
+            default:
+                return -1;
+        }
     }
-    return pool->poolsafe.pool_status ;
+    return 0;
 }
 
 /*
- * Worker thread function
+ * Drop the oldest task of a lane to make room and give it to the discard
+ * callback. Tasks the pool put for its own work, which someone waits
+ * for, are never dropped but skipped in place. A ring cannot be walked,
+ * so internal tasks taken from it go to the head of the spill list.
+ * Return 0 if a task was dropped or -1 when none can be.
  */
-static void workerpool_workerthread_func(void *ptr) {
+static int workerpool_task_drop_oldest(workerpool_t *pool, uint prio, uint shard) {
     
-    workerpool_t *pool = (workerpool_t*)ptr;
-    if (workerpool_status(pool) == INVALID) {
-        return;
+    workerthread_t *worker = (workerthread_t*)pthread_getspecific(pool->worker_key);
+    if (shard == SHARD_CALLER) {
+        shard = workerpool_caller_shard(pool, worker);
     }
-    // Worker loop
-    while (1) {
-        
-        // If pool have been set to pause,
-        // break worker loop and finish current thread immediately.
-        if (pool->poolsafe.pool_status == PAUSE) {
-            break;
-        }
-        
-        // Load task from queue.
-        pthread_mutex_lock(pool->poolsafe.taskqueue_mutex);
-        DEBUG_INFO("[INFO] worker -%10d - load task.\n", (int)pthread_self());
-        task_t task;
-        int r = taskqueue_take(pool->taskqueue, &task);
-        pthread_mutex_unlock(pool->poolsafe.taskqueue_mutex);
-        
-        if (r == -1) {
-            
-            // If pool have been set to stop,
-            // break worker loop and finish current thread then task queue is empty.
-            pthread_mutex_lock(pool->poolsafe.worker_notify_mutex);
-            if (pool->poolsafe.pool_status == STOP) {
-                pthread_mutex_unlock(pool->poolsafe.worker_notify_mutex);
+    poolqueue_t *lane = workerpool_lane(pool, prio, workerpool_caller_node(pool, worker), shard);
+    task_t oldest;
+    int r = -1;
+    if (lane->taskring != NULL) {
+        task_t kept[DROP_SCAN];
+        int n = 0;
+        while (n < DROP_SCAN && taskring_take(lane->taskring, &oldest) == 0) {
+            if (!workerpool_task_kept(&oldest)) {
+                r = 0;
                 break;
             }
-            
-            DEBUG_INFO("[INFO] worker -%10d - wait.\n", (int)pthread_self());
+            kept[n++] = oldest;
+        }
+        pthread_mutex_lock(lane->taskqueue_mutex);
+        if (n > 0) {
+            taskqueue_put_front_batch(lane->taskqueue, kept, n);
+        }
+        if (r == -1) {
+            r = taskqueue_take_unless(lane->taskqueue, &oldest, workerpool_task_kept);
+        }
+        pthread_mutex_unlock(lane->taskqueue_mutex);
+    } else {
+        pthread_mutex_lock(lane->taskqueue_mutex);
+        r = taskqueue_take_unless(lane->taskqueue, &oldest, workerpool_task_kept);
+        pthread_mutex_unlock(lane->taskqueue_mutex);
+    }
+    if (r == 0 && pool->options.discard != NULL) {
+        pool->options.discard(&oldest);
+    }
+    return r;
+}
 
-            pthread_cond_wait(pool->poolsafe.worker_notify, pool->poolsafe.worker_notify_mutex);
-            
-            pthread_mutex_unlock(pool->poolsafe.worker_notify_mutex);
-            
-            DEBUG_INFO("[INFO] worker -%10d - weakup.\n", (int)pthread_self());
-            
-            continue;
-        } else {
-            pthread_mutex_lock(pool->poolsafe.queue_notify_mutex);
-            if ((uint)pool->taskqueue->size < pool->buffersize) {
-                pthread_cond_signal(pool->poolsafe.queue_notify);
-            }
-            pthread_mutex_unlock(pool->poolsafe.queue_notify_mutex);
+/*
+ * Return the entry of task if it is one the pool or its helpers put for
+ * their own work, a future, strand, group member, loop split, graph node
+ * or fiber resume, otherwise NULL.
+ */
+static const internaltask_t* workerpool_task_internal(const task_t *task) {
+    
+    // A suspended fiber cannot be unwound, it waits for the next start.
+    static const internaltask_t internals[] = {
+        { taskfuture_run, workerpool_future_cancel },
+        { taskstrand_task_func, taskstrand_task_cancel },
+        { taskgroup_task_func, taskgroup_task_cancel },
+        { taskloop_task_func, taskloop_task_cancel },
+        { taskgraph_node_func, taskgraph_node_cancel },
+        { workerpool_fiber_resume, NULL }
+    };
+    for (size_t i = 0; i < sizeof(internals) / sizeof(internals[0]); i++) {
+        if (task->func == internals[i].func) {
+            return internals + i;
         }
-        void (*task_func)(void*) = task.func;
-        void *task_arg = task.args;
-        task_func(task_arg);
     }
-    DEBUG_INFO("[INFO] worker -%10d - finish.\n", (int)pthread_self());
-    return;
+    return NULL;
 }
 
-static void workerthread_init(workerthread_t *workerthread) {
+/*
+ * Return 1 if task is internal and must not be dropped, otherwise 0.
+ */
+static int workerpool_task_kept(const task_t *task) {
     
-    if (workerthread == NULL) {
-        return;
+    return workerpool_task_internal(task) != NULL;
+}
+
+/*
+ * Cancel a submitted future left in a pool which was shut down.
+ */
+static void workerpool_future_cancel(void *arg, void (*cancel)(task_t*)) {
+    
+    (void)cancel;
+    taskfuture_cancel((taskfuture_t*)arg);
+}
+
+/*
+ * Put a task function to workerpool without waiting.
+ * Return 0 if success or -1, errno is EAGAIN when the buffer is full.
+ */
+int workerpool_task_try_put(workerpool_t *pool, void (*taskfunc)(void*), void *arg) {
+    
+    if (workerpool_status(pool) == INVALID || taskfunc == NULL) {
+        return -1;
     }
-    workerthread->thread = (pthread_t*)malloc(sizeof(pthread_t));
+    task_t task = { .func = taskfunc, .args = arg };
+    return workerpool_task_put_lane(pool, PRIO_DEFAULT, SHARD_CALLER, &task, PUT_TRY);
 }
 
-static void workerthread_join(workerthread_t *workerthreads, uint size) {
+/*
+ * Put a task function to workerpool, waiting at most timeout nanoseconds
+ * for buffer space.
+ * Return 0 if success or -1, errno is ETIMEDOUT on timeout.
+ */
+int workerpool_task_put_timed(workerpool_t *pool, uint64_t timeout, void (*taskfunc)(void*), void *arg) {
     
-    for (uint i = 0; i < size; i++) {
-        pthread_t *curosr = ((workerthreads+i)->thread);
-        pthread_join(*curosr, NULL);
-        DEBUG_INFO("[INFO] worker -%10d - stop.\n", (int)*curosr);
-        free((workerthreads+i)->thread);
+    if (workerpool_status(pool) == INVALID || taskfunc == NULL) {
+        return -1;
+    }
+    task_t task = { .func = taskfunc, .args = arg };
+    uint64_t now = workerpool_clock();
+    uint64_t deadline = timeout >= PUT_BLOCK - now ? PUT_BLOCK - 1 : now + timeout;
+    return workerpool_task_put_lane(pool, PRIO_DEFAULT, SHARD_CALLER, &task, deadline);
+}
+
+/*
+ * Put a task function to workerpool after delay nanoseconds.
+ * Return id of the timer if success or 0.
+ */
+timerid_t workerpool_task_put_after(workerpool_t *pool, uint64_t delay, void (*taskfunc)(void*), void *arg) {
+    
+    return workerpool_timer_add(pool, delay, 0, taskfunc, arg);
+}
+
+/*
+ * Put a task function to workerpool every period nanoseconds,
+ * until the timer is cancelled.
+ * Return id of the timer if success or 0.
+ */
+timerid_t workerpool_task_put_every(workerpool_t *pool, uint64_t period, void (*taskfunc)(void*), void *arg) {
+    
+    if (period == 0) {
+        return 0;
+    }
+    return workerpool_timer_add(pool, period, period, taskfunc, arg);
+}
+
+/*
+ * Cancel a delayed or periodic task.
+ * Return 0 if success or -1 when it already ran or was cancelled.
+ */
+int workerpool_timer_cancel(workerpool_t *pool, timerid_t id) {
+    
+    if (workerpool_status(pool) == INVALID) {
+        return -1;
+    }
+    return timerwheel_cancel(pool->timers, id);
+}
+
+/*
+ * Put a batch of tasks to workerpool.
+ * Buffer space is reserved once, all tasks are appended in a single
+ * critical section, then at most n idle workers are woken up.
+ * Return number of tasks put, always the first ones of the batch. Fewer
+ * than n are put when the pool closes meanwhile, errno is ECANCELED, or
+ * the overflow policy refuses a task. The pool owns the tasks put, the
+ * caller still owns the rest. Return -1 on invalid arguments.
+ */
+int workerpool_task_put_batch(workerpool_t *pool, const task_t *tasks, size_t n) {
+    
+    if (workerpool_status(pool) == INVALID || tasks == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (tasks[i].func == NULL) {
+            return -1;
+        }
+    }
+    if (n == 0) {
+        return 0;
+    }
+    
+    workerthread_t *worker = (workerthread_t*)pthread_getspecific(pool->worker_key);
+    if (worker == NULL && atomic_load(&pool->closing)) {
+        errno = ECANCELED;
+        return 0;
     }
-}
\ No newline at end of file
+    
+    // Other overflow policies decide per task, stop at the first refused.
+    if (worker == NULL && pool->options.overflow != OVERFLOW_BLOCK) {
+        size_t i = 0;
+        while (i < n) {
+            task_t task = tasks[i];
+            if (workerpool_task_put_policy(pool, PRIO_DEFAULT, SHARD_CALLER, &task) == -1) {
+                break;
+            }
+            i++;
+        }
+        return (int)i;
+    }
+    
+    // Tasks are stamped with the put time as they are stored.
+    uint64_t now = 0;
+#ifdef WORKERPOOL_STATS
+    now = workerpool_clock();
+#endif
+    
+    size_t done = 0;
+    if (worker != NULL && worker->deque != NULL) {
+        while (done < n) {
+            const task_t *task = tasks + done;
+#ifdef WORKERPOOL_STATS
+            task_t stamped = *task;
+            stamped.enqueued = now;
+            task = &stamped;
+#endif
+            if (workdeque_push(worker->deque, task) == -1) {
+                break;
+            }
+            done++;
+        }
+    }
+    uint node = workerpool_caller_node(pool, worker);
+    poolqueue_t *lane = workerpool_lane(pool, PRIO_DEFAULT, node, workerpool_caller_shard(pool, worker));
+    if (done < n) {
+        done += workerpool_queue_put_batch(pool, lane, tasks + done, n - done, worker == NULL, now);
+    }
+    if (done > 0) {
+#ifdef WORKERPOOL_TRACE
+        for (size_t i = 0; i < done; i++) {
+            POOLTRACE(pool->trace, TRACE_SUBMIT, tasks[i].func);
+        }
+#endif
+        workerpool_worker_notify_node(pool, done, (int)node);
+    }
+    return (int)done;
+}
+
+/*
+ * Submit a task and return its completion handle, or NULL on failure.
+ * The handle must be given back with taskfuture_release.
+ */
+taskfuture_t* workerpool_task_submit(workerpool_t *pool, void *(*taskfunc)(void*), void *arg) {
+    
+    if (workerpool_status(pool) == INVALID || taskfunc == NULL) {
+        return (taskfuture_t*)NULL;
+    }
+    
+    taskfuture_t *future = taskfuture_alloc(pool->futurepool, taskfunc, arg);
+    if (future == NULL) {
+        return (taskfuture_t*)NULL;
+    }
+    if (workerpool_task_put(pool, taskfuture_run, future) == -1) {
+        // Drop both references, the task will never run.
+        taskfuture_release(future);
+        taskfuture_release(future);
+        return (taskfuture_t*)NULL;
+    }
+    return future;
+}
+
+/*
+ * Block until all tasks of futures finished.
+ * Return 0 if success or -1.
+ */
+int workerpool_wait_all(taskfuture_t **futures, size_t n) {
+    
+    if (futures == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (futures[i] != NULL) {
+            taskfuture_wait(futures[i]);
+        }
+    }
+    return 0;
+}
+
+/*
+ * Suspend the calling task and put it to the back of the default lane,
+ * so other tasks run on this worker meanwhile. Outside of a fiber the
+ * thread yields instead.
+ * Return 0 if the task was suspended or -1.
+ */
+int workerpool_yield(workerpool_t *pool) {
+    
+    if (workerpool_status(pool) == INVALID) {
+        return -1;
+    }
+    taskfiber_t *fiber = pool->fiberpool != NULL ? (taskfiber_t*)pthread_getspecific(pool->fiber_key) : NULL;
+    if (fiber == NULL) {
+        sched_yield();
+        return -1;
+    }
+    taskfiber_suspend(fiber, FIBER_YIELDED);
+    return 0;
+}
+
+/*
+ * Wait until the task of future finished and return its result.
+ * A task running on a fiber is suspended, leaving its worker free, and
+ * resumed by any worker once future is done. Other callers block.
+ */
+void* workerpool_await(workerpool_t *pool, taskfuture_t *future) {
+    
+    if (workerpool_status(pool) == INVALID || future == NULL) {
+        return NULL;
+    }
+    taskfiber_t *fiber = pool->fiberpool != NULL ? (taskfiber_t*)pthread_getspecific(pool->fiber_key) : NULL;
+    if (fiber != NULL && !taskfuture_is_done(future)) {
+        fiber->awaited = future;
+        taskfiber_suspend(fiber, FIBER_AWAITING);
+    }
+    return taskfuture_wait(future);
+}
+
+/*
+ * Run one pending task in the calling thread.
+ * Used by threads waiting for other tasks to help instead of sleeping.
+ * Return 1 if a task was run, otherwise 0.
+ */
+int workerpool_task_run_one(workerpool_t *pool) {
+    
+    if (workerpool_status(pool) == INVALID) {
+        return 0;
+    }
+    
+    task_t task;
+    int r;
+    workerthread_t *worker = (workerthread_t*)pthread_getspecific(pool->worker_key);
+    if (worker != NULL) {
+        r = workerpool_task_take(pool, worker, &task);
+    } else {
+        r = workerpool_lanes_take(pool, NULL, &task);
+        if (r == -1 && pool->options.schedule == SCHEDULE_STEALING &&
+            pool->poolsafe.pool_status == RUNNING) {
+            r = workerpool_task_steal(pool, NULL, &task);
+        }
+        if (r == -1) {
+            r = workerpool_lanes_take_remote(pool, workerpool_caller_node(pool, NULL), &task);
+        }
+    }
+    if (r == -1) {
+        return 0;
+    }
+    workerpool_task_run(pool, &task);
+    return 1;
+}
+
+/*
+ * Run pending tasks of pool in the calling thread until done(arg) returns
+ * 1. With nothing to run, wait on notify under mutex, but at most HELP_WAIT
+ * at a time before looking for tasks again, so a task put while every
+ * worker waits like this still runs. Whoever makes done true must signal
+ * notify under mutex. Returns once that thread has left mutex as well.
+ */
+void workerpool_help_wait(workerpool_t *pool, int (*done)(void*), void *arg,
+                          pthread_mutex_t *mutex, pthread_cond_t *notify) {
+    
+    while (!done(arg)) {
+        if (workerpool_task_run_one(pool)) {
+            continue;
+        }
+        
+        // Nothing to help with, rest of the work is running elsewhere.
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += HELP_WAIT;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        pthread_mutex_lock(mutex);
+        if (!done(arg)) {
+            pthread_cond_timedwait(notify, mutex, &ts);
+        }
+        pthread_mutex_unlock(mutex);
+    }
+    
+    // The last one counts down under lock, make sure it has left before
+    // the caller may free what it waited on.
+    pthread_mutex_lock(mutex);
+    pthread_mutex_unlock(mutex);
+}
+
+/*
+ * Return pool size, the number of live workers while running.
+ */
+uint workerpool_poolsize(workerpool_t *pool) {
+    
+    pool_status_t status = workerpool_status(pool);
+    if (status == INVALID) {
+        return 0;
+    }
+    if (status == RUNNING) {
+        return atomic_load(&pool->live_workers);
+    }
+    return atomic_load(&pool->poolsize);
+}
+
+/*
+ * Update pool size.
+ * A fixed size pool keeps fixed size, an elastic pool takes size as its
+ * new minimum. Workers are spawned or retired one by one, running tasks
+ * are never interrupted.
+ */
+int workerpool_poolsize_update(workerpool_t *pool, uint size) {
+    
+    if (workerpool_status(pool) == INVALID) {
+        return -1;
+    }
+    if (size > MAX_WORKERPOOL_SIZE) {
+        size = MAX_WORKERPOOL_SIZE;
+    }
+    
+    pthread_mutex_lock(pool->poolsafe.pool_mutex);
+    uint maxsize = atomic_load(&pool->maxsize);
+    if (maxsize == atomic_load(&pool->poolsize) || maxsize < size) {
+        atomic_store(&pool->maxsize, size);
+    }
+    atomic_store(&pool->poolsize, size);
+    
+    if (pool->poolsafe.pool_status == RUNNING) {
+        // Spawn missing workers, or ask idle workers to retire.
+        atomic_store(&pool->retire_requests, 0);
+        while (atomic_load(&pool->live_workers) < size) {
+            if (workerpool_worker_spawn(pool) == -1) {
+                break;
+            }
+        }
+        uint live = atomic_load(&pool->live_workers);
+        if (live > atomic_load(&pool->maxsize)) {
+            atomic_store(&pool->retire_requests, live - atomic_load(&pool->maxsize));
+            workerpool_worker_notify_all(pool);
+        } else if (live > size) {
+            // Workers parked for good under the old minimum must
+            // switch to keep-alive waits.
+            workerpool_worker_notify_all(pool);
+        }
+    }
+    pthread_mutex_unlock(pool->poolsafe.pool_mutex);
+    return 0;
+}
+
+/*
+ * Return current status of pool
+ */
+pool_status_t workerpool_status(workerpool_t *pool) {
+    
+    if (pool == NULL) {
+        return INVALID;
+    }
+    pool_status_t current = pool->poolsafe.pool_status;
+    if (current != INVALID  &&
+        current != RUNNING  &&
+        current != STOP     &&
+        current != PAUSE) {
+        pool->poolsafe.pool_status = INVALID;
+    }
+    return pool->poolsafe.pool_status ;
+}
+
+/*
+ * Fill out with a snapshot of pool statistics.
+ * Counters and histograms are summed over all workers without locking,
+ * they stay zero unless built with WORKERPOOL_STATS.
+ * Return 0 if success or -1.
+ */
+int workerpool_stats(workerpool_t *pool, workerpool_stats_t *out) {
+    
+    if (workerpool_status(pool) == INVALID || out == NULL) {
+        return -1;
+    }
+    memset(out, 0, sizeof(workerpool_stats_t));
+    
+#ifdef WORKERPOOL_STATS
+    uint slots = atomic_load_explicit(&pool->kept_slots, memory_order_acquire);
+    for (uint i = 0; i <= slots; i++) {
+        poolstats_t *stats = i < slots ? workerpool_worker_at(pool, i)->stats : pool->stats;
+        out->tasks += atomic_load_explicit(&stats->tasks, memory_order_relaxed);
+        out->steals += atomic_load_explicit(&stats->steals, memory_order_relaxed);
+        out->parks += atomic_load_explicit(&stats->parks, memory_order_relaxed);
+        out->wakeups += atomic_load_explicit(&stats->wakeups, memory_order_relaxed);
+        out->idle_ns += atomic_load_explicit(&stats->idle_ns, memory_order_relaxed);
+        for (int j = 0; j < POOLSTATS_BUCKETS; j++) {
+            out->wait_hist[j] += atomic_load_explicit(&stats->wait_hist[j], memory_order_relaxed);
+            out->run_hist[j] += atomic_load_explicit(&stats->run_hist[j], memory_order_relaxed);
+        }
+    }
+#endif
+    
+    out->queued = (uint64_t)workerpool_lanes_size(pool);
+    uint size = atomic_load_explicit(&pool->worker_slots, memory_order_acquire);
+    for (uint i = 0; i < size; i++) {
+        out->queued += (uint64_t)workdeque_size(workerpool_worker_at(pool, i)->deque);
+    }
+    out->timers = timerwheel_count(pool->timers);
+    out->live_workers = atomic_load(&pool->live_workers);
+    out->idle_workers = atomic_load(&pool->idle_workers);
+    return 0;
+}
+
+/*
+ * Write the recorded events as Chrome trace JSON, viewable in Perfetto.
+ * Dump after the pool has stopped or paused for a consistent capture.
+ * Return 0 if success or -1, also when not built with WORKERPOOL_TRACE.
+ */
+int workerpool_trace_dump(workerpool_t *pool, FILE *out) {
+    
+    if (workerpool_status(pool) == INVALID || out == NULL) {
+        return -1;
+    }
+#ifdef WORKERPOOL_TRACE
+    return pooltrace_dump(pool->trace, out);
+#else
+    return -1;
+#endif
+}
+
+/*
+ * Return NUMA node of the calling thread, which is the node of the worker
+ * or of the cpu for other threads. Always 0 unless in NUMA mode.
+ */
+uint workerpool_current_node(workerpool_t *pool) {
+    
+    if (workerpool_status(pool) == INVALID) {
+        return 0;
+    }
+    return workerpool_caller_node(pool, (workerthread_t*)pthread_getspecific(pool->worker_key));
+}
+
+/*
+ * Return descriptor that is readable while completions are queued,
+ * or -1 when the pool was not created with events.
+ */
+int workerpool_completion_fd(workerpool_t *pool) {
+    
+    if (workerpool_status(pool) == INVALID) {
+        return -1;
+    }
+    return poolevent_fd(pool->completion_event);
+}
+
+/*
+ * Queue a completion callback for the event loop, from a task or any
+ * other thread.
+ * Return 0 if success or -1.
+ */
+int workerpool_completion_put(workerpool_t *pool, void (*func)(void*), void *arg) {
+    
+    task_t task = { .func = func, .args = arg };
+    return workerpool_completion_put_batch(pool, &task, 1);
+}
+
+/*
+ * Queue a batch of completion callbacks under one lock, and make the
+ * completion descriptor readable with at most one write.
+ * Return 0 if success or -1.
+ */
+int workerpool_completion_put_batch(workerpool_t *pool, const task_t *tasks, size_t n) {
+    
+    if (workerpool_status(pool) == INVALID || pool->completions == NULL || tasks == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (tasks[i].func == NULL) {
+            return -1;
+        }
+    }
+    if (n == 0) {
+        return 0;
+    }
+    
+    poolqueue_t *queue = pool->completions;
+    pthread_mutex_lock(queue->taskqueue_mutex);
+    int r = taskqueue_put_batch(queue->taskqueue, tasks, (int)n);
+    pthread_mutex_unlock(queue->taskqueue_mutex);
+    if (r == -1) {
+        return -1;
+    }
+    poolevent_signal(pool->completion_event);
+    return 0;
+}
+
+/*
+ * Run up to max queued completions in the calling thread, the event loop
+ * once the completion descriptor is readable. The descriptor stays
+ * readable when completions are left.
+ * Return number of completions run or -1.
+ */
+int workerpool_completion_run(workerpool_t *pool, size_t max) {
+    
+    if (workerpool_status(pool) == INVALID || pool->completions == NULL) {
+        return -1;
+    }
+    
+    // Clear before taking, a completion put meanwhile signals again.
+    poolevent_clear(pool->completion_event);
+    
+    poolqueue_t *queue = pool->completions;
+    task_t tasks[COMPLETION_BATCH];
+    size_t done = 0;
+    while (done < max && taskqueue_size(queue->taskqueue) > 0) {
+        int batch = max - done < COMPLETION_BATCH ? (int)(max - done) : COMPLETION_BATCH;
+        pthread_mutex_lock(queue->taskqueue_mutex);
+        int n = taskqueue_take_batch(queue->taskqueue, tasks, batch);
+        pthread_mutex_unlock(queue->taskqueue_mutex);
+        for (int i = 0; i < n; i++) {
+            tasks[i].func(task_args(tasks + i));
+        }
+        done += (size_t)n;
+    }
+    if (taskqueue_size(queue->taskqueue) > 0) {
+        poolevent_signal(pool->completion_event);
+    }
+    return (int)done;
+}
+
+/*
+ * Return descriptor that becomes readable when a submission which did not
+ * fit may be retried, or -1 when the pool was not created with events.
+ */
+int workerpool_submission_fd(workerpool_t *pool) {
+    
+    if (workerpool_status(pool) == INVALID) {
+        return -1;
+    }
+    return poolevent_fd(pool->submission_event);
+}
+
+/*
+ * Put as many tasks of a batch as fit into the buffer without blocking,
+ * for an event loop that must not wait on the queue condition. Idle
+ * workers are woken once for the whole batch. When not all tasks fit,
+ * the submission descriptor becomes readable after workers took some.
+ * Return number of tasks put, 0 with errno ECANCELED when the pool is
+ * closing, as workerpool_task_put_batch does, or -1 on invalid arguments.
+ */
+int workerpool_submission_put(workerpool_t *pool, const task_t *tasks, size_t n) {
+    
+    if (workerpool_status(pool) == INVALID || pool->submission_event == NULL || tasks == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (tasks[i].func == NULL) {
+            return -1;
+        }
+    }
+    if (atomic_load(&pool->closing)) {
+        errno = ECANCELED;
+        return 0;
+    }
+    if (n == 0) {
+        return 0;
+    }
+    
+    // Tasks are stamped with the put time as they are stored.
+    uint64_t now = 0;
+#ifdef WORKERPOOL_STATS
+    now = workerpool_clock();
+#endif
+    
+    // Clear before putting, space freed meanwhile signals again.
+    poolevent_clear(pool->submission_event);
+    
+    uint node = workerpool_caller_node(pool, NULL);
+    poolqueue_t *lane = workerpool_lane(pool, PRIO_DEFAULT, node, workerpool_caller_shard(pool, NULL));
+    size_t done = workerpool_queue_put_some(pool, lane, tasks, n, now);
+    if (done < n) {
+        // Announce before the last try, the fence pairs with the one in
+        // workerpool_queue_take_batch, so either we see the space or
+        // the worker sees us waiting.
+        atomic_store(&pool->space_wanted, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        done += workerpool_queue_put_some(pool, lane, tasks + done, n - done, now);
+    }
+    if (done > 0) {
+#ifdef WORKERPOOL_TRACE
+        for (size_t i = 0; i < done; i++) {
+            POOLTRACE(pool->trace, TRACE_SUBMIT, tasks[i].func);
+        }
+#endif
+        workerpool_worker_notify_node(pool, done, (int)node);
+    }
+    return (int)done;
+}
+
+/*
+ * Worker thread function
+ */
+static void workerpool_workerthread_func(void *ptr) {
+    
+    workerthread_t *worker = (workerthread_t*)ptr;
+    workerpool_t *pool = worker->pool;
+    if (workerpool_status(pool) == INVALID) {
+        return;
+    }
+    pthread_setspecific(pool->worker_key, worker);
+#ifdef WORKERPOOL_TRACE
+    pooltrace_worker(pool->trace, (int)worker->index);
+#endif
+#ifdef __linux__
+    // Pinning is best effort, a cpu outside our cpuset leaves the worker free.
+    if (worker->cpu >= 0) {
+        cpu_set_t cpuset;
+        CPU_ZERO(&cpuset);
+        CPU_SET(worker->cpu, &cpuset);
+        pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+    }
+#endif
+    
+    // Worker loop
+    while (1) {
+        
+        // If pool have been set to pause,
+        // break worker loop and finish current thread immediately.
+        if (pool->poolsafe.pool_status == PAUSE) {
+            break;
+        }
+        
+        // Move due timers to the task queue.
+        workerpool_timer_poll(pool, worker);
+        
+        // Load task.
+        task_t task;
+        int r = workerpool_task_take(pool, worker, &task);
+        
+        // Spin for a while before going to sleep when the idle policy asks for it.
+        if (r == -1 && pool->options.idle == IDLE_SPIN) {
+            r = workerpool_worker_spin(pool, worker, &task);
+        }
+        
+        if (r == -1) {
+            
+            // If pool have been set to stop,
+            // break worker loop and finish current thread then task queue is empty.
+            if (workerpool_worker_park(pool, worker) == -1) {
+                break;
+            }
+            continue;
+        }
+        POOLTRACE(pool->trace, TRACE_DEQUEUE, task.func);
+        workerpool_task_run(pool, &task);
+    }
+    workerpool_taken_return(pool, worker);
+#ifdef WORKERPOOL_TRACE
+    pooltrace_release(pool->trace);
+#endif
+    atomic_store(&worker->running, 0);
+    DEBUG_INFO("[INFO] worker -%10d - finish.\n", (int)pthread_self());
+    return;
+}
+
+/*
+ * Put a task to a priority lane and notify one idle worker.
+ * Tasks of default priority put by a worker go to its local deque when
+ * work stealing. Otherwise workers put to the lane without waiting for
+ * buffer space, since a blocked worker could never drain the buffer.
+ * Return 0 if success or -1 with errno set.
+ */
+static int workerpool_task_put_lane(workerpool_t *pool, uint prio, uint shard, const task_t *task, uint64_t deadline) {
+    
+    workerthread_t *worker = (workerthread_t*)pthread_getspecific(pool->worker_key);
+    if (worker != NULL) {
+        deadline = PUT_SPILL;
+    }
+#ifdef WORKERPOOL_STATS
+    task_t stamped = *task;
+    stamped.enqueued = workerpool_clock();
+    task = &stamped;
+#endif
+    // A task put to an explicit shard skips the local deque.
+    uint node = workerpool_caller_node(pool, worker);
+    if (worker == NULL || worker->deque == NULL || prio != PRIO_DEFAULT || shard != SHARD_CALLER ||
+        workdeque_push(worker->deque, task) == -1) {
+        if (shard == SHARD_CALLER) {
+            shard = workerpool_caller_shard(pool, worker);
+        }
+        if (workerpool_queue_put(pool, workerpool_lane(pool, prio, node, shard), task, deadline) == -1) {
+            return -1;
+        }
+    }
+    POOLTRACE(pool->trace, TRACE_SUBMIT, task->func);
+    
+    // Notify one idle worker, one of the same node for tasks bound to it.
+    workerpool_worker_notify_node(pool, 1, prio == PRIO_DEFAULT ? (int)node : -1);
+    return 0;
+}
+
+/*
+ * Put task into a shared queue.
+ * With PUT_SPILL never block and go over the buffer size when it is full,
+ * otherwise wait for buffer space until deadline. A deadline which has
+ * passed fails at once.
+ * Return 0 if success or -1 with errno set.
+ */
+static int workerpool_queue_put(workerpool_t *pool, poolqueue_t *queue, const task_t *task, uint64_t deadline) {
+    
+    while (1) {
+        // Workers always spill, only other threads are shut out.
+        if (deadline != PUT_SPILL && atomic_load(&pool->closing)) {
+            errno = ECANCELED;
+            return -1;
+        }
+        if (queue->taskring == NULL) {
+            // Check and put in one critical section, so concurrent producers
+            // never overshoot the buffer.
+            pthread_mutex_lock(queue->taskqueue_mutex);
+            if (deadline == PUT_SPILL || (uint)taskqueue_size(queue->taskqueue) < pool->buffersize) {
+                int r = taskqueue_put_batch(queue->taskqueue, task, 1);
+                pthread_mutex_unlock(queue->taskqueue_mutex);
+                return r == -1 ? -1 : 0;
+            }
+            pthread_mutex_unlock(queue->taskqueue_mutex);
+        } else if (taskring_put(queue->taskring, task) == 0) {
+            return 0;
+        } else if (deadline == PUT_SPILL) {
+            // Ring is full and caller must not block, spill to the task queue.
+            pthread_mutex_lock(queue->taskqueue_mutex);
+            int r = taskqueue_put_batch(queue->taskqueue, task, 1);
+            pthread_mutex_unlock(queue->taskqueue_mutex);
+            return r == -1 ? -1 : 0;
+        }
+        
+        if (workerpool_queue_wait(pool, queue, deadline) == -1) {
+            errno = deadline == PUT_TRY ? EAGAIN : ETIMEDOUT;
+            return -1;
+        }
+    }
+}
+
+/*
+ * Wait until a shared queue has buffer space or deadline passes.
+ * Return 0 when the caller should try again or -1 on timeout.
+ */
+static int workerpool_queue_wait(workerpool_t *pool, poolqueue_t *queue, uint64_t deadline) {
+    
+    if (deadline != PUT_BLOCK && workerpool_clock() >= deadline) {
+        return -1;
+    }
+    
+    // Announce the waiting producer before checking the queue again,
+    // so a worker taking a task right now will see it and signal.
+    pthread_mutex_lock(pool->poolsafe.queue_notify_mutex);
+    atomic_fetch_add(&pool->producers_waiting, 1);
+    int full = queue->taskring == NULL ?
+               (uint)taskqueue_size(queue->taskqueue) >= pool->buffersize :
+               taskring_size(queue->taskring) >= taskring_capacity(queue->taskring);
+    if (full && !atomic_load(&pool->closing)) {
+        if (deadline == PUT_BLOCK) {
+            pthread_cond_wait(pool->poolsafe.queue_notify, pool->poolsafe.queue_notify_mutex);
+        } else {
+            struct timespec ts;
+            ts.tv_sec = (time_t)(deadline / 1000000000);
+            ts.tv_nsec = (long)(deadline % 1000000000);
+            pthread_cond_timedwait(pool->poolsafe.queue_notify, pool->poolsafe.queue_notify_mutex, &ts);
+        }
+    }
+    atomic_fetch_sub(&pool->producers_waiting, 1);
+    pthread_mutex_unlock(pool->poolsafe.queue_notify_mutex);
+    return 0;
+}
+
+/*
+ * Put a batch of tasks into a shared queue, stamped with enqueued unless
+ * it is 0. A task queue takes the whole batch or none, a ring keeps the
+ * tasks put before the pool closed.
+ * Return number of tasks put, errno is ECANCELED when the pool closed.
+ */
+static size_t workerpool_queue_put_batch(workerpool_t *pool, poolqueue_t *queue, const task_t *tasks, size_t n, int wait, uint64_t enqueued) {
+    
+    if (queue->taskring == NULL) {
+        // Wait until the whole batch fits, or the queue is empty for batch
+        // larger than the buffer.
+        pthread_mutex_lock(pool->poolsafe.queue_notify_mutex);
+        atomic_fetch_add(&pool->producers_waiting, 1);
+        while (wait && taskqueue_size(queue->taskqueue) > 0 && !atomic_load(&pool->closing) &&
+               (size_t)taskqueue_size(queue->taskqueue) + n > pool->buffersize) {
+            pthread_cond_wait(pool->poolsafe.queue_notify, pool->poolsafe.queue_notify_mutex);
+        }
+        atomic_fetch_sub(&pool->producers_waiting, 1);
+        pthread_mutex_unlock(pool->poolsafe.queue_notify_mutex);
+        if (wait && atomic_load(&pool->closing)) {
+            errno = ECANCELED;
+            return 0;
+        }
+        
+        pthread_mutex_lock(queue->taskqueue_mutex);
+        int r = taskqueue_put_batch_stamp(queue->taskqueue, tasks, (int)n, enqueued);
+        pthread_mutex_unlock(queue->taskqueue_mutex);
+        return r == -1 ? 0 : n;
+    }
+    
+    size_t done = 0;
+    size_t notified = 0;
+    while (1) {
+        done += taskring_put_batch_stamp(queue->taskring, tasks + done, (int)(n - done), enqueued);
+        if (done == n) {
+            break;
+        }
+        
+        if (!wait) {
+            pthread_mutex_lock(queue->taskqueue_mutex);
+            int r = taskqueue_put_batch_stamp(queue->taskqueue, tasks + done, (int)(n - done), enqueued);
+            pthread_mutex_unlock(queue->taskqueue_mutex);
+            return r == -1 ? done : n;
+        }
+        
+        // Workers must know about the tasks already put before we wait for them.
+        workerpool_worker_notify(pool, done - notified);
+        notified = done;
+        
+        pthread_mutex_lock(pool->poolsafe.queue_notify_mutex);
+        atomic_fetch_add(&pool->producers_waiting, 1);
+        if (taskring_size(queue->taskring) >= taskring_capacity(queue->taskring) &&
+            !atomic_load(&pool->closing)) {
+            pthread_cond_wait(pool->poolsafe.queue_notify, pool->poolsafe.queue_notify_mutex);
+        }
+        atomic_fetch_sub(&pool->producers_waiting, 1);
+        pthread_mutex_unlock(pool->poolsafe.queue_notify_mutex);
+        
+        // The tasks put so far stay, shutdown hands them over.
+        if (atomic_load(&pool->closing)) {
+            errno = ECANCELED;
+            return done;
+        }
+    }
+    return n;
+}
+
+/*
+ * Put the leading tasks of a batch that fit into the buffer of a shared
+ * queue, never waiting and never spilling, stamped with enqueued unless
+ * it is 0.
+ * Return number of tasks put.
+ */
+static size_t workerpool_queue_put_some(workerpool_t *pool, poolqueue_t *queue, const task_t *tasks, size_t n, uint64_t enqueued) {
+    
+    if (queue->taskring != NULL) {
+        return (size_t)taskring_put_batch_stamp(queue->taskring, tasks, (int)n, enqueued);
+    }
+    
+    pthread_mutex_lock(queue->taskqueue_mutex);
+    size_t size = (size_t)taskqueue_size(queue->taskqueue);
+    size_t room = size < pool->buffersize ? pool->buffersize - size : 0;
+    size_t done = n < room ? n : room;
+    if (done > 0 && taskqueue_put_batch_stamp(queue->taskqueue, tasks, (int)done, enqueued) == -1) {
+        done = 0;
+    }
+    pthread_mutex_unlock(queue->taskqueue_mutex);
+    return done;
+}
+
+/*
+ * Take a task from a shared queue and wake up waiting producers.
+ * Return 0 if success or -1.
+ */
+static int workerpool_queue_take(workerpool_t *pool, poolqueue_t *queue, task_t *task) {
+    
+    return workerpool_queue_take_batch(pool, queue, task, 1) == 1 ? 0 : -1;
+}
+
+/*
+ * Take up to max tasks from a shared queue under one lock, and wake up
+ * waiting producers once. A task queue gives no more than its fair share
+ * over the live workers, so one worker never hoards tasks others could
+ * run. A ring has no lock to save and gives one task.
+ * Return number of tasks taken.
+ */
+static int workerpool_queue_take_batch(workerpool_t *pool, poolqueue_t *queue, task_t *tasks, int max) {
+    
+    int r = 0;
+    if (queue->taskring != NULL) {
+        r = taskring_take(queue->taskring, tasks) == 0 ? 1 : 0;
+    }
+    
+    // Only lock the task queue when there are tasks in it.
+    if (r == 0 && taskqueue_size(queue->taskqueue) > 0) {
+        pthread_mutex_lock(queue->taskqueue_mutex);
+        if (max > 1) {
+            int live = (int)atomic_load_explicit(&pool->live_workers, memory_order_relaxed);
+            int share = taskqueue_size(queue->taskqueue) / (live > 1 ? live : 1);
+            max = share < max ? (share > 1 ? share : 1) : max;
+        }
+        r = taskqueue_take_batch(queue->taskqueue, tasks, max);
+        pthread_mutex_unlock(queue->taskqueue_mutex);
+    }
+    
+    // Producers of all lanes wait on the same condition, wake them all
+    // and let each check its own lane.
+    // The fence pairs with the announcement in workerpool_queue_wait,
+    // polls of empty shards need none.
+    // An event loop waiting for space is told through its descriptor.
+    if (r > 0) {
+        atomic_thread_fence(memory_order_seq_cst);
+        if (atomic_load(&pool->producers_waiting) > 0) {
+            pthread_mutex_lock(pool->poolsafe.queue_notify_mutex);
+            pthread_cond_broadcast(pool->poolsafe.queue_notify);
+            pthread_mutex_unlock(pool->poolsafe.queue_notify_mutex);
+        }
+        if (atomic_load_explicit(&pool->space_wanted, memory_order_relaxed) &&
+            atomic_exchange(&pool->space_wanted, 0)) {
+            poolevent_signal(pool->submission_event);
+        }
+    }
+    return r;
+}
+
+/*
+ * Return number of tasks in a shared queue, without its lock.
+ * Both sizes are atomic, so the check before a worker parks is no race.
+ */
+static int workerpool_queue_size(poolqueue_t *queue) {
+    
+    return taskqueue_size(queue->taskqueue) + taskring_size(queue->taskring);
+}
+
+/*
+ * Take a task from the highest non-empty priority lane.
+ * With aging, every aging-th take of a worker scans from the lowest lane
+ * instead, so low priority tasks are never starved forever.
+ * Tasks a worker took at once from a lane before go ahead of that lane and
+ * the lower ones, but after any task of a higher lane, whichever end the
+ * scan starts from.
+ * Return 0 if success or -1.
+ */
+static int workerpool_lanes_take(workerpool_t *pool, workerthread_t *worker, task_t *task) {
+    
+    // Only takes which got a task count, polls of empty lanes do not.
+    int lowest_first = worker != NULL && pool->options.aging > 0 &&
+                       worker->takes + 1 >= pool->options.aging;
+    int taken = workerpool_taken_prio(pool, worker);
+    uint node = workerpool_caller_node(pool, worker);
+    uint home = workerpool_caller_shard(pool, worker);
+    int r = -1;
+    for (int i = 0; r == -1 && i < PRIO_LANES; i++) {
+        int prio = lowest_first ? PRIO_LANES - 1 - i : i;
+        if (prio == taken && workerpool_taken_pop(worker, task) == 0) {
+            r = 0;
+            break;
+        }
+        r = prio == PRIO_DEFAULT ?
+            workerpool_shards_take(pool, worker, node, home, task) :
+            workerpool_queue_take_worker(pool, worker, pool->lanes + prio, task);
+    }
+    if (r == -1) {
+        r = workerpool_taken_pop(worker, task);
+    }
+    if (r == 0 && worker != NULL) {
+        worker->takes = lowest_first ? 0 : worker->takes + 1;
+    }
+    return r;
+}
+
+/*
+ * Take a task from a shared queue for worker. When nothing is left of the
+ * tasks it took at once before, the worker takes a batch and keeps all but
+ * the first, so producers are signalled once for the whole batch.
+ * Return 0 if success or -1.
+ */
+static int workerpool_queue_take_worker(workerpool_t *pool, workerthread_t *worker, poolqueue_t *queue, task_t *task) {
+    
+    if (worker == NULL || worker->taken == NULL || worker->taken_next < worker->taken_count) {
+        return workerpool_queue_take(pool, queue, task);
+    }
+    int n = workerpool_queue_take_batch(pool, queue, worker->taken, (int)pool->options.take_batch);
+    if (n == 0) {
+        return -1;
+    }
+    *task = worker->taken[0];
+    worker->taken_lane = queue;
+    worker->taken_next = 1;
+    worker->taken_count = (uint)n;
+    return 0;
+}
+
+/*
+ * Pop the next task worker took at once from a lane.
+ * Return 0 if success or -1.
+ */
+static int workerpool_taken_pop(workerthread_t *worker, task_t *task) {
+    
+    if (worker == NULL || worker->taken_next >= worker->taken_count) {
+        return -1;
+    }
+    *task = worker->taken[worker->taken_next++];
+    return 0;
+}
+
+/*
+ * Return priority of the lane worker took the tasks it holds from, or -1
+ * when it holds none. Shards belong to the default lane.
+ */
+static int workerpool_taken_prio(workerpool_t *pool, workerthread_t *worker) {
+    
+    if (worker == NULL || worker->taken_next >= worker->taken_count) {
+        return -1;
+    }
+    poolqueue_t *lane = worker->taken_lane;
+    if (lane >= pool->lanes && lane < pool->lanes + PRIO_LANES) {
+        return (int)(lane - pool->lanes);
+    }
+    return PRIO_DEFAULT;
+}
+
+/*
+ * Put tasks worker took at once but did not run back to the head of their
+ * lane, when it pauses or retires, so they keep their place ahead of tasks
+ * put since.
+ */
+static void workerpool_taken_return(workerpool_t *pool, workerthread_t *worker) {
+    
+    uint left = worker->taken_count - worker->taken_next;
+    if (left > 0) {
+        poolqueue_t *lane = worker->taken_lane;
+        pthread_mutex_lock(lane->taskqueue_mutex);
+        taskqueue_put_front_batch(lane->taskqueue, worker->taken + worker->taken_next, (int)left);
+        pthread_mutex_unlock(lane->taskqueue_mutex);
+        workerpool_worker_notify(pool, left);
+    }
+    worker->taken_next = 0;
+    worker->taken_count = 0;
+}
+
+/*
+ * Take a task from the default lane shards of node, polling them round
+ * robin from the home shard.
+ * Return 0 if success or -1.
+ */
+static int workerpool_shards_take(workerpool_t *pool, workerthread_t *worker, uint node, uint home, task_t *task) {
+    
+    if (pool->shards == NULL) {
+        return workerpool_queue_take_worker(pool, worker, pool->lanes + PRIO_DEFAULT, task);
+    }
+    poolqueue_t *shards = pool->shards + node * pool->shard_count;
+    for (uint i = 0; i < pool->shard_count; i++) {
+        if (workerpool_queue_take_worker(pool, worker, shards + (home + i) % pool->shard_count, task) == 0) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Take a task from the default lanes of other nodes in NUMA mode.
+ * Return 0 if success or -1.
+ */
+static int workerpool_lanes_take_remote(workerpool_t *pool, uint node, task_t *task) {
+    
+    for (uint i = 1; i < pool->node_count; i++) {
+        if (workerpool_shards_take(pool, NULL, (node + i) % pool->node_count, 0, task) == 0) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Return number of tasks in all priority lanes.
+ */
+static int workerpool_lanes_size(workerpool_t *pool) {
+    
+    int size = 0;
+    for (int i = 0; i < PRIO_LANES; i++) {
+        size += workerpool_queue_size(pool->lanes + i);
+    }
+    if (pool->shards != NULL) {
+        for (uint i = 0; i < pool->node_count * pool->shard_count; i++) {
+            size += workerpool_queue_size(pool->shards + i);
+        }
+    }
+    return size;
+}
+
+/*
+ * Return the lane of prio for node and shard.
+ * The lane of default priority is split into shards per node.
+ */
+static inline poolqueue_t* workerpool_lane(workerpool_t *pool, uint prio, uint node, uint shard) {
+    
+    if (prio == PRIO_DEFAULT && pool->shards != NULL) {
+        return pool->shards + node * pool->shard_count + shard % pool->shard_count;
+    }
+    return pool->lanes + prio;
+}
+
+/*
+ * Return NUMA node of worker, or of the current cpu for threads outside
+ * the pool. Always 0 unless in NUMA mode.
+ */
+static uint workerpool_caller_node(workerpool_t *pool, workerthread_t *worker) {
+    
+    if (pool->node_count == 1) {
+        return 0;
+    }
+    if (worker != NULL) {
+        return worker->node;
+    }
+#ifdef __linux__
+    int node = pooltopology_node_of(pool->topology, sched_getcpu());
+    return node < 0 ? 0 : (uint)node;
+#else
+    return 0;
+#endif
+}
+
+/*
+ * Return injection shard of worker, its home shard, or a shard hashed
+ * from the thread id for threads outside the pool.
+ */
+static uint workerpool_caller_shard(workerpool_t *pool, workerthread_t *worker) {
+    
+    if (pool->shard_count == 1) {
+        return 0;
+    }
+    if (worker != NULL) {
+        return worker->shard;
+    }
+    uint64_t hash = (uint64_t)(uintptr_t)pthread_self() * 0x9E3779B97F4A7C15ULL;
+    return (uint)(hash >> 32) % pool->shard_count;
+}
+
+/*
+ * Run a task in current thread.
+ */
+static void workerpool_task_run(workerpool_t *pool, task_t *task) {
+    
+    POOLTRACE(pool->trace, TRACE_START, task->func);
+#ifdef WORKERPOOL_STATS
+    workerthread_t *worker = (workerthread_t*)pthread_getspecific(pool->worker_key);
+    poolstats_t *stats = worker != NULL ? worker->stats : pool->stats;
+    uint64_t start = workerpool_clock();
+    if (task->enqueued != 0 && start > task->enqueued) {
+        POOLSTATS_RECORD(stats, wait_hist, start - task->enqueued);
+    }
+    workerpool_task_call(pool, task);
+    POOLSTATS_RECORD(stats, run_hist, workerpool_clock() - start);
+    POOLSTATS_ADD(stats, tasks, 1);
+#else
+    workerpool_task_call(pool, task);
+#endif
+    POOLTRACE(pool->trace, TRACE_END, task->func);
+}
+
+/*
+ * Call the task function, on a fiber of its own in fiber mode.
+ * A task started from a fiber, by an overflowing put or by
+ * workerpool_task_run_one, runs on the fiber of its caller. So do all
+ * tasks when no fiber can be allocated.
+ */
+static void workerpool_task_call(workerpool_t *pool, task_t *task) {
+    
+    if (pool->fiberpool != NULL && task->func != workerpool_fiber_resume &&
+        pthread_getspecific(pool->fiber_key) == NULL) {
+        taskfiber_t *fiber = taskfiber_alloc(pool->fiberpool, task);
+        if (fiber != NULL) {
+            fiber->owner = pool;
+            fiber->waiter.func = workerpool_fiber_wake;
+            fiber->waiter.arg = fiber;
+            workerpool_fiber_run(pool, fiber);
+            return;
+        }
+    }
+    task->func(task_args(task));
+}
+
+/*
+ * Run fiber until it finishes or suspends, then act on why it suspended.
+ * This happens off the fiber's stack, so another thread may resume the
+ * fiber as soon as it is yielded or waits on its future.
+ */
+static void workerpool_fiber_run(workerpool_t *pool, taskfiber_t *fiber) {
+    
+    void *outer = pthread_getspecific(pool->fiber_key);
+    pthread_setspecific(pool->fiber_key, fiber);
+    fiber_state_t state = taskfiber_switch(fiber);
+    pthread_setspecific(pool->fiber_key, outer);
+    
+    switch (state) {
+        case FIBER_YIELDED:
+            workerpool_fiber_wake(fiber);
+            break;
+        case FIBER_AWAITING:
+            if (taskfuture_add_waiter(fiber->awaited, &fiber->waiter) == -1) {
+                workerpool_fiber_wake(fiber);
+            }
+            break;
+        default:
+            taskfiber_free(fiber);
+            break;
+    }
+}
+
+/*
+ * Task function that resumes a suspended fiber.
+ */
+static void workerpool_fiber_resume(void *arg) {
+    
+    taskfiber_t *fiber = (taskfiber_t*)arg;
+    workerpool_fiber_run((workerpool_t*)fiber->owner, fiber);
+}
+
+/*
+ * Put a suspended fiber to the back of the default lane to be resumed.
+ * The put never waits. Should the pool refuse, the fiber is resumed in
+ * the calling thread.
+ */
+static void workerpool_fiber_wake(void *arg) {
+    
+    taskfiber_t *fiber = (taskfiber_t*)arg;
+    workerpool_t *pool = (workerpool_t*)fiber->owner;
+    workerthread_t *worker = (workerthread_t*)pthread_getspecific(pool->worker_key);
+    task_t task = { .func = workerpool_fiber_resume, .args = fiber };
+    if (workerpool_task_put_lane(pool, PRIO_DEFAULT, workerpool_caller_shard(pool, worker), &task, PUT_SPILL) == -1) {
+        workerpool_fiber_resume(fiber);
+    }
+}
+
+/*
+ * Take a task for worker.
+ * Local deque first, then the shared task queue, then steal from other workers.
+ * In NUMA mode the lanes of other nodes come last.
+ * Return 0 if success or -1.
+ */
+static int workerpool_task_take(workerpool_t *pool, workerthread_t *worker, task_t *task) {
+    
+    if (worker->deque != NULL && workdeque_pop(worker->deque, task) == 0) {
+        return 0;
+    }
+    
+    if (workerpool_lanes_take(pool, worker, task) == 0) {
+        return 0;
+    }
+    
+    if (worker->deque != NULL && workerpool_task_steal(pool, worker, task) == 0) {
+        return 0;
+    }
+    
+    // Our node is out of work, help the others.
+    return workerpool_lanes_take_remote(pool, worker->node, task);
+}
+
+/*
+ * Steal a task from other workers, starting at a random victim.
+ * Worker is NULL when called from a thread outside the pool.
+ * Return 0 if success or -1.
+ */
+static int workerpool_task_steal(workerpool_t *pool, workerthread_t *worker, task_t *task) {
+    
+    uint size = atomic_load_explicit(&pool->worker_slots, memory_order_acquire);
+    if (size < 2) {
+        return -1;
+    }
+    // Threads outside the pool have no seed of their own.
+    uint seed = (uint)(uintptr_t)task;
+    uint start = (uint)rand_r(worker != NULL ? &worker->seed : &seed) % size;
+    
+    // In NUMA mode victims of our node go first, the others only after
+    // our node has nothing left.
+    uint node = workerpool_caller_node(pool, worker);
+    int numa = pool->node_count > 1;
+    for (int remote = 0; remote < (numa ? 2 : 1); remote++) {
+        for (uint i = 0; i < size; i++) {
+            workerthread_t *victim = workerpool_worker_at(pool, (start + i) % size);
+            if (victim == worker || (numa && (victim->node != node) != remote)) {
+                continue;
+            }
+            if (workdeque_steal(victim->deque, task) == 0) {
+                POOLSTATS_ADD(worker != NULL ? worker->stats : pool->stats, steals, 1);
+                return 0;
+            }
+        }
+    }
+    return -1;
+}
+
+/*
+ * Return 1 if any task is waiting in the task queue or worker deques.
+ */
+static int workerpool_task_pending(workerpool_t *pool) {
+    
+    if (workerpool_lanes_size(pool) > 0) {
+        return 1;
+    }
+    if (pool->options.schedule == SCHEDULE_STEALING) {
+        uint size = atomic_load_explicit(&pool->worker_slots, memory_order_acquire);
+        for (uint i = 0; i < size; i++) {
+            if (workdeque_size(workerpool_worker_at(pool, i)->deque) > 0) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * Return 1 if no task is waiting and every worker is parked.
+ */
+static int workerpool_drained(workerpool_t *pool) {
+    
+    if (workerpool_task_pending(pool)) {
+        return 0;
+    }
+    return atomic_load(&pool->idle_workers) >= atomic_load(&pool->live_workers);
+}
+
+/*
+ * Take every task left in the lanes, see workerpool_queue_cancel.
+ * Return number of tasks taken.
+ */
+static size_t workerpool_lanes_cancel(workerpool_t *pool, void (*cancel)(task_t*)) {
+    
+    size_t count = 0;
+    for (int i = 0; i < PRIO_LANES; i++) {
+        count += workerpool_queue_cancel(pool, pool->lanes + i, cancel);
+    }
+    for (uint i = 0; pool->shards != NULL && i < pool->node_count * pool->shard_count; i++) {
+        count += workerpool_queue_cancel(pool, pool->shards + i, cancel);
+    }
+    return count;
+}
+
+/*
+ * Take every task left in a shared queue. Tasks put by users go to cancel,
+ * if any. Tasks of the pool and its helpers never do, they are finished
+ * without running instead, so nobody waits for them forever. Suspended
+ * fibers are put back for the next start.
+ * Return number of tasks taken.
+ */
+static size_t workerpool_queue_cancel(workerpool_t *pool, poolqueue_t *queue, void (*cancel)(task_t*)) {
+    
+    size_t count = 0;
+    taskqueue_t kept;
+    taskqueue_init_nodepool(&kept, pool->nodepool);
+    task_t task;
+    while (workerpool_queue_take(pool, queue, &task) == 0) {
+        const internaltask_t *internal = workerpool_task_internal(&task);
+        if (internal == NULL) {
+            if (cancel != NULL) {
+                cancel(&task);
+            }
+        } else if (internal->cancel != NULL) {
+            internal->cancel(task_args(&task), cancel);
+        } else {
+            taskqueue_put_batch(&kept, &task, 1);
+        }
+        count++;
+    }
+    while (taskqueue_take(&kept, &task) == 0) {
+        workerpool_queue_put(pool, queue, &task, PUT_SPILL);
+    }
+    return count;
+}
+
+/*
+ * Spin, then yield, waiting for a task to show up.
+ * The spin budget follows the observed gap between tasks: it grows when
+ * a task arrives while spinning and shrinks when the worker has to park.
+ * Return 0 with task if success or -1.
+ */
+static int workerpool_worker_spin(workerpool_t *pool, workerthread_t *worker, task_t *task) {
+    
+    int r = -1;
+    atomic_fetch_add(&pool->spinning_workers, 1);
+    
+    uint spins = 0;
+    while (spins < worker->spin_budget && pool->poolsafe.pool_status == RUNNING) {
+        cpu_relax();
+        spins++;
+        if (workerpool_task_pending(pool) && workerpool_task_take(pool, worker, task) == 0) {
+            r = 0;
+            break;
+        }
+    }
+    
+    for (uint i = 0; r == -1 && i < pool->options.yield_limit &&
+         pool->poolsafe.pool_status == RUNNING; i++) {
+        sched_yield();
+        r = workerpool_task_take(pool, worker, task);
+    }
+    
+    if (r == 0) {
+        // Keep budget about twice the gap we just waited.
+        uint budget = spins * 2 > worker->spin_budget ? spins * 2 : worker->spin_budget;
+        worker->spin_budget = budget > pool->options.spin_limit ? pool->options.spin_limit : budget;
+    } else {
+        worker->spin_budget = worker->spin_budget / 2 > MIN_SPIN_BUDGET ?
+                              worker->spin_budget / 2 : MIN_SPIN_BUDGET;
+    }
+    
+    // Producers do not wake anybody while we spin, so hand over the wakeup
+    // if more work is waiting.
+    atomic_fetch_sub(&pool->spinning_workers, 1);
+    if (r == 0 && workerpool_task_pending(pool)) {
+        workerpool_worker_notify(pool, 1);
+    }
+    return r;
+}
+
+/*
+ * Park worker until it is notified.
+ * The worker pushes itself to the idle stack and checks for pending tasks
+ * again before sleeping, so a task put in between is never missed.
+ * One parked worker sleeps only until the next timer, and workers above
+ * the minimum of an elastic pool only for the keep-alive time.
+ * Return -1 when the pool stops or pauses or the worker retires, otherwise 0.
+ */
+static int workerpool_worker_park(workerpool_t *pool, workerthread_t *worker) {
+    
+    pthread_mutex_lock(pool->poolsafe.worker_notify_mutex);
+    if (pool->poolsafe.pool_status == STOP ||
+        pool->poolsafe.pool_status == PAUSE) {
+        pthread_mutex_unlock(pool->poolsafe.worker_notify_mutex);
+        return -1;
+    }
+    
+    // Retire when the pool has been shrunk.
+    uint requests = atomic_load(&pool->retire_requests);
+    while (requests > 0 && !atomic_compare_exchange_weak(&pool->retire_requests, &requests, requests - 1));
+    if (requests > 0) {
+        atomic_fetch_sub(&pool->live_workers, 1);
+        if (atomic_load_explicit(&pool->closing, memory_order_relaxed)) {
+            pthread_cond_broadcast(pool->poolsafe.drain_notify);
+        }
+        pthread_mutex_unlock(pool->poolsafe.worker_notify_mutex);
+        return -1;
+    }
+    
+    // An idle worker ends any backlog the pool would grow for.
+    atomic_store_explicit(&pool->backlog_since, 0, memory_order_relaxed);
+    worker->idle_next = pool->idle_stack;
+    pool->idle_stack = worker;
+    atomic_fetch_add(&pool->idle_workers, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    
+    if (workerpool_task_pending(pool)) {
+        // Still on top of the stack since we hold the lock.
+        pool->idle_stack = worker->idle_next;
+        atomic_fetch_sub(&pool->idle_workers, 1);
+        pthread_mutex_unlock(pool->poolsafe.worker_notify_mutex);
+        return 0;
+    }
+    
+    // The last worker going idle lets a shutdown waiting for the drain go on.
+    if (atomic_load_explicit(&pool->closing, memory_order_relaxed)) {
+        pthread_cond_broadcast(pool->poolsafe.drain_notify);
+    }
+    
+#ifdef WORKERPOOL_STATS
+    uint64_t parked = workerpool_clock();
+#endif
+    POOLSTATS_ADD(worker->stats, parks, 1);
+    POOLTRACE(pool->trace, TRACE_PARK, NULL);
+    
+    int r = 0;
+    uint64_t deadline = timerwheel_next(pool->timers);
+    if (deadline != UINT64_MAX && pool->timekeeper == NULL) {
+        // One parked worker keeps time for pending timers.
+        pool->timekeeper = worker;
+        pool->timekeeper_deadline = deadline;
+        pthread_mutex_unlock(pool->poolsafe.worker_notify_mutex);
+        workerpool_worker_wait(pool, worker, deadline);
+    } else if (atomic_load(&pool->live_workers) > atomic_load(&pool->poolsize)) {
+        // Workers above the minimum retire after keep-alive time.
+        pthread_mutex_unlock(pool->poolsafe.worker_notify_mutex);
+        if (workerpool_worker_wait(pool, worker, workerpool_clock() + pool->options.keepalive) &&
+            workerpool_worker_shrink(pool) == 0) {
+            r = -1;
+        }
+    } else {
+        pthread_mutex_unlock(pool->poolsafe.worker_notify_mutex);
+        pthread_mutex_lock(worker->park_mutex);
+        while (!(worker->notified & WORKER_NOTIFY_TASK)) {
+            pthread_cond_wait(worker->park_notify, worker->park_mutex);
+        }
+        worker->notified = 0;
+        pthread_mutex_unlock(worker->park_mutex);
+    }
+    POOLSTATS_ADD(worker->stats, idle_ns, workerpool_clock() - parked);
+    POOLTRACE(pool->trace, TRACE_WAKE, NULL);
+    return r;
+}
+
+/*
+ * Wake up at most n idle workers, most recently parked first.
+ */
+static void workerpool_worker_notify(workerpool_t *pool, size_t n) {
+    
+    workerpool_worker_notify_node(pool, n, -1);
+}
+
+/*
+ * Wake up at most n idle workers, those of node first in NUMA mode.
+ * Node -1 takes the most recently parked.
+ */
+static void workerpool_worker_notify_node(workerpool_t *pool, size_t n, int node) {
+    
+    // Nobody is parked, skip the lock.
+    // The fence pairs with the one in workerpool_worker_park.
+    // An elastic pool may grow instead.
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&pool->idle_workers, memory_order_relaxed) == 0) {
+        workerpool_worker_grow(pool);
+        return;
+    }
+    
+    // A spinning worker will pick the task up, it passes the wakeup on when
+    // more work is left, and parks only after checking the queues again.
+    if (n == 1 && atomic_load_explicit(&pool->spinning_workers, memory_order_relaxed) > 0) {
+        return;
+    }
+    
+    pthread_mutex_lock(pool->poolsafe.worker_notify_mutex);
+    workerthread_t *woken = NULL;
+    while (n > 0 && pool->idle_stack != NULL) {
+        workerthread_t **cursor = &pool->idle_stack;
+        if (node >= 0 && pool->node_count > 1) {
+            for (workerthread_t **next = cursor; *next != NULL; next = &(*next)->idle_next) {
+                if ((*next)->node == (uint)node) {
+                    cursor = next;
+                    break;
+                }
+            }
+        }
+        workerthread_t *worker = *cursor;
+        *cursor = worker->idle_next;
+        atomic_fetch_sub(&pool->idle_workers, 1);
+        worker->idle_next = woken;
+        woken = worker;
+        n--;
+    }
+    pthread_mutex_unlock(pool->poolsafe.worker_notify_mutex);
+    
+    while (woken != NULL) {
+        workerthread_t *next = woken->idle_next;
+        workerthread_wake(woken, WORKER_NOTIFY_TASK);
+        woken = next;
+    }
+}
+
+/*
+ * Wake up all idle workers, used when pool status changes.
+ */
+static void workerpool_worker_notify_all(workerpool_t *pool) {
+    
+    pthread_mutex_lock(pool->poolsafe.worker_notify_mutex);
+    workerthread_t *woken = pool->idle_stack;
+    pool->idle_stack = NULL;
+    atomic_store(&pool->idle_workers, 0);
+    pthread_mutex_unlock(pool->poolsafe.worker_notify_mutex);
+    
+    while (woken != NULL) {
+        workerthread_t *next = woken->idle_next;
+        workerthread_wake(woken, WORKER_NOTIFY_TASK);
+        woken = next;
+    }
+}
+
+/*
+ * Return monotonic time in nanoseconds.
+ */
+static uint64_t workerpool_clock() {
+    
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+/*
+ * Add a timer putting the task after delay, then every period if not 0.
+ * Wake up the timekeeper when the new timer is due before its deadline,
+ * or a parked worker to become timekeeper when there is none.
+ * Return id of the timer if success or 0.
+ */
+static timerid_t workerpool_timer_add(workerpool_t *pool, uint64_t delay, uint64_t period, void (*taskfunc)(void*), void *arg) {
+    
+    if (workerpool_status(pool) == INVALID || taskfunc == NULL) {
+        return 0;
+    }
+    timerid_t id = timerwheel_add(pool->timers, workerpool_clock() + delay, period, taskfunc, arg);
+    if (id == 0) {
+        return 0;
+    }
+    
+    pthread_mutex_lock(pool->poolsafe.worker_notify_mutex);
+    workerthread_t *timekeeper = pool->timekeeper;
+    uint64_t deadline = timerwheel_next(pool->timers);
+    if (timekeeper != NULL && deadline < pool->timekeeper_deadline) {
+        pool->timekeeper_deadline = deadline;
+        workerthread_wake(timekeeper, WORKER_NOTIFY_TIMER);
+    }
+    pthread_mutex_unlock(pool->poolsafe.worker_notify_mutex);
+    
+    if (timekeeper == NULL) {
+        workerpool_worker_notify(pool, 1);
+    }
+    return id;
+}
+
+/*
+ * Put due timers to the default lane.
+ * Only reads the clock when a timer is pending.
+ */
+static void workerpool_timer_poll(workerpool_t *pool, workerthread_t *worker) {
+    
+    uint64_t next = timerwheel_next(pool->timers);
+    if (next == UINT64_MAX) {
+        return;
+    }
+    uint64_t now = workerpool_clock();
+    if (now < next) {
+        return;
+    }
+    
+    task_t tasks[TIMER_BATCH];
+    int n;
+    do {
+        n = timerwheel_advance(pool->timers, now, tasks, TIMER_BATCH);
+#ifdef WORKERPOOL_STATS
+        for (int i = 0; i < n; i++) {
+            tasks[i].enqueued = now;
+        }
+#endif
+        if (n > 0) {
+            workerpool_queue_put_batch(pool, workerpool_lane(pool, PRIO_DEFAULT, worker->node, worker->shard), tasks, n, 0, 0);
+            workerpool_worker_notify_node(pool, n, (int)worker->node);
+        }
+    } while (n == TIMER_BATCH);
+}
+
+/*
+ * Park worker until deadline, a task, or an earlier timer when it is
+ * the timekeeper. The worker is on the idle stack, so it may be handed
+ * a task meanwhile.
+ * Return 1 when the deadline passed and nobody took the worker off the
+ * idle stack, otherwise 0.
+ */
+static int workerpool_worker_wait(workerpool_t *pool, workerthread_t *worker, uint64_t deadline) {
+    
+    struct timespec ts;
+    ts.tv_sec = (time_t)(deadline / 1000000000);
+    ts.tv_nsec = (long)(deadline % 1000000000);
+    
+    pthread_mutex_lock(worker->park_mutex);
+    int r = 0;
+    while (worker->notified == 0 && r != ETIMEDOUT) {
+        r = pthread_cond_timedwait(worker->park_notify, worker->park_mutex, &ts);
+    }
+    pthread_mutex_unlock(worker->park_mutex);
+    
+    // Give up the role and leave the idle stack unless a notifier took us off.
+    pthread_mutex_lock(pool->poolsafe.worker_notify_mutex);
+    int timekeeper = pool->timekeeper == worker;
+    if (timekeeper) {
+        pool->timekeeper = NULL;
+        pool->timekeeper_deadline = UINT64_MAX;
+    }
+    int popped = 1;
+    for (workerthread_t **cursor = &pool->idle_stack; *cursor != NULL; cursor = &(*cursor)->idle_next) {
+        if (*cursor == worker) {
+            *cursor = worker->idle_next;
+            atomic_fetch_sub(&pool->idle_workers, 1);
+            popped = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(pool->poolsafe.worker_notify_mutex);
+    
+    // A notifier that took us off the stack signals us exactly once, wait
+    // for it so the signal does not end a later park.
+    pthread_mutex_lock(worker->park_mutex);
+    while (popped && !(worker->notified & WORKER_NOTIFY_TASK)) {
+        pthread_cond_wait(worker->park_notify, worker->park_mutex);
+    }
+    int notified = worker->notified;
+    worker->notified = 0;
+    pthread_mutex_unlock(worker->park_mutex);
+    
+    // We are off to run tasks, let another parked worker keep time.
+    if (timekeeper && popped && timerwheel_next(pool->timers) != UINT64_MAX) {
+        workerpool_worker_notify(pool, 1);
+    }
+    return !popped && !notified && r == ETIMEDOUT;
+}
+
+/*
+ * Return the worker of a slot.
+ */
+static inline workerthread_t* workerpool_worker_at(workerpool_t *pool, uint index) {
+    
+    return pool->worker_chunks[index / WORKER_CHUNK_SIZE] + index % WORKER_CHUNK_SIZE;
+}
+
+/*
+ * Start one more worker thread, reusing the slot of a retired worker.
+ * Pool mutex must be held.
+ * Return 0 if success or -1.
+ */
+static int workerpool_worker_spawn(workerpool_t *pool) {
+    
+    uint slots = atomic_load(&pool->worker_slots);
+    workerthread_t *worker = NULL;
+    for (uint i = 0; i < slots; i++) {
+        workerthread_t *slot = workerpool_worker_at(pool, i);
+        if (atomic_load(&slot->running) == 0) {
+            worker = slot;
+            break;
+        }
+    }
+    
+    if (worker == NULL) {
+        if (slots >= MAX_WORKERPOOL_SIZE) {
+            return -1;
+        }
+        workerthread_t **chunk = pool->worker_chunks + slots / WORKER_CHUNK_SIZE;
+        if (*chunk == NULL) {
+            *chunk = (workerthread_t*)calloc(WORKER_CHUNK_SIZE, sizeof(workerthread_t));
+            if (*chunk == NULL) {
+                return -1;
+            }
+        }
+        worker = workerpool_worker_at(pool, slots);
+        workerthread_init(worker, pool, slots);
+        
+        // Publish the slot to thieves once it is complete.
+        atomic_store_explicit(&pool->worker_slots, slots + 1, memory_order_release);
+    } else if (worker->joinable) {
+        pthread_join(*worker->thread, NULL);
+        worker->joinable = 0;
+    }
+    
+    worker->idle_next = NULL;
+    worker->notified = 0;
+    worker->spin_budget = pool->options.spin_limit;
+    worker->takes = 0;
+    atomic_store(&worker->running, 1);
+    if (pthread_create(worker->thread, NULL, (void*)workerpool_workerthread_func, (void*)worker) != 0) {
+        atomic_store(&worker->running, 0);
+        return -1;
+    }
+    worker->joinable = 1;
+    atomic_fetch_add(&pool->live_workers, 1);
+    DEBUG_INFO("[INFO] worker -%10d - start.\n", (int)*worker->thread);
+    return 0;
+}
+
+/*
+ * Spawn a worker when the pool is elastic, below its maximum size and
+ * enough tasks are waiting, or tasks have waited grow_wait nanoseconds
+ * since no worker was idle. Never blocks on the pool mutex.
+ */
+static void workerpool_worker_grow(workerpool_t *pool) {
+    
+    uint maxsize = atomic_load_explicit(&pool->maxsize, memory_order_relaxed);
+    if (atomic_load_explicit(&pool->live_workers, memory_order_relaxed) >= maxsize) {
+        return;
+    }
+    if ((uint)workerpool_lanes_size(pool) < pool->options.grow_depth) {
+        if (pool->options.grow_wait == 0) {
+            return;
+        }
+        // The first put finding no worker idle starts the clock.
+        uint64_t now = workerpool_clock();
+        uint64_t since = atomic_load_explicit(&pool->backlog_since, memory_order_relaxed);
+        if (since == 0) {
+            atomic_compare_exchange_strong(&pool->backlog_since, &since, now);
+            return;
+        }
+        if (now - since < pool->options.grow_wait) {
+            return;
+        }
+    }
+    if (pthread_mutex_trylock(pool->poolsafe.pool_mutex) != 0) {
+        return;
+    }
+    if (pool->poolsafe.pool_status == RUNNING &&
+        atomic_load(&pool->live_workers) < atomic_load(&pool->maxsize)) {
+        atomic_store_explicit(&pool->backlog_since, 0, memory_order_relaxed);
+        workerpool_worker_spawn(pool);
+    }
+    pthread_mutex_unlock(pool->poolsafe.pool_mutex);
+}
+
+/*
+ * Count one worker as retired if the pool is above its minimum size.
+ * Return 0 if success or -1.
+ */
+static int workerpool_worker_shrink(workerpool_t *pool) {
+    
+    uint live = atomic_load(&pool->live_workers);
+    while (live > atomic_load(&pool->poolsize)) {
+        if (atomic_compare_exchange_weak(&pool->live_workers, &live, live - 1)) {
+            if (atomic_load(&pool->closing)) {
+                pthread_mutex_lock(pool->poolsafe.worker_notify_mutex);
+                pthread_cond_broadcast(pool->poolsafe.drain_notify);
+                pthread_mutex_unlock(pool->poolsafe.worker_notify_mutex);
+            }
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static void workerthread_wake(workerthread_t *workerthread, int reason) {
+    
+    if (reason == WORKER_NOTIFY_TASK) {
+        POOLSTATS_ADD(workerthread->stats, wakeups, 1);
+    }
+    pthread_mutex_lock(workerthread->park_mutex);
+    workerthread->notified |= reason;
+    pthread_cond_signal(workerthread->park_notify);
+    pthread_mutex_unlock(workerthread->park_mutex);
+}
+
+/*
+ * Init a shared queue.
+ * With QUEUE_RING the ring is the buffer, and the task queue only keeps
+ * tasks spilled by workers when the ring is full.
+ */
+static void poolqueue_init(poolqueue_t *queue, workerpool_t *pool) {
+    
+    queue->taskqueue = taskqueue_new();
+    taskqueue_init_nodepool(queue->taskqueue, pool->nodepool);
+    queue->taskqueue_mutex = (pthread_mutex_t*)malloc(sizeof(pthread_mutex_t));
+    pthread_mutex_init(queue->taskqueue_mutex, NULL);
+    queue->taskring = NULL;
+    if (pool->options.queue == QUEUE_RING) {
+        queue->taskring = taskring_new();
+        taskring_init(queue->taskring, pool->buffersize);
+    }
+}
+
+static void poolqueue_destroy(poolqueue_t *queue) {
+    
+    taskqueue_destroy(queue->taskqueue);
+    taskring_destroy(queue->taskring);
+    pthread_mutex_destroy(queue->taskqueue_mutex);
+    free(queue->taskqueue_mutex);
+}
+
+static void workerthread_init(workerthread_t *workerthread, workerpool_t *pool, uint index) {
+    
+    if (workerthread == NULL) {
+        return;
+    }
+    workerthread->thread = (pthread_t*)malloc(sizeof(pthread_t));
+    workerthread->pool = pool;
+    workerthread->index = index;
+    workerthread->seed = index + 1;
+    workerthread->idle_next = NULL;
+    workerthread->notified = 0;
+    workerthread->spin_budget = pool->options.spin_limit;
+    workerthread->takes = 0;
+    workerthread->taken = NULL;
+    workerthread->taken_next = 0;
+    workerthread->taken_count = 0;
+    workerthread->taken_lane = NULL;
+    if (pool->options.take_batch > 1) {
+        workerthread->taken = (task_t*)malloc(sizeof(task_t) * pool->options.take_batch);
+    }
+    atomic_init(&workerthread->running, 0);
+    workerthread->joinable = 0;
+    workerthread_place(workerthread, pool);
+    
+    // Deque and statistics outlive restarts of the pool, so readers and
+    // stealers outside the pool never race a free.
+    if (index >= atomic_load(&pool->kept_slots)) {
+        if (pool->options.schedule == SCHEDULE_STEALING) {
+            workerthread->deque = workdeque_new();
+            workdeque_init(workerthread->deque, pool->options.dequesize);
+        }
+#ifdef WORKERPOOL_STATS
+        workerthread->stats = poolstats_new();
+        poolstats_init(workerthread->stats);
+#endif
+        atomic_store_explicit(&pool->kept_slots, index + 1, memory_order_release);
+    }
+    workerthread->park_mutex = (pthread_mutex_t*)malloc(sizeof(pthread_mutex_t));
+    pthread_mutex_init(workerthread->park_mutex, NULL);
+    workerthread->park_notify = (pthread_cond_t*)malloc(sizeof(pthread_cond_t));
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(workerthread->park_notify, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+/*
+ * Join all worker threads and release their slots.
+ * Pool mutex must be held.
+ */
+static void workerthread_join(workerpool_t *pool) {
+    
+    uint size = atomic_load(&pool->worker_slots);
+    for (uint i = 0; i < size; i++) {
+        workerthread_t *worker = workerpool_worker_at(pool, i);
+        if (worker->joinable) {
+            pthread_join(*worker->thread, NULL);
+            DEBUG_INFO("[INFO] worker -%10d - stop.\n", (int)*worker->thread);
+        }
+        free(worker->thread);
+        free(worker->taken);
+        pthread_mutex_destroy(worker->park_mutex);
+        pthread_cond_destroy(worker->park_notify);
+        free(worker->park_mutex);
+        free(worker->park_notify);
+    }
+    
+    // Keep tasks left in worker deques by moving them back to the task queue.
+    // Producers outside the pool may still be putting to it meanwhile. The
+    // empty deques stay for the next start, threads outside the pool may
+    // still be looking into them.
+    for (uint i = 0; i < size; i++) {
+        workdeque_t *deque = workerpool_worker_at(pool, i)->deque;
+        if (deque == NULL) {
+            continue;
+        }
+        workerthread_t *worker = workerpool_worker_at(pool, i);
+        poolqueue_t *queue = workerpool_lane(pool, PRIO_DEFAULT, worker->node, worker->shard);
+        task_t task;
+        pthread_mutex_lock(queue->taskqueue_mutex);
+        while (workdeque_steal(deque, &task) == 0) {
+            taskqueue_put_batch(queue->taskqueue, &task, 1);
+        }
+        pthread_mutex_unlock(queue->taskqueue_mutex);
+    }
+    atomic_store(&pool->worker_slots, 0);
+    atomic_store(&pool->live_workers, 0);
+}
+
+/*
+ * Pick cpu and node of worker from the affinity option.
+ * Without pinning NUMA mode deals workers to nodes in turn.
+ */
+static void workerthread_place(workerthread_t *workerthread, workerpool_t *pool) {
+    
+    workerthread->cpu = -1;
+    workerthread->node = 0;
+    uint index = workerthread->index;
+    switch (pool->options.affinity) {
+        case AFFINITY_LIST: {
+            workerthread->cpu = pool->options.cpus[index % pool->options.cpu_count];
+            int node = pooltopology_node_of(pool->topology, workerthread->cpu);
+            workerthread->node = node < 0 ? 0 : (uint)node;
+            break;
+        }
+        case AFFINITY_COMPACT:
+        case AFFINITY_SCATTER:
+            workerthread->cpu = pooltopology_place(pool->topology, index,
+                                                   pool->options.affinity == AFFINITY_SCATTER,
+                                                   &workerthread->node);
+            break;
+        default:
+            workerthread->node = index % pool->node_count;
+            break;
+    }
+    if (workerthread->node >= pool->node_count) {
+        workerthread->node = 0;
+    }
+    workerthread->shard = index % pool->shard_count;
+}
@@ -28,11 +28,21 @@
 #define WORKERPOOL_H_
 
 #include <pthread.h>    /* POSIX threading */
+#include <stdint.h>
 #include <stdlib.h>     /* memory dynomic alloc */
 #include <sys/types.h>  /* types */
 #include <unistd.h>
 
+#include "poolevent.h"
+#include "poolstats.h"
+#include "pooltopology.h"
+#include "pooltrace.h"
+#include "taskfiber.h"
+#include "taskfuture.h"
 #include "taskqueue.h"
+#include "taskring.h"
+#include "timerwheel.h"
+#include "workdeque.h"
 
 #ifdef DEBUG
     #include <stdio.h>
@@ -41,7 +51,27 @@
     #define DEBUG_INFO(fmt, ...)
 #endif
 
-#define MAX_WORKERPOOL_SIZE     0xff
+#define MAX_WORKERPOOL_SIZE     0x10000
+#define WORKER_CHUNK_SIZE       0x40
+#define DEFAULT_DEQUE_SIZE      0x100
+#define DEFAULT_SPIN_LIMIT      0x1000
+#define DEFAULT_YIELD_LIMIT     0x10
+#define MIN_SPIN_BUDGET         0x10
+#define DEFAULT_AGING           0x20
+#define DEFAULT_TAKE_BATCH      0x8
+#define DEFAULT_TIMER_TICK      1000000
+#define TIMER_BATCH             0x40
+#define DEFAULT_KEEPALIVE       10000000000ULL
+#define DEFAULT_GROW_DEPTH      1
+#define COMPLETION_BATCH        0x20
+#define DROP_SCAN               0x40        /* ring tasks DROP_OLDEST looks at before the spill list */
+#define DEFAULT_FIBER_STACK     0x10000
+#define HELP_WAIT               1000000     /* ns a helping waiter sleeps before it looks for tasks again */
+
+#define PRIO_LANES              4
+#define PRIO_HIGHEST            0
+#define PRIO_DEFAULT            1
+#define PRIO_LOWEST             (PRIO_LANES - 1)
 
 /* enums */
 #pragma mark enums
@@ -53,39 +83,196 @@ typedef enum pool_status_e {
     STOP
 } pool_status_t;    // pool status
 
+typedef enum pool_schedule_e {
+    SCHEDULE_FIFO,      /* all workers share the task queue */
+    SCHEDULE_STEALING   /* per worker deque with work stealing */
+} pool_schedule_t;  // pool schedule mode
+
+typedef enum pool_queue_e {
+    QUEUE_LIST,         /* unbounded linked list task queue */
+    QUEUE_RING          /* bounded lock-free ring of buffer size */
+} pool_queue_t;     // pool queue backend
+
+typedef enum pool_idle_e {
+    IDLE_BLOCK,         /* park as soon as no task is found */
+    IDLE_SPIN           /* spin, then yield, then park */
+} pool_idle_t;      // worker idle policy
+
+typedef enum pool_overflow_e {
+    OVERFLOW_BLOCK,         /* wait for buffer space */
+    OVERFLOW_REJECT,        /* fail with EAGAIN */
+    OVERFLOW_DROP_OLDEST,   /* discard the oldest task of the lane */
+    OVERFLOW_CALLER_RUNS    /* run the task in the calling thread */
+} pool_overflow_t;  // policy when buffer is full
+
+typedef enum pool_affinity_e {
+    AFFINITY_NONE,          /* workers run on any cpu */
+    AFFINITY_LIST,          /* worker i is pinned to cpus[i % cpu_count] */
+    AFFINITY_COMPACT,       /* fill the cpus of a node before the next node */
+    AFFINITY_SCATTER        /* deal workers to nodes in turn */
+} pool_affinity_t;  // worker cpu placement
+
 /* struct and types */
 #pragma mark struct and types
 
 typedef struct workerthread_s {
-    pthread_t *thread;  // pointer of POSIX thread
+    pthread_t *thread;          // pointer of POSIX thread
+    struct workerpool_s *pool;  // owner pool
+    uint index;                 // index in pool
+    uint seed;                  // random seed for victim selection
+    workdeque_t *deque;         // local deque, only for SCHEDULE_STEALING
+    pthread_mutex_t *park_mutex;
+    pthread_cond_t *park_notify;    // condition the idle worker parks on
+    int notified;                   // WORKER_NOTIFY_* bits, guarded by park_mutex
+    uint spin_budget;               // adaptive spin iterations for IDLE_SPIN
+    uint takes;                     // takes since last aging scan
+    struct workerthread_s *idle_next;   // next in idle stack
+    atomic_int running;             // set from spawn until the thread leaves its loop
+    int joinable;                   // thread not joined yet, guarded by pool_mutex
+    poolstats_t *stats;             // statistics slot, kept across restarts
+    int cpu;                        // pinned cpu, -1 for none
+    uint node;                      // NUMA node of worker
+    uint shard;                     // home injection shard
+    task_t *taken;                  // tasks taken from a lane at once, not run yet
+    uint taken_next;                // next of taken to run
+    uint taken_count;               // number of taken
+    struct poolqueue_s *taken_lane; // lane taken was filled from
 } workerthread_t; // worker thread
 
 typedef struct poolsafe_s {
-    pthread_cond_t *worker_notify, *queue_notify;
-    pthread_mutex_t *worker_notify_mutex, *queue_notify_mutex, *taskqueue_mutex, *pool_mutex;
+    pthread_cond_t *queue_notify;
+    pthread_cond_t *drain_notify;       /* workers going idle while the pool closes */
+    pthread_mutex_t *worker_notify_mutex, *queue_notify_mutex, *pool_mutex;
     pool_status_t pool_status;
 } poolsafe_t; // worker safe
 
+typedef struct workerpool_options_s {
+    uint poolsize;                      /* pool size, minimum of elastic pool */
+    uint buffersize;                    /* buffer size */
+    uint max_workers;                   /* maximum of elastic pool, 0 for fixed size */
+    uint64_t keepalive;                 /* idle nanoseconds before an extra worker retires */
+    uint grow_depth;                    /* waiting tasks that spawn a worker when none is idle */
+    uint64_t grow_wait;                 /* nanoseconds tasks wait before a worker is spawned, 0 for none */
+    pool_schedule_t schedule;           /* schedule mode */
+    uint dequesize;                     /* capacity of worker deque */
+    pool_queue_t queue;                 /* queue backend */
+    pool_idle_t idle;                   /* worker idle policy */
+    uint spin_limit;                    /* max spin iterations before yield */
+    uint yield_limit;                   /* yields before park */
+    uint aging;                         /* takes between lowest lane first scans, 0 for none */
+    uint take_batch;                    /* most tasks a worker takes from a lane at once */
+    uint64_t timer_tick;                /* timer resolution in nanoseconds */
+    pool_overflow_t overflow;           /* policy when buffer is full */
+    void (*discard)(task_t*);           /* gets tasks dropped by OVERFLOW_DROP_OLDEST or left by shutdown */
+    pool_affinity_t affinity;           /* worker cpu placement */
+    const int *cpus;                    /* cpus for AFFINITY_LIST, copied */
+    uint cpu_count;                     /* number of cpus */
+    int numa;                           /* partition default lane and stealing per node */
+    const pooltopology_t *topology;     /* topology to place on, copied, NULL to detect */
+    uint shards;                        /* injection shards of default lane, 0 or 1 for one */
+    int events;                         /* create completion and submission descriptors */
+    int fibers;                         /* run tasks on fibers which can suspend */
+    size_t fiber_stack;                 /* stack size of fibers in bytes */
+} workerpool_options_t; // worker pool options
+
+typedef struct poolqueue_s {
+    taskqueue_t *taskqueue;             /* task queue, or spill of ring */
+    taskring_t *taskring;               /* ring for QUEUE_RING */
+    pthread_mutex_t *taskqueue_mutex;   /* guards task queue */
+} poolqueue_t; // shared queue of pool
+
 typedef struct workerpool_s {
-    taskqueue_t *taskqueue;
+    poolqueue_t lanes[PRIO_LANES];      /* priority lanes */
+    tasknodepool_t *nodepool;
+    taskfuturepool_t *futurepool;
+    taskfiberpool_t *fiberpool;         /* NULL unless fibers */
     poolsafe_t poolsafe;
-    uint poolsize;                      /* pool size */
+    atomic_uint poolsize;               /* pool size, minimum of elastic pool */
+    atomic_uint maxsize;                /* maximum pool size */
+    atomic_ullong backlog_since;        /* time tasks wait with no worker idle, 0 for none */
     uint buffersize;                    /* buffer size */
-    workerthread_t *worker_threads;     /* workers */
+    workerthread_t **worker_chunks;     /* worker slots, in chunks of WORKER_CHUNK_SIZE */
+    atomic_uint worker_slots;           /* slots used since start */
+    atomic_uint live_workers;           /* running workers */
+    atomic_uint retire_requests;        /* workers to retire after a shrink */
+    atomic_uint kept_slots;             /* worker slots with deque and statistics, kept across restarts */
+    poolstats_t *stats;                 /* statistics of threads outside the pool, NULL unless WORKERPOOL_STATS */
+    pooltrace_t *trace;                 /* event trace, NULL unless WORKERPOOL_TRACE */
+    pooltopology_t *topology;           /* cpu topology, NULL without affinity and NUMA */
+    poolqueue_t *shards;                /* default lane shards, node_count * shard_count, or NULL */
+    uint node_count;                    /* nodes of NUMA mode, 1 otherwise */
+    uint shard_count;                   /* shards per node, 1 without sharding */
+    workerpool_options_t options;       /* options */
+    pthread_key_t worker_key;           /* current worker of thread */
+    pthread_key_t fiber_key;            /* fiber running in thread, only with fibers */
+    atomic_int producers_waiting;       /* producers waiting for ring space */
+    atomic_int closing;                 /* puts from outside the pool fail, set by shutdown */
+    poolqueue_t *completions;           /* completions for the event loop, NULL unless events */
+    poolevent_t *completion_event;      /* readable while completions are queued */
+    poolevent_t *submission_event;      /* readable when buffer space frees up */
+    atomic_int space_wanted;            /* event loop waits for buffer space */
+    workerthread_t *idle_stack;         /* parked workers */
+    atomic_uint idle_workers;           /* number of parked workers */
+    atomic_uint spinning_workers;       /* number of spinning workers */
+    timerwheel_t *timers;               /* delayed and periodic tasks */
+    workerthread_t *timekeeper;         /* worker parked until next timer, guarded by worker_notify_mutex */
+    uint64_t timekeeper_deadline;       /* time the timekeeper sleeps until */
 } workerpool_t; // worker pool
 
+typedef struct workerpool_stats_s {
+    uint64_t tasks;                     /* tasks executed */
+    uint64_t steals;                    /* tasks stolen */
+    uint64_t parks;                     /* times workers parked */
+    uint64_t wakeups;                   /* times workers were woken up for a task */
+    uint64_t idle_ns;                   /* time workers spent parked */
+    uint64_t queued;                    /* tasks waiting now */
+    uint64_t timers;                    /* pending timers now */
+    uint live_workers;                  /* running workers now */
+    uint idle_workers;                  /* parked workers now */
+    uint64_t wait_hist[POOLSTATS_BUCKETS];  /* queue wait time in ns, see poolstats_percentile */
+    uint64_t run_hist[POOLSTATS_BUCKETS];   /* execution time in ns */
+} workerpool_stats_t; // statistics snapshot
+
 /* workerpool functions */
 #pragma mark functions
 
 workerpool_t* workerpool_new();
 void workerpool_init(workerpool_t * __restrict, uint, uint);
+void workerpool_init_options(workerpool_t * __restrict, const workerpool_options_t * __restrict);
+void workerpool_options_init(workerpool_options_t * __restrict);
 void workerpool_destroy(workerpool_t * __restrict);
 int  workerpool_start(workerpool_t * __restrict);
 int  workerpool_pause(workerpool_t * __restrict);
 int  workerpool_stop(workerpool_t * __restrict);
-int  workerpool_task_put(workerpool_t * __restrict, void (*)(void*), void*);
+int  workerpool_shutdown(workerpool_t * __restrict, uint64_t, void (*)(task_t*));
+int  workerpool_task_put(workerpool_t *, void (*)(void*), void*);
+int  workerpool_task_try_put(workerpool_t *, void (*)(void*), void*);
+int  workerpool_task_put_timed(workerpool_t *, uint64_t, void (*)(void*), void*);
+int  workerpool_task_put_inline(workerpool_t *, void (*)(void*), const void * __restrict, size_t);
+int  workerpool_task_put_prio(workerpool_t *, uint, void (*)(void*), void*);
+int  workerpool_task_put_shard(workerpool_t *, uint, void (*)(void*), void*);
+int  workerpool_task_put_spill(workerpool_t *, uint, void (*)(void*), void*);
+timerid_t workerpool_task_put_after(workerpool_t *, uint64_t, void (*)(void*), void*);
+timerid_t workerpool_task_put_every(workerpool_t *, uint64_t, void (*)(void*), void*);
+int  workerpool_timer_cancel(workerpool_t * __restrict, timerid_t);
+int  workerpool_task_put_batch(workerpool_t * __restrict, const task_t *, size_t);
+taskfuture_t* workerpool_task_submit(workerpool_t *, void *(*)(void*), void*);
+int  workerpool_wait_all(taskfuture_t **, size_t);
+int  workerpool_yield(workerpool_t * __restrict);
+void* workerpool_await(workerpool_t * __restrict, taskfuture_t * __restrict);
+int  workerpool_task_run_one(workerpool_t * __restrict);
+void workerpool_help_wait(workerpool_t *, int (*)(void*), void*, pthread_mutex_t *, pthread_cond_t *);
 uint workerpool_poolsize(workerpool_t * __restrict);
 int workerpool_poolsize_update(workerpool_t * __restrict, uint);
+int  workerpool_stats(workerpool_t * __restrict, workerpool_stats_t * __restrict);
+int  workerpool_trace_dump(workerpool_t * __restrict, FILE * __restrict);
+uint workerpool_current_node(workerpool_t * __restrict);
+int  workerpool_completion_fd(workerpool_t * __restrict);
+int  workerpool_completion_put(workerpool_t *, void (*)(void*), void*);
+int  workerpool_completion_put_batch(workerpool_t * __restrict, const task_t *, size_t);
+int  workerpool_completion_run(workerpool_t * __restrict, size_t);
+int  workerpool_submission_fd(workerpool_t * __restrict);
+int  workerpool_submission_put(workerpool_t * __restrict, const task_t *, size_t);
 pool_status_t workerpool_status(workerpool_t * __restrict);
 
 #endif /* WORKERPOOL_H_ */
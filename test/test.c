@@ -24,15 +24,185 @@
  * SOFTWARE.
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <poll.h>
+#include <sys/resource.h>
 #include "workerpool.h"
+#include "taskgraph.h"
+#include "taskgroup.h"
+#include "taskloop.h"
+#include "taskstrand.h"
 
 #define WORKER  4
 #define BUFFER_SIZE 4
+#define STEAL_TASKS 64
+#define STEAL_CHILDREN 16
+#define RING_TASKS 1000
+#define BATCH_SIZE 50
+#define BATCH_COUNT 20
+#define FUTURE_TASKS 100
+#define PRIO_TASKS 16
+#define TIMER_TASKS 10000
+#define MSEC 1000000
+#define ELASTIC_MAX 8
+#define LARGE_POOL 300
+#define STATS_TASKS 100
+#define TRACE_TASKS 200
+#define AFFINITY_TASKS 200
+#define ABSENT_CPU 1023
+#define INLINE_TASKS 1000
+#define SHARDS 4
+#define SHARD_PRODUCERS 4
+#define SHARD_TASKS 500
+#define STRANDS 8
+#define STRAND_TASKS 1000
+#define SHUTDOWN_TASKS 100
+#define GRAPH_LAYERS 8
+#define GRAPH_WIDTH 8
+#define GRAPH_RUNS 100
+#define LOOP_SIZE (1 << 20)
+#define LOOP_GRAIN 1000
+#define TAKE_TASKS 2000
+#define EVENT_TASKS 64
+#define FIBER_TASKS 1000
 
 static void task_func(void *);
+static void test_stealing();
+static void steal_parent_func(void *);
+static void steal_child_func(void *);
+static void test_ring();
+static void test_batch();
+static void test_spin();
+static void test_nodepool();
+static void test_future();
+static void* future_square_func(void *);
+static void* future_slow_func(void *);
+static void test_group();
+static void group_parent_func(void *);
+static void group_wait_func(void *);
+static void test_prio();
+static void prio_gate_func(void *);
+static void prio_record_func(void *);
+static void test_timer();
+static void timer_count_func(void *);
+static void test_overflow();
+static void overflow_caller_func(void *);
+static void overflow_member_func(void *);
+static void overflow_discard_func(task_t *);
+static void test_elastic();
+static void elastic_block_func(void *);
+static void wait_poolsize(workerpool_t *, uint);
+static void test_stats();
+static void stats_sleep_func(void *);
+static void test_trace();
+#ifdef WORKERPOOL_TRACE
+static void* trace_producer_func(void *);
+static int count_substr(const char *, const char *);
+#endif
+static void test_affinity();
+static void affinity_check_func(void *);
+static void test_inline();
+static void inline_sum_func(void *);
+static void test_shard();
+static void *shard_producer_func(void *);
+static void shard_count_func(void *);
+static void test_strand();
+static void strand_check_func(void *);
+static void test_shutdown();
+static void *shutdown_producer_func(void *);
+static void *shutdown_batch_func(void *);
+static void *shutdown_future_func(void *);
+static void *shutdown_wait_func(void *);
+static void *shutdown_release_func(void *);
+static void shutdown_count_func(void *);
+static void shutdown_cancel_func(task_t *);
+static void test_graph();
+static void graph_node_func(void *);
+static void test_loop();
+static void loop_mark_func(size_t, size_t, void *);
+static void loop_sum_func(size_t, size_t, void *, void *);
+static void loop_join_func(void *, const void *, void *);
+static void test_take_batch();
+static void take_count_func(void *);
+static void take_gate_func(void *);
+static void take_record_func(void *);
+static int take_odd_skip(const task_t *);
+static void test_events();
+static void event_task_func(void *);
+static void event_complete_func(void *);
+static void test_fibers();
+static void fiber_wait_func(void *);
+static void fiber_parent_func(void *);
+
+typedef struct inline_arg_s {
+    atomic_long *sum;
+    long value;
+    char tag[TASK_INLINE_SIZE - sizeof(atomic_long*) - sizeof(long)];
+} inline_arg_t;
+
+typedef struct strand_check_s {
+    atomic_int running;         /* tasks of strand running now */
+    int next;                   /* sequence expected next */
+    int wrong;                  /* tasks run out of order or concurrently */
+} strand_check_t;
+
+typedef struct strand_arg_s {
+    strand_check_t *check;
+    int seq;
+} strand_arg_t;
+
+typedef struct shutdown_producer_s {
+    workerpool_t *pool;
+    int accepted;               /* tasks put before the pool closed */
+    int error;                  /* errno of the failed put */
+} shutdown_producer_t;
+
+typedef struct loop_check_s {
+    atomic_uchar *marks;        /* times each index was visited */
+    size_t grain;               /* largest range body may get */
+    atomic_int wrong;
+} loop_check_t;
+
+typedef struct affinity_check_s {
+    workerpool_t *pool;
+    int cpu;                    /* cpu tasks must run on, -1 for any */
+    uint node;                  /* node tasks must run on */
+    atomic_int done;
+    atomic_int wrong;
+} affinity_check_t;
+
+static atomic_int steal_counter;
+static atomic_int prio_gate;
+static int prio_order[PRIO_TASKS * 2];
+static atomic_int overflow_discarded;
+static atomic_int shard_counter;
+static atomic_int shutdown_ran;
+static atomic_int shutdown_cancelled;
+static atomic_int graph_layer_done[GRAPH_LAYERS];
+static atomic_int graph_wrong;
+static atomic_int take_counter;
+static atomic_int take_gate;
+static atomic_int take_order_next;
+static int take_order[PRIO_TASKS + 2];
+static atomic_int event_gate;
+static workerpool_t *event_pool;
+static pthread_t event_loop;
+static int event_completed;
+static workerpool_t *fiber_pool;
+static taskfuture_t *fiber_gate;
+static atomic_int fiber_started;
+static atomic_int fiber_finished;
+static atomic_long fiber_sum;
 
 int main() {
     
@@ -63,6 +233,30 @@ int main() {
     
     assert(workerpool_status(pool) == STOP);
     
+    test_stealing();
+    test_ring();
+    test_batch();
+    test_spin();
+    test_nodepool();
+    test_future();
+    test_group();
+    test_prio();
+    test_timer();
+    test_overflow();
+    test_elastic();
+    test_stats();
+    test_trace();
+    test_affinity();
+    test_inline();
+    test_shard();
+    test_strand();
+    test_shutdown();
+    test_graph();
+    test_loop();
+    test_take_batch();
+    test_events();
+    test_fibers();
+    
     printf("Test finish.\n");
     
     return 0;
@@ -71,3 +265,1617 @@ int main() {
 static void task_func(void *arg) {
     printf("thread %10d: task %4d.\n", (int)pthread_self(), (int)*(int*)arg);
 }
+
+static void test_stealing() {
+    
+    printf("Test work stealing.\n");
+    
+    workerpool_options_t options;
+    workerpool_options_init(&options);
+    options.poolsize = WORKER;
+    options.buffersize = BUFFER_SIZE;
+    options.schedule = SCHEDULE_STEALING;
+    options.dequesize = 8;
+    
+    workerpool_t *pool = workerpool_new();
+    workerpool_init_options(pool, &options);
+    assert(workerpool_status(pool) == STOP);
+    
+    atomic_store(&steal_counter, 0);
+    workerpool_start(pool);
+    for (int i = 0; i < STEAL_TASKS; i++) {
+        workerpool_task_put(pool, steal_parent_func, pool);
+    }
+    workerpool_stop(pool);
+    
+    assert(atomic_load(&steal_counter) == STEAL_TASKS * (STEAL_CHILDREN + 1));
+    workerpool_destroy(pool);
+}
+
+static void steal_parent_func(void *arg) {
+    workerpool_t *pool = (workerpool_t*)arg;
+    for (int i = 0; i < STEAL_CHILDREN; i++) {
+        workerpool_task_put(pool, steal_child_func, NULL);
+    }
+    atomic_fetch_add(&steal_counter, 1);
+}
+
+static void steal_child_func(void *arg) {
+    (void)arg;
+    atomic_fetch_add(&steal_counter, 1);
+}
+
+static void test_ring() {
+    
+    printf("Test ring queue.\n");
+    
+    // A capacity which is not a power of two holds no more than asked for.
+    taskring_t *ring = taskring_new();
+    assert(taskring_init(ring, BUFFER_SIZE + 1) == 0);
+    assert(taskring_capacity(ring) == BUFFER_SIZE + 1);
+    task_t task = { .func = steal_child_func, .args = NULL };
+    for (int i = 0; i < BUFFER_SIZE + 1; i++) {
+        assert(taskring_put(ring, &task) == 0);
+    }
+    assert(taskring_put(ring, &task) == -1);
+    assert(taskring_take(ring, &task) == 0);
+    task_t batch[BUFFER_SIZE * 2];
+    for (int i = 0; i < BUFFER_SIZE * 2; i++) {
+        batch[i] = task;
+    }
+    assert(taskring_put_batch(ring, batch, BUFFER_SIZE * 2) == 1);
+    assert(taskring_put_batch(ring, batch, BUFFER_SIZE * 2) == 0);
+    assert(taskring_size(ring) == BUFFER_SIZE + 1);
+    taskring_destroy(ring);
+    
+    workerpool_options_t options;
+    workerpool_options_init(&options);
+    options.poolsize = WORKER;
+    options.buffersize = BUFFER_SIZE;
+    options.queue = QUEUE_RING;
+    
+    workerpool_t *pool = workerpool_new();
+    workerpool_init_options(pool, &options);
+    assert(taskring_capacity(pool->lanes[PRIO_DEFAULT].taskring) == BUFFER_SIZE);
+    
+    atomic_store(&steal_counter, 0);
+    workerpool_start(pool);
+    for (int i = 0; i < RING_TASKS; i++) {
+        workerpool_task_put(pool, steal_child_func, NULL);
+    }
+    workerpool_stop(pool);
+    
+    assert(atomic_load(&steal_counter) == RING_TASKS);
+    
+    // Ring with work stealing, workers spill to the task queue when ring is full.
+    options.schedule = SCHEDULE_STEALING;
+    options.dequesize = 2;
+    workerpool_t *stealing = workerpool_new();
+    workerpool_init_options(stealing, &options);
+    
+    atomic_store(&steal_counter, 0);
+    workerpool_start(stealing);
+    for (int i = 0; i < STEAL_TASKS; i++) {
+        workerpool_task_put(stealing, steal_parent_func, stealing);
+    }
+    workerpool_stop(stealing);
+    
+    assert(atomic_load(&steal_counter) == STEAL_TASKS * (STEAL_CHILDREN + 1));
+    workerpool_destroy(stealing);
+    workerpool_destroy(pool);
+}
+
+static void test_batch() {
+    
+    printf("Test batch put.\n");
+    
+    task_t tasks[BATCH_SIZE];
+    for (int i = 0; i < BATCH_SIZE; i++) {
+        tasks[i].func = steal_child_func;
+        tasks[i].args = NULL;
+    }
+    
+    pool_queue_t queues[] = { QUEUE_LIST, QUEUE_RING };
+    for (int q = 0; q < 2; q++) {
+        workerpool_options_t options;
+        workerpool_options_init(&options);
+        options.poolsize = WORKER;
+        options.buffersize = BUFFER_SIZE;
+        options.queue = queues[q];
+        
+        workerpool_t *pool = workerpool_new();
+        workerpool_init_options(pool, &options);
+        
+        atomic_store(&steal_counter, 0);
+        workerpool_start(pool);
+        for (int i = 0; i < BATCH_COUNT; i++) {
+            assert(workerpool_task_put_batch(pool, tasks, BATCH_SIZE) == BATCH_SIZE);
+        }
+        assert(workerpool_task_put_batch(pool, tasks, 0) == 0);
+        workerpool_stop(pool);
+        
+        assert(atomic_load(&steal_counter) == BATCH_SIZE * BATCH_COUNT);
+        workerpool_destroy(pool);
+    }
+}
+
+static void test_spin() {
+    
+    printf("Test spin idle policy.\n");
+    
+    workerpool_options_t options;
+    workerpool_options_init(&options);
+    options.poolsize = WORKER;
+    options.buffersize = BUFFER_SIZE;
+    options.idle = IDLE_SPIN;
+    options.spin_limit = 256;
+    
+    workerpool_t *pool = workerpool_new();
+    workerpool_init_options(pool, &options);
+    
+    atomic_store(&steal_counter, 0);
+    workerpool_start(pool);
+    for (int i = 0; i < RING_TASKS; i++) {
+        workerpool_task_put(pool, steal_child_func, NULL);
+        if (i % 100 == 0) {
+            usleep(100);
+        }
+    }
+    workerpool_stop(pool);
+    
+    assert(atomic_load(&steal_counter) == RING_TASKS);
+    workerpool_destroy(pool);
+}
+
+static void test_nodepool() {
+    
+    printf("Test task node pool.\n");
+    
+    tasknodepool_t *nodepool = tasknodepool_new();
+    assert(tasknodepool_init(nodepool) == 0);
+    
+    taskqueue_t *queue = taskqueue_new();
+    taskqueue_init_nodepool(queue, nodepool);
+    
+    // More than a slab to make the pool grow.
+    for (long i = 0; i < TASKNODE_SLAB_SIZE * 3; i++) {
+        assert(taskqueue_put(queue, steal_child_func, (void*)i) == i + 1);
+    }
+    for (long i = 0; i < TASKNODE_SLAB_SIZE * 3; i++) {
+        task_t task;
+        assert(taskqueue_take(queue, &task) == 0);
+        assert(task.func == steal_child_func && task.args == (void*)i);
+    }
+    task_t task;
+    assert(taskqueue_take(queue, &task) == -1);
+    
+    // Freed nodes are reused.
+    taskqueue_put(queue, steal_child_func, NULL);
+    taskqueue_clear(queue);
+    assert(taskqueue_size(queue) == 0 && queue->first == NULL);
+    assert(nodepool->slabs != NULL && nodepool->slabs->next != NULL &&
+           nodepool->slabs->next->next != NULL && nodepool->slabs->next->next->next == NULL);
+    
+    taskqueue_destroy(queue);
+    tasknodepool_destroy(nodepool);
+}
+
+static void test_future() {
+    
+    printf("Test future.\n");
+    
+    workerpool_t *pool = workerpool_new();
+    workerpool_init(pool, WORKER, BUFFER_SIZE);
+    workerpool_start(pool);
+    
+    taskfuture_t *futures[FUTURE_TASKS];
+    for (long i = 0; i < FUTURE_TASKS; i++) {
+        futures[i] = workerpool_task_submit(pool, future_square_func, (void*)i);
+        assert(futures[i] != NULL);
+    }
+    assert(workerpool_wait_all(futures, FUTURE_TASKS) == 0);
+    for (long i = 0; i < FUTURE_TASKS; i++) {
+        assert(taskfuture_is_done(futures[i]));
+        assert((long)taskfuture_wait(futures[i]) == i * i);
+        taskfuture_release(futures[i]);
+    }
+    
+    // Wait with timeout.
+    taskfuture_t *future = workerpool_task_submit(pool, future_slow_func, NULL);
+    void *result = NULL;
+    assert(taskfuture_wait_timeout(future, 1000, &result) == -1);
+    assert(taskfuture_wait_timeout(future, 5000000000ULL, &result) == 0);
+    assert(result == (void*)1);
+    taskfuture_release(future);
+    
+    workerpool_stop(pool);
+    workerpool_destroy(pool);
+}
+
+static void* future_square_func(void *arg) {
+    long value = (long)arg;
+    return (void*)(value * value);
+}
+
+static void* future_slow_func(void *arg) {
+    (void)arg;
+    usleep(20000);
+    return (void*)1;
+}
+
+static void test_group() {
+    
+    printf("Test task group.\n");
+    
+    // Single worker, parents wait on their children from inside the pool.
+    workerpool_t *pool = workerpool_new();
+    workerpool_init(pool, 1, BUFFER_SIZE);
+    workerpool_start(pool);
+    
+    taskgroup_t *group = taskgroup_new();
+    taskgroup_init(group);
+    atomic_store(&steal_counter, 0);
+    for (int i = 0; i < STEAL_TASKS; i++) {
+        assert(workerpool_group_put(pool, group, group_parent_func, pool) == 0);
+    }
+    taskgroup_wait(group);
+    assert(taskgroup_pending(group) == 0);
+    assert(atomic_load(&steal_counter) == STEAL_TASKS * (STEAL_CHILDREN + 1));
+    taskgroup_destroy(group);
+    
+    // The only worker waits on a group with nothing to help with, then a
+    // member is put from outside. The waiter looks again and runs it.
+    group = taskgroup_new();
+    taskgroup_init(group);
+    group->pool = pool;
+    atomic_store(&group->pending, 1);
+    atomic_store(&steal_counter, 0);
+    assert(workerpool_task_put(pool, group_wait_func, group) == 0);
+    usleep(10 * 1000);
+    assert(workerpool_group_put(pool, group, steal_child_func, NULL) == 0);
+    atomic_fetch_sub(&group->pending, 1);
+    workerpool_stop(pool);
+    assert(atomic_load(&steal_counter) == 2);
+    assert(taskgroup_pending(group) == 0);
+    taskgroup_destroy(group);
+    
+    workerpool_destroy(pool);
+}
+
+static void group_wait_func(void *arg) {
+    taskgroup_wait((taskgroup_t*)arg);
+    atomic_fetch_add(&steal_counter, 1);
+}
+
+static void group_parent_func(void *arg) {
+    workerpool_t *pool = (workerpool_t*)arg;
+    taskgroup_t children;
+    taskgroup_init(&children);
+    for (int i = 0; i < STEAL_CHILDREN; i++) {
+        workerpool_group_put(pool, &children, steal_child_func, NULL);
+    }
+    taskgroup_wait(&children);
+    assert(taskgroup_pending(&children) == 0);
+    atomic_fetch_add(&steal_counter, 1);
+}
+
+static void test_prio() {
+    
+    printf("Test priority lanes.\n");
+    
+    for (int aging = 0; aging <= 2; aging += 2) {
+        // Single worker blocked by a gate task while both lanes fill up.
+        workerpool_options_t options;
+        workerpool_options_init(&options);
+        options.poolsize = 1;
+        options.buffersize = PRIO_TASKS * 2;
+        options.aging = aging;
+        workerpool_t *pool = workerpool_new();
+        workerpool_init_options(pool, &options);
+        workerpool_start(pool);
+        
+        atomic_store(&prio_gate, 0);
+        atomic_store(&steal_counter, 0);
+        assert(workerpool_task_put(pool, prio_gate_func, NULL) == 0);
+        while (atomic_load(&prio_gate) == 0) {
+            sched_yield();
+        }
+        for (int i = 0; i < PRIO_TASKS; i++) {
+            assert(workerpool_task_put_prio(pool, PRIO_LOWEST, prio_record_func, (void*)(long)PRIO_LOWEST) == 0);
+        }
+        for (int i = 0; i < PRIO_TASKS; i++) {
+            assert(workerpool_task_put_prio(pool, PRIO_HIGHEST, prio_record_func, (void*)(long)PRIO_HIGHEST) == 0);
+        }
+        assert(workerpool_task_put_prio(pool, PRIO_LANES, prio_record_func, NULL) == -1);
+        atomic_store(&prio_gate, 2);
+        
+        workerpool_stop(pool);
+        assert(atomic_load(&steal_counter) == PRIO_TASKS * 2);
+        
+        if (aging == 0) {
+            // Strict priority, all high tasks run first.
+            for (int i = 0; i < PRIO_TASKS * 2; i++) {
+                assert(prio_order[i] == (i < PRIO_TASKS ? PRIO_HIGHEST : PRIO_LOWEST));
+            }
+        } else {
+            // Aging lets low tasks run before the high lane is drained.
+            assert(prio_order[PRIO_TASKS * 2 - 1] == PRIO_HIGHEST);
+        }
+        workerpool_destroy(pool);
+    }
+}
+
+static void prio_gate_func(void *arg) {
+    (void)arg;
+    atomic_store(&prio_gate, 1);
+    while (atomic_load(&prio_gate) == 1) {
+        sched_yield();
+    }
+}
+
+static void prio_record_func(void *arg) {
+    prio_order[atomic_fetch_add(&steal_counter, 1)] = (int)(long)arg;
+}
+
+static void test_timer() {
+    
+    printf("Test delayed and periodic tasks.\n");
+    
+    workerpool_t *pool = workerpool_new();
+    workerpool_init(pool, WORKER, BUFFER_SIZE);
+    workerpool_start(pool);
+    
+    // Delayed tasks run once, cancelled ones never.
+    atomic_int once, cancelled, periodic;
+    atomic_init(&once, 0);
+    atomic_init(&cancelled, 0);
+    atomic_init(&periodic, 0);
+    assert(workerpool_task_put_after(pool, 10 * MSEC, timer_count_func, &once) != 0);
+    timerid_t id = workerpool_task_put_after(pool, 20 * MSEC, timer_count_func, &cancelled);
+    assert(id != 0);
+    assert(workerpool_timer_cancel(pool, id) == 0);
+    assert(workerpool_timer_cancel(pool, id) == -1);
+    assert(atomic_load(&once) == 0);
+    
+    // Periodic task keeps running until cancelled.
+    id = workerpool_task_put_every(pool, 2 * MSEC, timer_count_func, &periodic);
+    assert(id != 0);
+    while (atomic_load(&periodic) < 5) {
+        usleep(1000);
+    }
+    assert(workerpool_timer_cancel(pool, id) == 0);
+    
+    // Many timers spread over a few wheel levels.
+    atomic_int many;
+    atomic_init(&many, 0);
+    for (int i = 0; i < TIMER_TASKS; i++) {
+        assert(workerpool_task_put_after(pool, (uint64_t)(i % 100) * MSEC, timer_count_func, &many) != 0);
+    }
+    while (atomic_load(&many) < TIMER_TASKS) {
+        usleep(1000);
+    }
+    
+    usleep(30 * 1000);
+    assert(atomic_load(&once) == 1);
+    assert(atomic_load(&cancelled) == 0);
+    int runs = atomic_load(&periodic);
+    usleep(10 * 1000);
+    assert(atomic_load(&periodic) <= runs + 1);
+    assert(atomic_load(&many) == TIMER_TASKS);
+    
+    workerpool_stop(pool);
+    workerpool_destroy(pool);
+    
+    // Pending timers go to the discard callback on destroy.
+    workerpool_options_t options;
+    workerpool_options_init(&options);
+    options.discard = overflow_discard_func;
+    pool = workerpool_new();
+    workerpool_init_options(pool, &options);
+    atomic_store(&overflow_discarded, 0);
+    assert(workerpool_task_put_after(pool, 1000 * MSEC, timer_count_func, &once) != 0);
+    assert(workerpool_task_put_every(pool, 1000 * MSEC, timer_count_func, &periodic) != 0);
+    workerpool_destroy(pool);
+    assert(atomic_load(&overflow_discarded) == 2);
+}
+
+static void timer_count_func(void *arg) {
+    atomic_fetch_add((atomic_int*)arg, 1);
+}
+
+static void test_overflow() {
+    
+    printf("Test overflow policies.\n");
+    
+    pool_overflow_t policies[] = { OVERFLOW_BLOCK, OVERFLOW_REJECT, OVERFLOW_DROP_OLDEST, OVERFLOW_CALLER_RUNS };
+    for (int q = QUEUE_LIST; q <= QUEUE_RING; q++) {
+        for (int p = 0; p < 4; p++) {
+            // Single worker blocked by a gate task, so the buffer fills up.
+            workerpool_options_t options;
+            workerpool_options_init(&options);
+            options.poolsize = 1;
+            options.buffersize = BUFFER_SIZE;
+            options.queue = (pool_queue_t)q;
+            options.overflow = policies[p];
+            options.discard = overflow_discard_func;
+            workerpool_t *pool = workerpool_new();
+            workerpool_init_options(pool, &options);
+            workerpool_start(pool);
+            
+            atomic_store(&prio_gate, 0);
+            atomic_store(&overflow_discarded, 0);
+            assert(workerpool_task_put(pool, prio_gate_func, NULL) == 0);
+            while (atomic_load(&prio_gate) == 0) {
+                sched_yield();
+            }
+            
+            atomic_int counter;
+            atomic_init(&counter, 0);
+            for (int i = 0; i < BUFFER_SIZE; i++) {
+                assert(workerpool_task_try_put(pool, timer_count_func, &counter) == 0);
+            }
+            errno = 0;
+            assert(workerpool_task_try_put(pool, timer_count_func, &counter) == -1 && errno == EAGAIN);
+            errno = 0;
+            assert(workerpool_task_put_timed(pool, MSEC, timer_count_func, &counter) == -1 && errno == ETIMEDOUT);
+            
+            int expected = BUFFER_SIZE;
+            taskgroup_t *group = NULL;
+            taskstrand_t *strand = NULL;
+            atomic_int members;
+            atomic_init(&members, 0);
+            pthread_t caller = pthread_self();
+            switch (policies[p]) {
+                case OVERFLOW_REJECT:
+                    errno = 0;
+                    assert(workerpool_task_put(pool, timer_count_func, &counter) == -1 && errno == EAGAIN);
+                    
+                    // A strand is scheduled over the buffer, its tasks
+                    // never run in the caller.
+                    strand = workerpool_strand_new(pool);
+                    for (int i = 0; i < BUFFER_SIZE; i++) {
+                        assert(taskstrand_put(strand, overflow_caller_func, &caller) == 0);
+                    }
+                    assert(atomic_load(&overflow_discarded) == 0);
+                    break;
+                case OVERFLOW_DROP_OLDEST:
+                    assert(workerpool_task_put(pool, timer_count_func, &counter) == 0);
+                    assert(atomic_load(&overflow_discarded) == 1);
+                    
+                    // Group members and strands displace plain tasks, but
+                    // are never dropped themselves. Once only they wait,
+                    // new tasks go over the buffer.
+                    group = taskgroup_new();
+                    taskgroup_init(group);
+                    strand = workerpool_strand_new(pool);
+                    for (int i = 0; i < BUFFER_SIZE * 2; i++) {
+                        assert(workerpool_group_put(pool, group, overflow_member_func, &members) == 0);
+                    }
+                    for (int i = 0; i < BUFFER_SIZE; i++) {
+                        assert(taskstrand_put(strand, overflow_member_func, &members) == 0);
+                    }
+                    assert(workerpool_task_put(pool, timer_count_func, &counter) == 0);
+                    assert(atomic_load(&overflow_discarded) == 1 + BUFFER_SIZE);
+                    expected = 1;
+                    break;
+                case OVERFLOW_CALLER_RUNS:
+                    assert(workerpool_task_put(pool, overflow_caller_func, &caller) == 0);
+                    assert(atomic_load(&overflow_discarded) == -1);
+                    break;
+                default:
+                    break;
+            }
+            
+            atomic_store(&prio_gate, 2);
+            if (policies[p] == OVERFLOW_BLOCK) {
+                // Blocks until the worker made room.
+                assert(workerpool_task_put(pool, timer_count_func, &counter) == 0);
+                expected++;
+            }
+            if (group != NULL) {
+                taskgroup_wait(group);
+                taskgroup_destroy(group);
+            }
+            workerpool_stop(pool);
+            assert(atomic_load(&counter) == expected);
+            if (strand != NULL) {
+                assert(taskstrand_pending(strand) == 0);
+                assert(atomic_load(&members) == (policies[p] == OVERFLOW_DROP_OLDEST ? BUFFER_SIZE * 3 : 0));
+                assert(policies[p] != OVERFLOW_REJECT || atomic_load(&overflow_discarded) == 0);
+                taskstrand_destroy(strand);
+            }
+            workerpool_destroy(pool);
+        }
+    }
+}
+
+static void overflow_caller_func(void *arg) {
+    if (pthread_equal(*(pthread_t*)arg, pthread_self())) {
+        atomic_store(&overflow_discarded, -1);
+    }
+}
+
+static void overflow_member_func(void *arg) {
+    atomic_fetch_add((atomic_int*)arg, 1);
+}
+
+static void overflow_discard_func(task_t *task) {
+    assert(task->func == timer_count_func);
+    atomic_fetch_add(&overflow_discarded, 1);
+}
+
+static void test_elastic() {
+    
+    printf("Test elastic pool.\n");
+    
+    workerpool_options_t options;
+    workerpool_options_init(&options);
+    options.poolsize = 1;
+    options.max_workers = ELASTIC_MAX;
+    options.buffersize = ELASTIC_MAX * 2;
+    options.keepalive = 20 * MSEC;
+    workerpool_t *pool = workerpool_new();
+    workerpool_init_options(pool, &options);
+    workerpool_start(pool);
+    assert(workerpool_poolsize(pool) == 1);
+    
+    // Blocking tasks make the pool grow up to its maximum.
+    atomic_store(&prio_gate, 0);
+    atomic_store(&steal_counter, 0);
+    for (int i = 0; i < ELASTIC_MAX; i++) {
+        assert(workerpool_task_put(pool, elastic_block_func, NULL) == 0);
+    }
+    while (atomic_load(&steal_counter) < ELASTIC_MAX) {
+        usleep(1000);
+    }
+    assert(workerpool_poolsize(pool) == ELASTIC_MAX);
+    
+    // Idle workers above the minimum retire after keep-alive time.
+    atomic_store(&prio_gate, 1);
+    wait_poolsize(pool, 1);
+    
+    // Resizing spawns and retires single workers.
+    assert(workerpool_poolsize_update(pool, 4) == 0);
+    assert(workerpool_poolsize(pool) == 4);
+    assert(workerpool_poolsize_update(pool, 2) == 0);
+    wait_poolsize(pool, 2);
+    workerpool_stop(pool);
+    workerpool_destroy(pool);
+    
+    // Tasks waiting long enough make the pool grow below the depth too.
+    options.grow_depth = ELASTIC_MAX * 2;
+    options.grow_wait = MSEC;
+    pool = workerpool_new();
+    workerpool_init_options(pool, &options);
+    workerpool_start(pool);
+    atomic_store(&prio_gate, 0);
+    atomic_store(&steal_counter, 0);
+    assert(workerpool_task_put(pool, elastic_block_func, NULL) == 0);
+    while (atomic_load(&steal_counter) < 1) {
+        usleep(1000);
+    }
+    for (int i = 0; i < 10 && workerpool_poolsize(pool) < 2; i++) {
+        assert(workerpool_task_put(pool, elastic_block_func, NULL) == 0);
+        usleep(2 * MSEC / 1000);
+    }
+    assert(workerpool_poolsize(pool) >= 2);
+    atomic_store(&prio_gate, 1);
+    workerpool_stop(pool);
+    workerpool_destroy(pool);
+    
+    // Fixed pools may have more than 255 workers.
+    pool = workerpool_new();
+    workerpool_init(pool, WORKER, BUFFER_SIZE);
+    workerpool_start(pool);
+    assert(workerpool_poolsize_update(pool, LARGE_POOL) == 0);
+    assert(workerpool_poolsize(pool) == LARGE_POOL);
+    atomic_int counter;
+    atomic_init(&counter, 0);
+    for (int i = 0; i < LARGE_POOL; i++) {
+        assert(workerpool_task_put(pool, timer_count_func, &counter) == 0);
+    }
+    assert(workerpool_poolsize_update(pool, WORKER) == 0);
+    wait_poolsize(pool, WORKER);
+    workerpool_stop(pool);
+    assert(atomic_load(&counter) == LARGE_POOL);
+    workerpool_destroy(pool);
+}
+
+static void elastic_block_func(void *arg) {
+    (void)arg;
+    atomic_fetch_add(&steal_counter, 1);
+    while (atomic_load(&prio_gate) == 0) {
+        usleep(1000);
+    }
+}
+
+static void wait_poolsize(workerpool_t *pool, uint size) {
+    for (int i = 0; i < 1000 && workerpool_poolsize(pool) != size; i++) {
+        usleep(1000);
+    }
+    assert(workerpool_poolsize(pool) == size);
+}
+
+static void test_stats() {
+    
+    printf("Test statistics.\n");
+    
+    // Buckets keep values within a quarter.
+    for (uint64_t v = 1; v < ((uint64_t)1 << 62); v = v * 3 + 1) {
+        uint64_t low = poolstats_bucket_value(poolstats_bucket(v));
+        assert(low <= v && v - low <= v / 4);
+    }
+    
+    workerpool_t *pool = workerpool_new();
+    workerpool_init(pool, 1, STATS_TASKS);
+    workerpool_start(pool);
+    
+    // Let the worker park first.
+    usleep(10 * 1000);
+    
+    // Queue depth is known while the only worker is blocked.
+    workerpool_stats_t stats;
+    atomic_store(&prio_gate, 0);
+    assert(workerpool_task_put(pool, prio_gate_func, NULL) == 0);
+    while (atomic_load(&prio_gate) == 0) {
+        sched_yield();
+    }
+    for (int i = 0; i < STATS_TASKS; i++) {
+        assert(workerpool_task_put(pool, stats_sleep_func, NULL) == 0);
+    }
+    assert(workerpool_stats(pool, &stats) == 0);
+    assert(stats.queued == STATS_TASKS);
+    assert(stats.live_workers == 1);
+    atomic_store(&prio_gate, 2);
+    workerpool_stop(pool);
+    
+    assert(workerpool_stats(pool, &stats) == 0);
+    assert(stats.queued == 0);
+    assert(stats.live_workers == 0);
+#ifdef WORKERPOOL_STATS
+    assert(stats.tasks == STATS_TASKS + 1);
+    assert(stats.parks > 0);
+    assert(poolstats_percentile(stats.run_hist, 0.5) >= 50000);
+    assert(poolstats_percentile(stats.wait_hist, 0.99) >= poolstats_percentile(stats.wait_hist, 0.5));
+#else
+    assert(stats.tasks == 0);
+#endif
+    workerpool_destroy(pool);
+}
+
+static void stats_sleep_func(void *arg) {
+    (void)arg;
+    usleep(100);
+}
+
+static void test_trace() {
+    
+    printf("Test trace.\n");
+    
+    workerpool_t *pool = workerpool_new();
+    workerpool_init(pool, 2, TRACE_TASKS);
+    workerpool_start(pool);
+    for (int i = 0; i < TRACE_TASKS; i++) {
+        assert(workerpool_task_put(pool, stats_sleep_func, NULL) == 0);
+    }
+    workerpool_stop(pool);
+    
+    FILE *out = tmpfile();
+    assert(out != NULL);
+#ifdef WORKERPOOL_TRACE
+    assert(workerpool_trace_dump(pool, out) == 0);
+    
+    long length = ftell(out);
+    char *json = (char*)malloc(length + 1);
+    rewind(out);
+    assert(fread(json, 1, length, out) == (size_t)length);
+    json[length] = '\0';
+    assert(strncmp(json, "{\"traceEvents\":[", 15) == 0);
+    assert(count_substr(json, "\"name\":\"worker ") == 2);
+    assert(count_substr(json, "\"name\":\"submit\"") == TRACE_TASKS);
+    assert(count_substr(json, "\"name\":\"dequeue\"") == TRACE_TASKS);
+    assert(count_substr(json, "\"name\":\"task\",\"ph\":\"B\"") == TRACE_TASKS);
+    assert(count_substr(json, "\"name\":\"task\",\"ph\":\"E\"") == TRACE_TASKS);
+    assert(count_substr(json, "\"name\":\"park\",\"ph\":\"B\"") ==
+           count_substr(json, "\"name\":\"park\",\"ph\":\"E\""));
+    free(json);
+    
+    // Restarted workers take over the rings of those before them.
+    uint32_t rings = pool->trace->ring_count;
+    for (int i = 0; i < 3; i++) {
+        workerpool_start(pool);
+        workerpool_stop(pool);
+    }
+    assert(pool->trace->ring_count == rings);
+    
+    // Threads outside the pool exiting leave their ring to the next one.
+    workerpool_start(pool);
+    for (int i = 0; i < 3; i++) {
+        pthread_t thread;
+        assert(pthread_create(&thread, NULL, trace_producer_func, pool) == 0);
+        pthread_join(thread, NULL);
+    }
+    workerpool_stop(pool);
+    assert(pool->trace->ring_count <= rings + 1);
+#else
+    assert(workerpool_trace_dump(pool, out) == -1);
+#endif
+    fclose(out);
+    workerpool_destroy(pool);
+}
+
+#ifdef WORKERPOOL_TRACE
+static void* trace_producer_func(void *arg) {
+    assert(workerpool_task_put((workerpool_t*)arg, stats_sleep_func, NULL) == 0);
+    return NULL;
+}
+
+static int count_substr(const char *str, const char *sub) {
+    
+    int count = 0;
+    size_t length = strlen(sub);
+    while ((str = strstr(str, sub)) != NULL) {
+        count++;
+        str += length;
+    }
+    return count;
+}
+#endif
+
+static void test_affinity() {
+    
+    printf("Test affinity.\n");
+    
+    // Placement on a made up two node machine, added out of order.
+    pooltopology_t *topology = pooltopology_new();
+    pooltopology_init(topology);
+    assert(pooltopology_add(topology, 1, 2) == 0);
+    assert(pooltopology_add(topology, 0, 0) == 0);
+    assert(pooltopology_add(topology, 1, 3) == 0);
+    assert(pooltopology_add(topology, 0, 1) == 0);
+    assert(topology->node_count == 2 && topology->cpu_count == 4);
+    assert(pooltopology_node_of(topology, 3) == 1);
+    assert(pooltopology_node_of(topology, 9) == -1);
+    int compact[] = { 0, 1, 2, 3 };
+    int scatter[] = { 0, 2, 1, 3 };
+    for (uint i = 0; i < 4; i++) {
+        uint node;
+        assert(pooltopology_place(topology, i, 0, &node) == compact[i] && node == i / 2);
+        assert(pooltopology_place(topology, i, 1, &node) == scatter[i] && node == i % 2);
+    }
+    pooltopology_destroy(topology);
+    
+    topology = pooltopology_new();
+    pooltopology_init(topology);
+    assert(pooltopology_detect(topology) == 0);
+    assert(topology->cpu_count > 0 && topology->node_count > 0);
+    pooltopology_destroy(topology);
+    
+    // Pinned workers run on the listed cpu only.
+    int cpu = sched_getcpu();
+    assert(cpu >= 0);
+    workerpool_options_t options;
+    workerpool_options_init(&options);
+    options.poolsize = 2;
+    options.buffersize = AFFINITY_TASKS;
+    options.affinity = AFFINITY_LIST;
+    options.cpus = &cpu;
+    options.cpu_count = 1;
+    workerpool_t *pool = workerpool_new();
+    workerpool_init_options(pool, &options);
+    affinity_check_t check = { .pool = pool, .cpu = cpu, .node = 0 };
+    atomic_init(&check.done, 0);
+    atomic_init(&check.wrong, 0);
+    workerpool_start(pool);
+    for (int i = 0; i < AFFINITY_TASKS; i++) {
+        assert(workerpool_task_put(pool, affinity_check_func, &check) == 0);
+    }
+    workerpool_stop(pool);
+    assert(atomic_load(&check.done) == AFFINITY_TASKS);
+    assert(atomic_load(&check.wrong) == 0);
+    workerpool_destroy(pool);
+    
+    // All workers sit on node 1 while tasks are put to node 0,
+    // so every task is taken across nodes.
+    topology = pooltopology_new();
+    pooltopology_init(topology);
+    pooltopology_add(topology, 0, cpu);
+    pooltopology_add(topology, 1, ABSENT_CPU);
+    int absent = ABSENT_CPU;
+    for (int schedule = SCHEDULE_FIFO; schedule <= SCHEDULE_STEALING; schedule++) {
+        options.schedule = (pool_schedule_t)schedule;
+        options.numa = 1;
+        options.topology = topology;
+        options.cpus = &absent;
+        pool = workerpool_new();
+        workerpool_init_options(pool, &options);
+        check.pool = pool;
+        check.cpu = -1;
+        check.node = 1;
+        atomic_store(&check.done, 0);
+        workerpool_start(pool);
+        assert(workerpool_current_node(pool) == 0);
+        for (int i = 0; i < AFFINITY_TASKS; i++) {
+            assert(workerpool_task_put(pool, affinity_check_func, &check) == 0);
+        }
+        while (atomic_load(&check.done) < AFFINITY_TASKS) {
+            usleep(1000);
+        }
+        workerpool_stop(pool);
+        assert(atomic_load(&check.wrong) == 0);
+        workerpool_destroy(pool);
+    }
+    pooltopology_destroy(topology);
+}
+
+static void affinity_check_func(void *arg) {
+    affinity_check_t *check = (affinity_check_t*)arg;
+    if ((check->cpu >= 0 && sched_getcpu() != check->cpu) ||
+        workerpool_current_node(check->pool) != check->node) {
+        atomic_fetch_add(&check->wrong, 1);
+    }
+    atomic_fetch_add(&check->done, 1);
+}
+
+static void test_inline() {
+    
+    printf("Test inline arguments.\n");
+    
+    // Same layout with and without statistics.
+    assert(sizeof(task_t) == CACHE_LINE_SIZE);
+    
+    workerpool_t *pool = workerpool_new();
+    workerpool_init(pool, WORKER, BUFFER_SIZE);
+    workerpool_start(pool);
+    
+    // The argument is copied, the buffer may change right after put.
+    atomic_long sum;
+    atomic_init(&sum, 0);
+    inline_arg_t arg;
+    arg.sum = &sum;
+    memset(arg.tag, 0, sizeof(arg.tag));
+    long expected = 0;
+    for (int i = 0; i < INLINE_TASKS; i++) {
+        arg.value = i;
+        snprintf(arg.tag, sizeof(arg.tag), "%d", i);
+        assert(workerpool_task_put_inline(pool, inline_sum_func, &arg, sizeof(arg)) == 0);
+        expected += i;
+    }
+    
+    // Batches carry inline arguments too.
+    task_t tasks[BATCH_SIZE];
+    for (int i = 0; i < BATCH_SIZE; i++) {
+        arg.value = i;
+        snprintf(arg.tag, sizeof(arg.tag), "%d", i);
+        assert(task_init_inline(tasks + i, inline_sum_func, &arg, sizeof(arg)) == 0);
+        expected += i;
+    }
+    assert(workerpool_task_put_batch(pool, tasks, BATCH_SIZE) == BATCH_SIZE);
+    
+    // Arguments which do not fit are refused.
+    char large[TASK_INLINE_SIZE + 1];
+    errno = 0;
+    assert(workerpool_task_put_inline(pool, inline_sum_func, large, sizeof(large)) == -1);
+    assert(errno == EINVAL);
+    
+    workerpool_stop(pool);
+    assert(atomic_load(&sum) == expected);
+    workerpool_destroy(pool);
+}
+
+static void inline_sum_func(void *ptr) {
+    inline_arg_t *arg = (inline_arg_t*)ptr;
+    assert(atol(arg->tag) == arg->value);
+    atomic_fetch_add(arg->sum, arg->value);
+}
+
+static void test_shard() {
+    
+    printf("Test sharded injection queues.\n");
+    
+    pooltopology_t *topology = pooltopology_new();
+    pooltopology_init(topology);
+    pooltopology_add(topology, 0, 0);
+    pooltopology_add(topology, 1, ABSENT_CPU);
+    
+    // Both queue backends, alone and with a shard set per node.
+    for (int config = 0; config < 4; config++) {
+        workerpool_options_t options;
+        workerpool_options_init(&options);
+        options.poolsize = WORKER;
+        options.buffersize = BUFFER_SIZE;
+        options.shards = SHARDS;
+        options.queue = config % 2 ? QUEUE_RING : QUEUE_LIST;
+        options.numa = config >= 2;
+        options.topology = topology;
+        
+        workerpool_t *pool = workerpool_new();
+        workerpool_init_options(pool, &options);
+        assert(pool->shard_count == SHARDS);
+        assert(pool->node_count == (options.numa ? 2 : 1));
+        workerpool_start(pool);
+        
+        // Producers put from their own shards at the same time.
+        atomic_store(&shard_counter, 0);
+        pthread_t producers[SHARD_PRODUCERS];
+        for (int i = 0; i < SHARD_PRODUCERS; i++) {
+            assert(pthread_create(producers + i, NULL, shard_producer_func, pool) == 0);
+        }
+        for (int i = 0; i < SHARD_PRODUCERS; i++) {
+            pthread_join(producers[i], NULL);
+        }
+        
+        // Explicit hints wrap around the shard count.
+        for (uint i = 0; i < SHARDS * 2; i++) {
+            assert(workerpool_task_put_shard(pool, i, shard_count_func, NULL) == 0);
+        }
+        
+        workerpool_stop(pool);
+        assert(atomic_load(&shard_counter) == SHARD_PRODUCERS * SHARD_TASKS + SHARDS * 2);
+        workerpool_destroy(pool);
+    }
+    pooltopology_destroy(topology);
+}
+
+static void *shard_producer_func(void *arg) {
+    workerpool_t *pool = (workerpool_t*)arg;
+    for (int i = 0; i < SHARD_TASKS; i++) {
+        assert(workerpool_task_put(pool, shard_count_func, NULL) == 0);
+    }
+    return NULL;
+}
+
+static void shard_count_func(void *arg) {
+    (void)arg;
+    atomic_fetch_add(&shard_counter, 1);
+}
+
+static void test_strand() {
+    
+    printf("Test strand.\n");
+    
+    // Batches of one yield after every task, the default drains more.
+    for (uint batch = 1; batch <= STRAND_BATCH; batch += STRAND_BATCH - 1) {
+        workerpool_t *pool = workerpool_new();
+        workerpool_init(pool, WORKER, BUFFER_SIZE);
+        workerpool_start(pool);
+        
+        taskstrand_t *strands[STRANDS];
+        strand_check_t checks[STRANDS];
+        strand_arg_t *args = (strand_arg_t*)malloc(sizeof(strand_arg_t) * STRANDS * STRAND_TASKS);
+        for (int i = 0; i < STRANDS; i++) {
+            if (batch == STRAND_BATCH) {
+                strands[i] = workerpool_strand_new(pool);
+            } else {
+                strands[i] = taskstrand_new();
+                taskstrand_init(strands[i], pool, batch);
+            }
+            atomic_init(&checks[i].running, 0);
+            checks[i].next = 0;
+            checks[i].wrong = 0;
+        }
+        
+        // Interleave strands so they all run at the same time.
+        for (int seq = 0; seq < STRAND_TASKS; seq++) {
+            for (int i = 0; i < STRANDS; i++) {
+                strand_arg_t *arg = args + seq * STRANDS + i;
+                arg->check = checks + i;
+                arg->seq = seq;
+                assert(taskstrand_put(strands[i], strand_check_func, arg) == 0);
+            }
+        }
+        
+        workerpool_stop(pool);
+        for (int i = 0; i < STRANDS; i++) {
+            assert(taskstrand_pending(strands[i]) == 0);
+            assert(checks[i].next == STRAND_TASKS);
+            assert(checks[i].wrong == 0);
+            taskstrand_destroy(strands[i]);
+        }
+        free(args);
+        workerpool_destroy(pool);
+    }
+}
+
+static void strand_check_func(void *ptr) {
+    strand_arg_t *arg = (strand_arg_t*)ptr;
+    strand_check_t *check = arg->check;
+    if (atomic_fetch_add(&check->running, 1) != 0 || check->next != arg->seq) {
+        check->wrong++;
+    }
+    check->next++;
+    sched_yield();
+    atomic_fetch_sub(&check->running, 1);
+}
+
+static void test_shutdown() {
+    
+    printf("Test shutdown.\n");
+    
+    // Drained before the deadline, nothing is left over.
+    workerpool_t *pool = workerpool_new();
+    workerpool_init(pool, WORKER, BUFFER_SIZE);
+    workerpool_start(pool);
+    atomic_store(&shutdown_ran, 0);
+    atomic_store(&shutdown_cancelled, 0);
+    for (int i = 0; i < SHUTDOWN_TASKS; i++) {
+        assert(workerpool_task_put(pool, shutdown_count_func, NULL) == 0);
+    }
+    assert(workerpool_shutdown(pool, 1000 * MSEC, shutdown_cancel_func) == 0);
+    assert(workerpool_status(pool) == STOP);
+    assert(atomic_load(&shutdown_ran) == SHUTDOWN_TASKS);
+    assert(atomic_load(&shutdown_cancelled) == 0);
+    
+    // A closed pool refuses tasks until it is started again.
+    errno = 0;
+    assert(workerpool_task_put(pool, shutdown_count_func, NULL) == -1);
+    assert(errno == ECANCELED);
+    workerpool_start(pool);
+    assert(workerpool_task_put(pool, shutdown_count_func, NULL) == 0);
+    workerpool_stop(pool);
+    assert(atomic_load(&shutdown_ran) == SHUTDOWN_TASKS + 1);
+    workerpool_destroy(pool);
+    
+    // Past the deadline the rest is cancelled, and a producer waiting for
+    // buffer space gives up. The buffer takes longer to run than that.
+    pool = workerpool_new();
+    workerpool_init(pool, 1, BUFFER_SIZE);
+    workerpool_start(pool);
+    atomic_store(&shutdown_ran, 0);
+    shutdown_producer_t producer = { .pool = pool, .accepted = 0, .error = 0 };
+    pthread_t thread;
+    assert(pthread_create(&thread, NULL, shutdown_producer_func, &producer) == 0);
+    usleep(5 * 1000);
+    int left = workerpool_shutdown(pool, 10 * MSEC, shutdown_cancel_func);
+    pthread_join(thread, NULL);
+    assert(producer.error == ECANCELED);
+    assert(left > 0);
+    assert(left == atomic_load(&shutdown_cancelled));
+    assert(atomic_load(&shutdown_ran) + left == producer.accepted);
+    workerpool_destroy(pool);
+    
+    // A batch put waiting for ring space keeps the tasks it put so far and
+    // says how many, the caller still owns the rest.
+    workerpool_options_t options;
+    workerpool_options_init(&options);
+    options.poolsize = 1;
+    options.buffersize = BUFFER_SIZE;
+    options.queue = QUEUE_RING;
+    pool = workerpool_new();
+    workerpool_init_options(pool, &options);
+    workerpool_start(pool);
+    atomic_store(&shutdown_ran, 0);
+    atomic_store(&shutdown_cancelled, 0);
+    producer = (shutdown_producer_t){ .pool = pool, .accepted = 0, .error = 0 };
+    assert(pthread_create(&thread, NULL, shutdown_batch_func, &producer) == 0);
+    usleep(5 * 1000);
+    left = workerpool_shutdown(pool, 10 * MSEC, shutdown_cancel_func);
+    pthread_join(thread, NULL);
+    assert(producer.error == ECANCELED);
+    assert(producer.accepted >= BUFFER_SIZE && producer.accepted < BATCH_SIZE);
+    assert(left == atomic_load(&shutdown_cancelled));
+    assert(atomic_load(&shutdown_ran) + left == producer.accepted);
+    workerpool_destroy(pool);
+    
+    // Past the deadline a future, group members and a strand never reach
+    // the callback as such. The future is cancelled and its waiter woken,
+    // the group counts down and the strand is idle for the next start.
+    pool = workerpool_new();
+    workerpool_init(pool, 1, SHUTDOWN_TASKS);
+    workerpool_start(pool);
+    atomic_store(&shutdown_ran, 0);
+    atomic_store(&shutdown_cancelled, 0);
+    atomic_store(&prio_gate, 0);
+    assert(workerpool_task_put(pool, prio_gate_func, NULL) == 0);
+    while (atomic_load(&prio_gate) == 0) {
+        sched_yield();
+    }
+    taskfuture_t *future = workerpool_task_submit(pool, shutdown_future_func, NULL);
+    assert(future != NULL);
+    taskgroup_t *group = taskgroup_new();
+    taskgroup_init(group);
+    taskstrand_t *strand = workerpool_strand_new(pool);
+    for (int i = 0; i < BUFFER_SIZE; i++) {
+        assert(workerpool_group_put(pool, group, shutdown_count_func, NULL) == 0);
+        assert(taskstrand_put(strand, shutdown_count_func, NULL) == 0);
+    }
+    pthread_t releaser;
+    assert(pthread_create(&thread, NULL, shutdown_wait_func, future) == 0);
+    assert(pthread_create(&releaser, NULL, shutdown_release_func, NULL) == 0);
+    left = workerpool_shutdown(pool, 5 * MSEC, shutdown_cancel_func);
+    pthread_join(releaser, NULL);
+    pthread_join(thread, NULL);
+    assert(left == BUFFER_SIZE + 2);
+    assert(atomic_load(&shutdown_cancelled) == BUFFER_SIZE * 2);
+    assert(atomic_load(&shutdown_ran) == 0);
+    assert(taskfuture_is_cancelled(future));
+    assert(taskfuture_wait(future) == NULL);
+    taskfuture_release(future);
+    taskgroup_wait(group);
+    assert(taskgroup_pending(group) == 0);
+    taskgroup_destroy(group);
+    assert(taskstrand_pending(strand) == 0);
+    workerpool_start(pool);
+    assert(taskstrand_put(strand, shutdown_count_func, NULL) == 0);
+    workerpool_stop(pool);
+    assert(atomic_load(&shutdown_ran) == 1);
+    taskstrand_destroy(strand);
+    workerpool_destroy(pool);
+    
+    // Without a callback tasks stay queued for the next start.
+    pool = workerpool_new();
+    workerpool_init(pool, WORKER, BUFFER_SIZE);
+    atomic_store(&shutdown_ran, 0);
+    for (int i = 0; i < BUFFER_SIZE; i++) {
+        assert(workerpool_task_put(pool, shutdown_count_func, NULL) == 0);
+    }
+    assert(workerpool_shutdown(pool, 0, NULL) == BUFFER_SIZE);
+    workerpool_start(pool);
+    workerpool_stop(pool);
+    assert(atomic_load(&shutdown_ran) == BUFFER_SIZE);
+    workerpool_destroy(pool);
+}
+
+static void *shutdown_producer_func(void *arg) {
+    shutdown_producer_t *producer = (shutdown_producer_t*)arg;
+    while (workerpool_task_put(producer->pool, shutdown_count_func, (void*)1) == 0) {
+        producer->accepted++;
+    }
+    producer->error = errno;
+    return NULL;
+}
+
+static void *shutdown_batch_func(void *arg) {
+    shutdown_producer_t *producer = (shutdown_producer_t*)arg;
+    task_t tasks[BATCH_SIZE];
+    for (int i = 0; i < BATCH_SIZE; i++) {
+        tasks[i] = (task_t){ .func = shutdown_count_func, .args = (void*)1 };
+    }
+    errno = 0;
+    producer->accepted = workerpool_task_put_batch(producer->pool, tasks, BATCH_SIZE);
+    producer->error = errno;
+    return NULL;
+}
+
+static void *shutdown_future_func(void *arg) {
+    shutdown_count_func(NULL);
+    return arg;
+}
+
+static void *shutdown_wait_func(void *arg) {
+    assert(taskfuture_wait((taskfuture_t*)arg) == NULL);
+    return NULL;
+}
+
+static void *shutdown_release_func(void *arg) {
+    // Let the gate task outlast the deadline of shutdown.
+    usleep(20 * 1000);
+    atomic_store(&prio_gate, 2);
+    return arg;
+}
+
+static void shutdown_count_func(void *arg) {
+    if (arg != NULL) {
+        usleep(5 * 1000);
+    }
+    atomic_fetch_add(&shutdown_ran, 1);
+}
+
+static void shutdown_cancel_func(task_t *task) {
+    assert(task->func == shutdown_count_func);
+    atomic_fetch_add(&shutdown_cancelled, 1);
+}
+
+static void test_graph() {
+    
+    printf("Test graph.\n");
+    
+    // Every node of a layer depends on all nodes of the layer before.
+    taskgraph_t *graph = taskgraph_new();
+    taskgraph_init(graph);
+    int layers[GRAPH_LAYERS * GRAPH_WIDTH];
+    for (int l = 0; l < GRAPH_LAYERS; l++) {
+        for (int i = 0; i < GRAPH_WIDTH; i++) {
+            layers[l * GRAPH_WIDTH + i] = l;
+            int id = taskgraph_add_node(graph, graph_node_func, layers + l * GRAPH_WIDTH + i);
+            assert(id == l * GRAPH_WIDTH + i);
+            for (int j = 0; l > 0 && j < GRAPH_WIDTH; j++) {
+                assert(taskgraph_add_edge(graph, (uint)((l - 1) * GRAPH_WIDTH + j), (uint)id) == 0);
+            }
+        }
+    }
+    
+    // The same graph runs many times on both schedules.
+    atomic_store(&graph_wrong, 0);
+    for (int schedule = 0; schedule < 2; schedule++) {
+        workerpool_options_t options;
+        workerpool_options_init(&options);
+        options.poolsize = WORKER;
+        options.buffersize = BUFFER_SIZE;
+        options.schedule = schedule ? SCHEDULE_STEALING : SCHEDULE_FIFO;
+        workerpool_t *pool = workerpool_new();
+        workerpool_init_options(pool, &options);
+        workerpool_start(pool);
+        for (int run = 0; run < GRAPH_RUNS; run++) {
+            for (int l = 0; l < GRAPH_LAYERS; l++) {
+                atomic_store(&graph_layer_done[l], 0);
+            }
+            assert(workerpool_run_graph(pool, graph) == 0);
+            for (int l = 0; l < GRAPH_LAYERS; l++) {
+                assert(atomic_load(&graph_layer_done[l]) == GRAPH_WIDTH);
+            }
+        }
+        
+        // A cycle is refused before anything runs.
+        if (schedule == 1) {
+            assert(taskgraph_add_edge(graph, GRAPH_LAYERS * GRAPH_WIDTH - 1, 0) == 0);
+            assert(workerpool_run_graph(pool, graph) == -1);
+        }
+        workerpool_stop(pool);
+        workerpool_destroy(pool);
+    }
+    assert(atomic_load(&graph_wrong) == 0);
+    assert(atomic_load(&graph_layer_done[0]) == GRAPH_WIDTH);
+    taskgraph_destroy(graph);
+}
+
+static void graph_node_func(void *arg) {
+    int layer = *(int*)arg;
+    if (layer > 0 && atomic_load(&graph_layer_done[layer - 1]) != GRAPH_WIDTH) {
+        atomic_fetch_add(&graph_wrong, 1);
+    }
+    atomic_fetch_add(&graph_layer_done[layer], 1);
+}
+
+static void test_loop() {
+    
+    printf("Test parallel loops.\n");
+    
+    loop_check_t check;
+    check.marks = (atomic_uchar*)calloc(LOOP_SIZE, sizeof(atomic_uchar));
+    atomic_init(&check.wrong, 0);
+    
+    // Both schedules with a set grain, and a stopped pool where the caller
+    // does all of the work.
+    for (int config = 0; config < 3; config++) {
+        workerpool_options_t options;
+        workerpool_options_init(&options);
+        options.poolsize = WORKER;
+        options.buffersize = BUFFER_SIZE;
+        options.schedule = config == 1 ? SCHEDULE_STEALING : SCHEDULE_FIFO;
+        workerpool_t *pool = workerpool_new();
+        workerpool_init_options(pool, &options);
+        if (config < 2) {
+            workerpool_start(pool);
+        }
+        
+        memset(check.marks, 0, LOOP_SIZE);
+        check.grain = LOOP_GRAIN;
+        assert(workerpool_parallel_for(pool, 0, LOOP_SIZE, LOOP_GRAIN, loop_mark_func, &check) == 0);
+        for (size_t i = 0; i < LOOP_SIZE; i++) {
+            assert(atomic_load(check.marks + i) == 1);
+        }
+        
+        // Empty ranges return at once.
+        assert(workerpool_parallel_for(pool, 5, 5, LOOP_GRAIN, loop_mark_func, &check) == 0);
+        
+        uint64_t zero = 0, sum = 0;
+        assert(workerpool_parallel_reduce(pool, 0, LOOP_SIZE, 0, loop_sum_func, loop_join_func,
+                                          &zero, &sum, sizeof(uint64_t), NULL) == 0);
+        assert(sum == (uint64_t)LOOP_SIZE * (LOOP_SIZE - 1) / 2);
+        
+        workerpool_stop(pool);
+        workerpool_destroy(pool);
+    }
+    assert(atomic_load(&check.wrong) == 0);
+    free(check.marks);
+}
+
+static void loop_mark_func(size_t begin, size_t end, void *ctx) {
+    loop_check_t *check = (loop_check_t*)ctx;
+    if (end - begin > check->grain) {
+        atomic_fetch_add(&check->wrong, 1);
+    }
+    for (size_t i = begin; i < end; i++) {
+        atomic_fetch_add(check->marks + i, 1);
+    }
+}
+
+static void loop_sum_func(size_t begin, size_t end, void *partial, void *ctx) {
+    (void)ctx;
+    uint64_t *sum = (uint64_t*)partial;
+    for (size_t i = begin; i < end; i++) {
+        *sum += i;
+    }
+}
+
+static void loop_join_func(void *result, const void *partial, void *ctx) {
+    (void)ctx;
+    *(uint64_t*)result += *(const uint64_t*)partial;
+}
+
+static void test_take_batch() {
+    
+    printf("Test batch take.\n");
+    
+    // Batches keep the order of the queue.
+    taskqueue_t *queue = taskqueue_new();
+    taskqueue_init(queue);
+    for (int i = 0; i < BATCH_SIZE; i++) {
+        assert(taskqueue_put(queue, take_count_func, (void*)(intptr_t)i) == i + 1);
+    }
+    task_t tasks[BATCH_SIZE];
+    assert(taskqueue_take_batch(queue, tasks, 8) == 8);
+    assert(taskqueue_take_batch(queue, tasks + 8, BATCH_SIZE) == BATCH_SIZE - 8);
+    assert(taskqueue_take_batch(queue, tasks, BATCH_SIZE) == 0);
+    assert(taskqueue_size(queue) == 0 && queue->first == NULL && queue->last == NULL);
+    for (int i = 0; i < BATCH_SIZE; i++) {
+        assert(tasks[i].args == (void*)(intptr_t)i);
+    }
+    
+    // Tasks put back in front are taken again first, in their order.
+    assert(taskqueue_put_batch(queue, tasks + 8, BATCH_SIZE - 8) == BATCH_SIZE - 8);
+    assert(taskqueue_put_front_batch(queue, tasks, 8) == BATCH_SIZE);
+    for (int i = 0; i < BATCH_SIZE; i++) {
+        task_t task;
+        assert(taskqueue_take(queue, &task) == 0 && task.args == (void*)(intptr_t)i);
+    }
+    assert(taskqueue_put_front_batch(queue, tasks, 1) == 1 && queue->last == queue->first);
+    
+    // Skipped tasks keep their place.
+    assert(taskqueue_put_batch(queue, tasks + 1, 3) == 4);
+    task_t task;
+    assert(taskqueue_take_unless(queue, &task, take_odd_skip) == 0 && task.args == (void*)(intptr_t)0);
+    assert(taskqueue_take_unless(queue, &task, take_odd_skip) == 0 && task.args == (void*)(intptr_t)2);
+    assert(taskqueue_take_unless(queue, &task, take_odd_skip) == -1);
+    assert(taskqueue_take(queue, &task) == 0 && task.args == (void*)(intptr_t)1);
+    assert(taskqueue_take(queue, &task) == 0 && task.args == (void*)(intptr_t)3);
+    assert(taskqueue_size(queue) == 0 && queue->first == NULL && queue->last == NULL);
+    taskqueue_destroy(queue);
+    
+    // Tasks a worker took at once but did not run survive a pause.
+    workerpool_options_t options;
+    workerpool_options_init(&options);
+    options.poolsize = 2;
+    options.buffersize = TAKE_TASKS;
+    options.take_batch = 16;
+    workerpool_t *pool = workerpool_new();
+    workerpool_init_options(pool, &options);
+    workerpool_start(pool);
+    atomic_store(&take_counter, 0);
+    for (int i = 0; i < TAKE_TASKS; i++) {
+        assert(workerpool_task_put(pool, take_count_func, NULL) == 0);
+    }
+    workerpool_pause(pool);
+    workerpool_start(pool);
+    workerpool_stop(pool);
+    assert(atomic_load(&take_counter) == TAKE_TASKS);
+    workerpool_destroy(pool);
+    
+    // A task of a higher lane runs before the rest of a batch a worker
+    // holds from a lower lane.
+    options.poolsize = 1;
+    options.aging = 0;
+    pool = workerpool_new();
+    workerpool_init_options(pool, &options);
+    atomic_store(&take_gate, 0);
+    atomic_store(&take_order_next, 0);
+    assert(workerpool_task_put_prio(pool, PRIO_LOWEST, take_gate_func, NULL) == 0);
+    for (int i = 0; i < PRIO_TASKS; i++) {
+        assert(workerpool_task_put_prio(pool, PRIO_LOWEST, take_record_func, (void*)(intptr_t)PRIO_LOWEST) == 0);
+    }
+    workerpool_start(pool);
+    while (atomic_load(&take_gate) == 0) {
+        usleep(100);
+    }
+    assert(workerpool_task_put_prio(pool, PRIO_HIGHEST, take_record_func, (void*)(intptr_t)PRIO_HIGHEST) == 0);
+    atomic_store(&take_gate, 2);
+    workerpool_stop(pool);
+    assert(atomic_load(&take_order_next) == PRIO_TASKS + 1);
+    assert(take_order[0] == PRIO_HIGHEST);
+    for (int i = 1; i <= PRIO_TASKS; i++) {
+        assert(take_order[i] == PRIO_LOWEST);
+    }
+    workerpool_destroy(pool);
+}
+
+static void take_gate_func(void *arg) {
+    (void)arg;
+    atomic_store(&take_gate, 1);
+    while (atomic_load(&take_gate) != 2) {
+        usleep(100);
+    }
+}
+
+static void take_record_func(void *arg) {
+    take_order[atomic_fetch_add(&take_order_next, 1)] = (int)(intptr_t)arg;
+}
+
+static void take_count_func(void *arg) {
+    (void)arg;
+    atomic_fetch_add(&take_counter, 1);
+}
+
+static int take_odd_skip(const task_t *task) {
+    return (intptr_t)task->args % 2;
+}
+
+static void test_events() {
+    
+    printf("Test events.\n");
+    
+    // No descriptors without events.
+    workerpool_t *pool = workerpool_new();
+    workerpool_init(pool, 1, 1);
+    assert(workerpool_completion_fd(pool) == -1);
+    assert(workerpool_submission_fd(pool) == -1);
+    assert(workerpool_submission_put(pool, NULL, 0) == -1);
+    workerpool_destroy(pool);
+    
+    workerpool_options_t options;
+    workerpool_options_init(&options);
+    options.poolsize = WORKER;
+    options.buffersize = BUFFER_SIZE;
+    options.events = 1;
+    
+    // Without descriptors the pool stays invalid.
+    struct rlimit limit;
+    assert(getrlimit(RLIMIT_NOFILE, &limit) == 0);
+    struct rlimit none = { .rlim_cur = 0, .rlim_max = limit.rlim_max };
+    pool = workerpool_new();
+    assert(setrlimit(RLIMIT_NOFILE, &none) == 0);
+    workerpool_init_options(pool, &options);
+    assert(setrlimit(RLIMIT_NOFILE, &limit) == 0);
+    assert(workerpool_status(pool) == INVALID);
+    assert(workerpool_start(pool) == -1);
+    free(pool);
+    
+    pool = workerpool_new();
+    workerpool_init_options(pool, &options);
+    event_pool = pool;
+    event_loop = pthread_self();
+    event_completed = 0;
+    
+    // A batch of completions makes the descriptor readable until all ran.
+    struct pollfd fds[2] = {
+        { .fd = workerpool_completion_fd(pool), .events = POLLIN },
+        { .fd = workerpool_submission_fd(pool), .events = POLLIN },
+    };
+    assert(fds[0].fd >= 0 && fds[1].fd >= 0);
+    assert(poll(fds, 1, 0) == 0);
+    task_t completions[3];
+    for (int i = 0; i < 3; i++) {
+        completions[i] = (task_t){ .func = event_complete_func, .args = NULL };
+    }
+    assert(workerpool_completion_put_batch(pool, completions, 3) == 0);
+    assert(poll(fds, 1, 0) == 1);
+    assert(workerpool_completion_run(pool, 1) == 1);
+    assert(poll(fds, 1, 0) == 1);
+    assert(workerpool_completion_run(pool, EVENT_TASKS) == 2);
+    assert(poll(fds, 1, 0) == 0);
+    assert(event_completed == 3);
+    event_completed = 0;
+    
+    // A write landing after a clear reset the flag is still drained by
+    // the next clear.
+    poolevent_t *event = poolevent_new();
+    assert(poolevent_init(event) == 0);
+    struct pollfd raced = { .fd = poolevent_fd(event), .events = POLLIN };
+    poolevent_signal(event);
+    atomic_store(&event->signalled, 0);
+    assert(poll(&raced, 1, 0) == 1);
+    assert(poolevent_clear(event) == 1);
+    assert(poll(&raced, 1, 0) == 0);
+    assert(poolevent_clear(event) == 0);
+    poolevent_destroy(event);
+    
+    // Workers are held, so the buffer fills and the submission falls short.
+    task_t tasks[EVENT_TASKS];
+    for (int i = 0; i < EVENT_TASKS; i++) {
+        tasks[i] = (task_t){ .func = event_task_func, .args = NULL };
+    }
+    atomic_store(&event_gate, 0);
+    workerpool_start(pool);
+    int submitted = workerpool_submission_put(pool, tasks, EVENT_TASKS);
+    assert(submitted > 0 && submitted < EVENT_TASKS);
+    atomic_store(&event_gate, 1);
+    
+    // Drive submissions and completions from this thread alone.
+    while (event_completed < EVENT_TASKS) {
+        fds[1].fd = submitted < EVENT_TASKS ? workerpool_submission_fd(pool) : -1;
+        assert(poll(fds, 2, 1000) > 0);
+        if (fds[1].revents & POLLIN) {
+            int r = workerpool_submission_put(pool, tasks + submitted, EVENT_TASKS - submitted);
+            assert(r >= 0);
+            submitted += r;
+        }
+        if (fds[0].revents & POLLIN) {
+            assert(workerpool_completion_run(pool, EVENT_TASKS) >= 0);
+        }
+    }
+    assert(submitted == EVENT_TASKS);
+    
+    // A closed pool takes nothing, like a batch put.
+    assert(workerpool_shutdown(pool, 0, NULL) == 0);
+    errno = 0;
+    assert(workerpool_submission_put(pool, tasks, EVENT_TASKS) == 0 && errno == ECANCELED);
+    workerpool_destroy(pool);
+}
+
+static void event_task_func(void *arg) {
+    (void)arg;
+    while (!atomic_load(&event_gate)) {
+        usleep(100);
+    }
+    assert(workerpool_completion_put(event_pool, event_complete_func, NULL) == 0);
+}
+
+static void event_complete_func(void *arg) {
+    (void)arg;
+    assert(pthread_equal(pthread_self(), event_loop));
+    event_completed++;
+}
+
+static void test_fibers() {
+    
+    printf("Test fibers.\n");
+    
+    workerpool_options_t options;
+    workerpool_options_init(&options);
+    options.poolsize = 2;
+    options.buffersize = FIBER_TASKS;
+    options.fibers = 1;
+    workerpool_t *pool = workerpool_new();
+    workerpool_init_options(pool, &options);
+    fiber_pool = pool;
+    
+    // Outside a fiber only the thread yields.
+    assert(workerpool_yield(pool) == -1);
+    
+    // Far more tasks wait at once than there are workers.
+    fiber_gate = taskfuture_alloc(pool->futurepool, NULL, NULL);
+    atomic_store(&fiber_started, 0);
+    atomic_store(&fiber_finished, 0);
+    workerpool_start(pool);
+    for (int i = 0; i < FIBER_TASKS; i++) {
+        assert(workerpool_task_put(pool, fiber_wait_func, NULL) == 0);
+    }
+    while (atomic_load(&fiber_started) < FIBER_TASKS) {
+        usleep(1000);
+    }
+    assert(atomic_load(&fiber_finished) == 0);
+    taskfuture_complete(fiber_gate, (void*)(intptr_t)FIBER_TASKS);
+    workerpool_stop(pool);
+    assert(atomic_load(&fiber_finished) == FIBER_TASKS);
+    assert(workerpool_await(pool, fiber_gate) == (void*)(intptr_t)FIBER_TASKS);
+    taskfuture_release(fiber_gate);
+    
+    // Tasks yield and await their children, on fibers reused after restart.
+    long expected = 0;
+    for (long i = 0; i < FIBER_TASKS; i++) {
+        expected += i * i;
+    }
+    atomic_store(&fiber_sum, 0);
+    workerpool_start(pool);
+    for (int i = 0; i < FIBER_TASKS; i++) {
+        assert(workerpool_task_put(pool, fiber_parent_func, (void*)(intptr_t)i) == 0);
+    }
+    workerpool_stop(pool);
+    assert(atomic_load(&fiber_sum) == expected);
+    workerpool_destroy(pool);
+}
+
+static void fiber_wait_func(void *arg) {
+    (void)arg;
+    atomic_fetch_add(&fiber_started, 1);
+    assert(workerpool_await(fiber_pool, fiber_gate) == (void*)(intptr_t)FIBER_TASKS);
+    atomic_fetch_add(&fiber_finished, 1);
+}
+
+static void fiber_parent_func(void *arg) {
+    taskfuture_t *future = workerpool_task_submit(fiber_pool, future_square_func, arg);
+    assert(future != NULL);
+    assert(workerpool_yield(fiber_pool) == 0);
+    atomic_fetch_add(&fiber_sum, (long)workerpool_await(fiber_pool, future));
+    taskfuture_release(future);
+}